@@ -31,52 +31,117 @@
 #include <qb/qblog.h>
 #include <qb/qbmap.h>
 #include <libxml/parser.h>
-#include <libxslt/transform.h>
 #include <assert.h>
+#include <fcntl.h>
 
 #include "cape.h"
 #include "trans.h"
+#include "cf2pe.h"
+#include "pool.h"
+#include "pe_dump.h"
 
-static struct application *application;
+static QB_LIST_DECLARE(application_head);
 
-static qb_map_t *assembly_map;
+static QB_LIST_DECLARE(op_stats_head);
 
-static qb_map_t *op_history_map;
+static struct latency_histogram queue_wait[CAPE_PRIO_MAX];
+
+static const char *prio_names[CAPE_PRIO_MAX] = {
+	"recovery",
+	"routine",
+};
 
 static int call_order = 0;
 
+static struct timer_wheel monitor_wheel;
+
 static int cape_debug = 0;
 
 static char crmd_uuid[37];
 
-static xmlDocPtr _pe = NULL;
+static char checkpoint_dir[PATH_MAX];
 
-static xmlDocPtr _config = NULL;
+static struct cape_cloud_limits cloud_limits = {
+	.concurrency = CLOUD_OP_CONCURRENCY,
+	.rate = CLOUD_OP_RATE,
+	.burst = CLOUD_OP_BURST,
+};
 
 struct operation_history {
 	char *rsc_id;
-	char *operation;
+	const char *operation;
 	uint32_t call_id;
 	uint32_t interval;
 	enum ocf_exitcode rc;
 	uint32_t target_outcome;
 	time_t last_run;
 	time_t last_rc_change;
+	uint32_t rc_changes;
 	uint32_t graph_id;
 	uint32_t action_id;
-	char *op_digest;
+	int pending;		/* sent to the assembly, no result yet */
+	const char *op_digest;
 	struct resource *resource;
+	xmlNode *resource_xml;
+	xmlNode *op_xml;
+	struct qb_list_head status_dirty_list;
+};
+
+/*
+ * Policy engine runs are coalesced: a burst of state changes marks the
+ * policy domain dirty and results in a single process() once the settle
+ * window has passed without further changes (bounded by max_latency).
+ *
+ * There is only one policy engine, policy domains that are due are queued
+ * on run_head and get their turn in order.
+ */
+static struct {
+	uint32_t settle_msec;
+	uint32_t max_latency_msec;
+	struct policy_domain *running;
+	struct qb_list_head run_head;
+	struct cape_process_stats stats;
+} process_sched = {
+	.settle_msec = PROCESS_SETTLE_TIMEOUT,
+	.max_latency_msec = PROCESS_MAX_LATENCY,
+	.run_head = { &process_sched.run_head, &process_sched.run_head },
 };
 
 
 static void resource_monitor_execute(void * data);
 
+static void resource_monitor_expired(void *data, uint64_t late_msec);
+
 static void recurring_monitor_stop(struct pe_operation *op);
 
-static void schedule_processing(void);
+static void schedule_processing(struct policy_domain *d);
 
-static void op_history_save(struct resource *resource, struct pe_operation *op,
-	enum ocf_exitcode ec)
+static void schedule_replan(struct policy_domain *d);
+
+static void orphans_free(struct application *app);
+
+static void checkpoint_schedule(struct application *app);
+
+static void assembly_status_dirty(struct assembly *assembly)
+{
+	if (qb_list_empty(&assembly->status_dirty_list)) {
+		qb_list_add_tail(&assembly->status_dirty_list,
+				 &assembly->application->assembly_dirty_head);
+	}
+	checkpoint_schedule(assembly->application);
+}
+
+static void op_history_dirty(struct operation_history *oh)
+{
+	if (qb_list_empty(&oh->status_dirty_list)) {
+		qb_list_add_tail(&oh->status_dirty_list,
+				 &oh->resource->assembly->application->op_history_dirty_head);
+	}
+	checkpoint_schedule(oh->resource->assembly->application);
+}
+
+static struct operation_history *op_history_get(struct resource *resource,
+	struct pe_operation *op)
 {
 	struct operation_history *oh;
 	/*
@@ -84,67 +149,139 @@ static void op_history_save(struct resource *resource, struct pe_operation *op,
 	 */
 	char buffer[RESOURCE_NAME_MAX + METHOD_NAME_MAX + OP_NAME_MAX + 3];
 
-	qb_enter();
-
 	snprintf(buffer,
 		RESOURCE_NAME_MAX + METHOD_NAME_MAX + OP_NAME_MAX + 3,
 		"%s_%s_%d", op->rname, op->method, op->interval);
 
-	oh = qb_map_get(op_history_map, buffer);
+	oh = qb_map_get(resource->op_history_map, buffer);
 	if (oh == NULL) {
 		oh = (struct operation_history *)calloc(1, sizeof(struct operation_history));
 		oh->resource = resource;
 		oh->rsc_id = strdup(buffer);
-		oh->operation = strdup(op->method);
+		oh->operation = intern_get(op->method);
 		oh->target_outcome = op->target_outcome;
 		oh->interval = op->interval;
 		oh->rc = OCF_PENDING;
-		oh->op_digest = strdup(op->op_digest);
-		qb_map_put(op_history_map, oh->rsc_id, oh);
+		oh->op_digest = intern_get(op->op_digest);
+		qb_list_init(&oh->status_dirty_list);
+		qb_map_put(resource->op_history_map, oh->rsc_id, oh);
 	} else
-	if (strcmp(oh->op_digest, op->op_digest) != 0) {
-		free(oh->op_digest);
-		oh->op_digest = op->op_digest;
+	if (oh->op_digest != op->op_digest) {
+		intern_put(oh->op_digest);
+		oh->op_digest = intern_get(op->op_digest);
 	}
+	return oh;
+}
+
+static void op_history_save(struct resource *resource, struct pe_operation *op,
+	enum ocf_exitcode ec)
+{
+	struct operation_history *oh;
+
+	qb_enter();
+
+	oh = op_history_get(resource, op);
         if (oh->rc != ec) {
                 oh->last_rc_change = time(NULL);
                 oh->rc = ec;
+                oh->rc_changes++;
         }
 
         oh->last_run = time(NULL);
         oh->call_id = call_order++;
         oh->graph_id = op->graph_id;
         oh->action_id = op->action_id;
+	oh->pending = QB_FALSE;
+
+	op_history_dirty(oh);
+
+	qb_leave();
+}
+
+/*
+ * A start or stop on its way to the assembly is in the status as in
+ * progress, a transition aborted meanwhile is replanned knowing about it
+ * and does not send it again.
+ */
+static void op_history_pending(struct resource *resource, struct pe_operation *op)
+{
+	struct operation_history *oh;
+
+	qb_enter();
+
+	oh = op_history_get(resource, op);
+	oh->last_run = time(NULL);
+	oh->call_id = call_order++;
+	oh->graph_id = op->graph_id;
+	oh->action_id = op->action_id;
+	oh->pending = QB_TRUE;
+
+	op_history_dirty(oh);
 
 	qb_leave();
 }
 
-static void xml_new_int_prop(xmlNode *n, const char *name, int32_t val)
+static void op_history_free(struct operation_history *oh)
+{
+	qb_enter();
+
+	qb_list_del(&oh->status_dirty_list);
+	if (oh->resource_xml) {
+		xmlUnlinkNode(oh->resource_xml);
+		xmlFreeNode(oh->resource_xml);
+	}
+	free(oh->rsc_id);
+	intern_put(oh->operation);
+	intern_put(oh->op_digest);
+	free(oh);
+
+	qb_leave();
+}
+
+static void xml_set_int_prop(xmlNode *n, const char *name, int32_t val)
 {
 	char int_str[36];
 
 	qb_enter();
 
 	snprintf(int_str, 36, "%d", val);
-	xmlNewProp(n, BAD_CAST name, BAD_CAST int_str);
+	xmlSetProp(n, BAD_CAST name, BAD_CAST int_str);
 
 	qb_leave();
 }
 
-static void xml_new_time_prop(xmlNode *n, const char *name, time_t val)
+static void xml_set_time_prop(xmlNode *n, const char *name, time_t val)
 {
         char int_str[36];
 
 	qb_enter();
 
         snprintf(int_str, 36, "%d", (int)val);
-        xmlNewProp(n, BAD_CAST name, BAD_CAST int_str);
+        xmlSetProp(n, BAD_CAST name, BAD_CAST int_str);
+
+	qb_leave();
+}
+
+static xmlNode *insert_resource(xmlNode *status, struct resource *resource)
+{
+	xmlNode *resource_xml;
+
+	qb_enter();
+
+	resource_xml = xmlNewChild (status, NULL, BAD_CAST "lrm_resource", NULL);
+	xmlNewProp(resource_xml, BAD_CAST "id", BAD_CAST resource->name);
+	xmlNewProp(resource_xml, BAD_CAST "type", BAD_CAST resource->type);
+	xmlNewProp(resource_xml, BAD_CAST "class", BAD_CAST resource->rclass);
+	if (resource->rclass == intern_ocf) {
+		xmlNewProp(resource_xml, BAD_CAST "provider", BAD_CAST resource->rprovider);
+	}
 
 	qb_leave();
+
+	return resource_xml;
 }
 
-static void op_history_insert(xmlNode *resource_xml,
-	struct operation_history *oh)
+static void op_history_insert(struct operation_history *oh)
 {
 	xmlNode *op;
 	char key[255];
@@ -152,30 +289,38 @@ static void op_history_insert(xmlNode *resource_xml,
 
 	qb_enter();
 
-	op = xmlNewChild(resource_xml, NULL, BAD_CAST "lrm_rsc_op", NULL);
+	if (oh->resource_xml == NULL) {
+		oh->resource_xml = insert_resource(oh->resource->assembly->lrm_resources_xml,
+						   oh->resource);
+		oh->op_xml = xmlNewChild(oh->resource_xml, NULL,
+					 BAD_CAST "lrm_rsc_op", NULL);
+		xmlNewProp(oh->op_xml, BAD_CAST "id", BAD_CAST oh->rsc_id);
+		xmlNewProp(oh->op_xml, BAD_CAST "operation", BAD_CAST oh->operation);
+		xml_set_int_prop(oh->op_xml, "interval", oh->interval);
+		xmlNewProp(oh->op_xml, BAD_CAST "crm-debug-origin", BAD_CAST __func__);
+		xmlNewProp(oh->op_xml, BAD_CAST "crm_feature_set", BAD_CAST PE_CRM_VERSION);
+		xmlNewProp(oh->op_xml, BAD_CAST "exec-time", BAD_CAST "0");
+		xmlNewProp(oh->op_xml, BAD_CAST "queue-time", BAD_CAST "0");
+	}
+	op = oh->op_xml;
 
-	xmlNewProp(op, BAD_CAST "id", BAD_CAST oh->rsc_id);
-	xmlNewProp(op, BAD_CAST "operation", BAD_CAST oh->operation);
-	xml_new_int_prop(op, "call-id", oh->call_id);
-	xml_new_int_prop(op, "rc-code", oh->rc);
-	xml_new_int_prop(op, "interval", oh->interval);
-	xml_new_time_prop(op, "last-run", oh->last_run);
-	xml_new_time_prop(op, "last-rc-change", oh->last_rc_change);
+	xml_set_int_prop(op, "call-id", oh->call_id);
+	xml_set_int_prop(op, "op-status", oh->pending ? PE_OP_STATUS_PENDING : 0);
+	xml_set_int_prop(op, "rc-code", oh->rc);
+	xml_set_time_prop(op, "last-run", oh->last_run);
+	xml_set_time_prop(op, "last-rc-change", oh->last_rc_change);
 
 	snprintf(key, 255, "%d:%d:%d:%s",
 		oh->action_id, oh->graph_id, oh->target_outcome, crmd_uuid);
 
-	xmlNewProp(op, BAD_CAST "transition-key", BAD_CAST key);
+	xmlSetProp(op, BAD_CAST "transition-key", BAD_CAST key);
 
-	snprintf(magic, 255, "0:%d:%s", oh->rc, key);
-	xmlNewProp(op, BAD_CAST "transition-magic", BAD_CAST magic);
+	snprintf(magic, 255, "%d:%d:%s",
+		oh->pending ? PE_OP_STATUS_PENDING : 0, oh->rc, key);
+	xmlSetProp(op, BAD_CAST "transition-magic", BAD_CAST magic);
 
-	xmlNewProp(op, BAD_CAST "op-digest", BAD_CAST oh->op_digest);
-	xmlNewProp(op, BAD_CAST "crm-debug-origin", BAD_CAST __func__);
-	xmlNewProp(op, BAD_CAST "crm_feature_set", BAD_CAST PE_CRM_VERSION);
-	xmlNewProp(op, BAD_CAST "op-status", BAD_CAST "0");
-	xmlNewProp(op, BAD_CAST "exec-time", BAD_CAST "0");
-	xmlNewProp(op, BAD_CAST "queue-time", BAD_CAST "0");
+	xmlSetProp(op, BAD_CAST "op-digest", BAD_CAST oh->op_digest);
+	oh->resource->assembly->status_version++;
 
 	qb_leave();
 }
@@ -202,7 +347,7 @@ resource_state_change_event(void* inst,
 	qb_log(LOG_INFO, "Resource (%s): changing state from %s to %s",
 	       r->name, state_name_str[from], state_name_str[to]);
 
-	cape_admin_event_send(application->name, r->assembly, r,
+	cape_admin_event_send(r->assembly->application->name, r->assembly, r,
 			      state_str[from][to],
 			      "bla");
 	qb_leave();
@@ -214,7 +359,7 @@ static void resource_recover_restart(void * inst)
 
 	qb_enter();
 
-	qb_loop_timer_del(NULL, resource->monitor_timer);
+	timer_wheel_del(&monitor_wheel, &resource->monitor_timer);
 
 	qb_leave();
 }
@@ -228,46 +373,74 @@ static void resource_recover_escalate(void * inst)
 	qb_log(LOG_NOTICE, "Escalating failure of service %s to node %s:%s",
 	       r->name, r->assembly->uuid, r->assembly->name);
 
-	qb_loop_timer_del(NULL, r->monitor_timer);
+	timer_wheel_del(&monitor_wheel, &r->monitor_timer);
 
 	instance_destroy(r->assembly);
 
 	qb_leave();
 }
 
-static void node_op_history_clear(struct assembly *assembly)
+static void resource_op_history_clear(struct resource *r)
 {
 	qb_map_iter_t *iter;
 	struct operation_history *oh;
 	const char *key;
-	struct resource *r;
 
 	qb_enter();
 
-	iter = qb_map_iter_create(op_history_map);
+	/* stop the recurring monitor.
+	 */
+	if ((timer_wheel_is_running(&r->monitor_timer) ||
+	     r->monitor_batched) && r->monitor_op) {
+		recurring_monitor_stop(r->monitor_op);
+	}
+
+	iter = qb_map_iter_create(r->op_history_map);
 	while ((key = qb_map_iter_next(iter, (void **)&oh)) != NULL) {
-		r = oh->resource;
+		qb_map_rm(r->op_history_map, key);
+		op_history_free(oh);
+	}
+	qb_map_iter_free(iter);
+	r->assembly->status_version++;
+	checkpoint_schedule(r->assembly->application);
 
-		if (r->assembly == assembly) {
-			/* stop the recurring monitor.
-			 */
-			if (qb_loop_timer_is_running(NULL, r->monitor_timer) &&
-			    r->monitor_op) {
-				recurring_monitor_stop(r->monitor_op);
-			}
+	qb_leave();
+}
 
-			qb_map_rm(op_history_map, key);
-			free(oh->rsc_id);
-			free(oh->operation);
-			free(oh->op_digest);
-			free(oh);
-		}
+static void node_op_history_clear(struct assembly *assembly)
+{
+	qb_map_iter_t *iter;
+	struct resource *r;
+
+	qb_enter();
+
+	iter = qb_map_iter_create(assembly->resource_map);
+	while ((qb_map_iter_next(iter, (void **)&r)) != NULL) {
+		resource_op_history_clear(r);
 	}
 	qb_map_iter_free(iter);
 
 	qb_leave();
 }
 
+static void
+ref_param_value_set(struct reference_param *p, struct assembly *a)
+{
+	if (p->xmlnode == NULL) {
+		return;
+	}
+	if (strcmp(p->parameter, "hostname") == 0) {
+		/* FIXME we probably need to get
+		 * the real hostname
+		 */
+		xmlSetProp(p->xmlnode, BAD_CAST "value",
+			   BAD_CAST a->name);
+	} else {
+		xmlSetProp(p->xmlnode, BAD_CAST "value",
+			   BAD_CAST a->address);
+	}
+}
+
 /*
  * find all resources that have an ip or hostname parameter reference
  * and update them.
@@ -280,47 +453,24 @@ static void node_op_history_clear(struct assembly *assembly)
 static void
 node_update_addr_info(struct assembly *a_changed)
 {
-	struct assembly *a;
-	struct resource *r;
+	struct qb_list_head *referrers;
+	struct qb_list_head *list;
 	struct reference_param *p;
-	const char *a_name;
-	const char *r_name;
-	const char *p_name;
-	qb_map_iter_t *a_iter;
-	qb_map_iter_t *r_iter;
-	qb_map_iter_t *p_iter;
 
-	a_iter = qb_map_iter_create(assembly_map);
-	while ((a_name = qb_map_iter_next(a_iter, (void**)&a)) != NULL) {
-		r_iter = qb_map_iter_create(a->resource_map);
-		while ((r_name = qb_map_iter_next(r_iter, (void**)&r)) != NULL) {
-			if (r->ref_params_map == NULL) {
-				continue;
-			}
-			/* See if there is a reference parameter that references
-			 * the changed node.
-			 */
-			p_iter = qb_map_iter_create(r->ref_params_map);
-			while ((p_name = qb_map_iter_next(p_iter, (void**)&p)) != NULL) {
-				if (p->xmlnode &&
-				    strcmp(p->assembly, a_changed->name) == 0) {
-					if (strcmp(p->parameter, "hostname") == 0) {
-						/* FIXME we probably need to get
-						 * the real hostname
-						 */
-						xmlSetProp(p->xmlnode, BAD_CAST "value",
-							   BAD_CAST a_changed->name);
-					} else {
-						xmlSetProp(p->xmlnode, BAD_CAST "value",
-							   BAD_CAST a_changed->address);
-					}
-				}
-			}
-			qb_map_iter_free(p_iter);
-		}
-		qb_map_iter_free(r_iter);
+	referrers = qb_map_get(a_changed->application->ref_param_index,
+			       a_changed->name);
+	if (referrers == NULL) {
+		return;
+	}
+
+	qb_list_for_each(list, referrers) {
+		p = qb_list_entry(list, struct reference_param, referrer_list);
+		ref_param_value_set(p, a_changed);
+	}
+	/* the referrers are all in the same domain */
+	if (a_changed->domain) {
+		a_changed->domain->pe_edits++;
 	}
-	qb_map_iter_free(a_iter);
 }
 
 
@@ -335,7 +485,7 @@ node_state_change_event(void* inst,
 
 	qb_log(LOG_INFO, "Node (%s): changing state from %s to %s",
 	       a->name, state_name_str[from], state_name_str[to]);
-	cape_admin_event_send(application->name, a, NULL,
+	cape_admin_event_send(a->application->name, a, NULL,
 			      state_str[from][to],
 			      "bla");
 	if (to == RECOVER_STATE_RUNNING) {
@@ -345,7 +495,14 @@ node_state_change_event(void* inst,
 			qb_util_stopwatch_us_elapsed_get(a->sw_instance_connected) / QB_TIME_US_IN_MSEC);
 		node_update_addr_info(a);
 	}
-	schedule_processing();
+	assembly_status_dirty(a);
+	if (a->domain == NULL) {
+		/* retired */
+	} else if (from == RECOVER_STATE_RUNNING) {
+		schedule_replan(a->domain);
+	} else {
+		schedule_processing(a->domain);
+	}
 	qb_leave();
 }
 
@@ -381,7 +538,7 @@ resource_state_set(struct resource *r,
 		   struct pe_operation *op,
 		   enum ocf_exitcode pe_exitcode)
 {
-	if (strcmp(op->method, "monitor") == 0) {
+	if (op->method == intern_monitor) {
 		if (pe_exitcode == OCF_OK) {
 			recover_state_set(&r->recover,
 					  RECOVER_STATE_RUNNING);
@@ -392,7 +549,7 @@ resource_state_set(struct resource *r,
 			recover_state_set(&r->recover,
 					  RECOVER_STATE_FAILED);
 		}
-	} else if (strcmp(op->method, "start") == 0) {
+	} else if (op->method == intern_start) {
 		if (pe_exitcode == OCF_OK) {
 			recover_state_set(&r->recover,
 					  RECOVER_STATE_RUNNING);
@@ -403,7 +560,7 @@ resource_state_set(struct resource *r,
 			recover_state_set(&r->recover,
 					  RECOVER_STATE_UNKNOWN);
 		}
-	} else if (strcmp(op->method, "stop") == 0) {
+	} else if (op->method == intern_stop) {
 		if (pe_exitcode == OCF_OK) {
 			recover_state_set(&r->recover,
 					  RECOVER_STATE_STOPPED);
@@ -417,13 +574,107 @@ resource_state_set(struct resource *r,
 	}
 }
 
+static struct cape_op_stats *
+op_stats_find(const char *rclass, const char *method, int create)
+{
+	struct qb_list_head *list;
+	struct cape_op_stats *s;
+
+	qb_list_for_each(list, &op_stats_head) {
+		s = qb_list_entry(list, struct cape_op_stats, list);
+		if (s->rclass == rclass && s->method == method) {
+			return s;
+		}
+	}
+	if (!create) {
+		return NULL;
+	}
+
+	/*
+	 * only the first operation of each kind allocates
+	 */
+	s = calloc(1, sizeof(struct cape_op_stats));
+	s->rclass = intern_get(rclass);
+	s->method = intern_get(method);
+	latency_init(&s->latency);
+	qb_list_add_tail(&s->list, &op_stats_head);
+	return s;
+}
+
+static void
+op_stats_account(struct pe_operation *op, struct assembly *a,
+		 uint64_t elapsed_us, enum ocf_exitcode pe_exitcode)
+{
+	struct cape_op_stats *s[2];
+	int i;
+
+	s[0] = op_stats_find(op->rclass, op->method, QB_TRUE);
+	s[1] = a ? &a->op_stats : NULL;
+	for (i = 0; i < 2 && s[i]; i++) {
+		latency_record(&s[i]->latency, elapsed_us);
+		if (pe_exitcode != op->target_outcome) {
+			s[i]->failures++;
+		}
+		if (op->timeout > 0 &&
+		    elapsed_us / QB_TIME_US_IN_MSEC > op->timeout) {
+			s[i]->timeouts++;
+		}
+	}
+}
+
+enum cape_prio
+cape_op_prio_get(struct pe_operation *op)
+{
+	if (op->method == intern_monitor && op->interval > 0) {
+		return CAPE_PRIO_ROUTINE;
+	}
+	return CAPE_PRIO_RECOVERY;
+}
+
+enum qb_loop_priority
+cape_prio_loop_level(enum cape_prio prio)
+{
+	if (prio == CAPE_PRIO_RECOVERY) {
+		return QB_LOOP_MED;
+	}
+	return QB_LOOP_LOW;
+}
+
+void
+cape_queue_wait_record(enum cape_prio prio, uint64_t wait_us)
+{
+	latency_record(&queue_wait[prio], wait_us);
+}
+
+struct latency_histogram *
+cape_queue_wait_get(enum cape_prio prio)
+{
+	return &queue_wait[prio];
+}
+
+void
+resource_action_timedout(struct pe_operation *op)
+{
+	struct application *app = (struct application *)op->user_data;
+	struct assembly *a = qb_map_get(app->assembly_map, op->hostname);
+
+	qb_log(LOG_NOTICE, "%s_%s_%d [%s] on %s timed out",
+	       op->rname, op->method, op->interval, op->rclass, op->hostname);
+
+	op_stats_find(op->rclass, op->method, QB_TRUE)->timeouts++;
+	if (a) {
+		a->op_stats.timeouts++;
+	}
+}
+
 void
 resource_action_completed(struct pe_operation *op,
 			  enum ocf_exitcode pe_exitcode)
 {
 	uint64_t el;
-	struct assembly *a = qb_map_get(assembly_map, op->hostname);;
-	struct resource *r = qb_map_get(a->resource_map, op->rname);
+	struct application *app = (struct application *)op->user_data;
+	struct assembly *a = qb_map_get(app->assembly_map, op->hostname);
+	struct resource *r = a ? qb_map_get(a->resource_map, op->rname) : NULL;
 
 	qb_enter();
 
@@ -436,10 +687,22 @@ resource_action_completed(struct pe_operation *op,
 	       pe_exitcode, op->target_outcome,
 	       el / QB_TIME_US_IN_MSEC, op->timeout);
 
-	if (strstr(op->rname, op->hostname) != NULL) {
-		op_history_save(r, op, pe_exitcode);
+	op_stats_account(op, a, el, pe_exitcode);
+
+	if (r == NULL) {
+		/* a probe of a resource that does not live on this assembly,
+		 * or of an assembly removed by a reload
+		 */
+		if (op->times_executed <= 1) {
+			pe_resource_completed(op, pe_exitcode);
+		}
+		pe_resource_unref(op);
+		qb_leave();
+		return;
 	}
 
+	op_history_save(r, op, pe_exitcode);
+
 	if (op->times_executed <= 1) {
 		pe_resource_completed(op, pe_exitcode);
 	}
@@ -447,7 +710,7 @@ resource_action_completed(struct pe_operation *op,
 	resource_state_set(r, op, pe_exitcode);
 
 	if (pe_exitcode != op->target_outcome) {
-		schedule_processing();
+		schedule_replan(a->domain);
 	}
 	if (op->interval > 0) {
 		if (pe_exitcode != op->target_outcome) {
@@ -455,10 +718,11 @@ resource_action_completed(struct pe_operation *op,
 			 */
 			pe_resource_unref(op);
 		} else {
-			qb_loop_timer_add(NULL, QB_LOOP_LOW,
-					  op->interval * QB_TIME_NS_IN_MSEC, op,
-					  resource_monitor_execute,
-					  &r->monitor_timer);
+			timer_wheel_add(&monitor_wheel, &r->monitor_timer,
+					timer_wheel_phase_delay(r->name,
+						timer_wheel_msec_get(&monitor_wheel),
+						op->interval),
+					resource_monitor_expired, op);
 		}
 	} else {
 		pe_resource_unref(op);
@@ -471,12 +735,13 @@ static void
 resource_monitor_execute(void *data)
 {
 	struct pe_operation *op = (struct pe_operation *)data;
+	struct application *app = (struct application *)op->user_data;
 	struct assembly *assembly;
 	struct resource *resource;
 
 	qb_enter();
 
-	assembly = qb_map_get(assembly_map, op->hostname);
+	assembly = qb_map_get(app->assembly_map, op->hostname);
 	resource = qb_map_get(assembly->resource_map, op->rname);
 
 	if (assembly->recover.state != RECOVER_STATE_RUNNING) {
@@ -490,11 +755,125 @@ resource_monitor_execute(void *data)
 	qb_leave();
 }
 
+static void
+monitor_batch_flush(void *data)
+{
+	struct assembly *assembly = (struct assembly *)data;
+	struct pe_operation *ops[MONITOR_BATCH_MAX];
+	struct resource *resource;
+	uint32_t num_ops;
+	uint32_t i;
+
+	qb_enter();
+
+	qb_loop_timer_del(NULL, assembly->monitor_batch_timer);
+
+	/*
+	 * take the batch over as completions may queue monitors again
+	 */
+	num_ops = assembly->monitor_batch_len;
+	memcpy(ops, assembly->monitor_batch,
+	       num_ops * sizeof(struct pe_operation *));
+	assembly->monitor_batch_len = 0;
+	for (i = 0; i < num_ops; i++) {
+		resource = (struct resource *)ops[i]->resource;
+		resource->monitor_batched = QB_FALSE;
+	}
+
+	if (assembly->recover.state != RECOVER_STATE_RUNNING) {
+		qb_log(LOG_DEBUG, "can't execute resource in offline state");
+		for (i = 0; i < num_ops; i++) {
+			resource_action_completed(ops[i], OCF_UNKNOWN_ERROR);
+		}
+		qb_leave();
+		return;
+	}
+
+	for (i = 0; i < num_ops; i++) {
+		qb_util_stopwatch_start(ops[i]->time_execed);
+	}
+	if (num_ops == 1) {
+		transport_resource_action(assembly, ops[0]->resource, ops[0]);
+	} else if (num_ops > 1) {
+		qb_log(LOG_DEBUG, "sending %d monitors to %s in one batch",
+		       num_ops, assembly->name);
+		transport_resource_monitor_batch(assembly, ops, num_ops);
+	}
+
+	qb_leave();
+}
+
+/*
+ * Recurring monitors that come due close together on the same assembly
+ * are sent to it in one request.
+ */
+static void
+monitor_batch_add(struct pe_operation *op)
+{
+	struct resource *resource = (struct resource *)op->resource;
+	struct assembly *assembly = resource->assembly;
+
+	qb_enter();
+
+	assembly->monitor_batch[assembly->monitor_batch_len++] = op;
+	resource->monitor_batched = QB_TRUE;
+
+	if (assembly->monitor_batch_len == MONITOR_BATCH_MAX) {
+		monitor_batch_flush(assembly);
+	} else if (assembly->monitor_batch_len == 1) {
+		qb_loop_timer_add(NULL, QB_LOOP_LOW,
+				  MONITOR_BATCH_WINDOW * QB_TIME_NS_IN_MSEC,
+				  assembly, monitor_batch_flush,
+				  &assembly->monitor_batch_timer);
+	}
+
+	qb_leave();
+}
+
+static int
+monitor_batch_del(struct pe_operation *op)
+{
+	struct resource *resource = (struct resource *)op->resource;
+	struct assembly *assembly = resource->assembly;
+	uint32_t i;
+
+	if (!resource->monitor_batched) {
+		return QB_FALSE;
+	}
+	for (i = 0; i < assembly->monitor_batch_len; i++) {
+		if (assembly->monitor_batch[i] == op) {
+			break;
+		}
+	}
+	assert(i < assembly->monitor_batch_len);
+
+	memmove(&assembly->monitor_batch[i], &assembly->monitor_batch[i + 1],
+		(assembly->monitor_batch_len - i - 1) *
+		sizeof(struct pe_operation *));
+	assembly->monitor_batch_len--;
+	resource->monitor_batched = QB_FALSE;
+	if (assembly->monitor_batch_len == 0) {
+		qb_loop_timer_del(NULL, assembly->monitor_batch_timer);
+	}
+	return QB_TRUE;
+}
+
+static void
+resource_monitor_expired(void *data, uint64_t late_msec)
+{
+	struct pe_operation *op = (struct pe_operation *)data;
+
+	qb_log(LOG_TRACE, "%s_%s_%d on %s ran %"PRIu64"ms late",
+	       op->rname, op->method, op->interval, op->hostname, late_msec);
+
+	monitor_batch_add(op);
+}
+
 static void recurring_monitor_start(struct pe_operation *op)
 {
 	struct resource * r = (struct resource *)op->resource;
 
-	if (!qb_loop_timer_is_running(NULL, r->monitor_timer)) {
+	if (!timer_wheel_is_running(&r->monitor_timer)) {
 		pe_resource_ref(op);
 		r->monitor_op = op;
 		resource_monitor_execute(op);
@@ -509,8 +888,10 @@ static void recurring_monitor_stop(struct pe_operation *op)
 {
 	struct resource * r = (struct resource *)op->resource;
 
-	if (qb_loop_timer_is_running(NULL, r->monitor_timer)) {
-		qb_loop_timer_del(NULL, r->monitor_timer);
+	if (timer_wheel_is_running(&r->monitor_timer)) {
+		timer_wheel_del(&monitor_wheel, &r->monitor_timer);
+		pe_resource_unref(op);
+	} else if (monitor_batch_del(op)) {
 		pe_resource_unref(op);
 	}
 	r->monitor_op = NULL;
@@ -519,36 +900,12 @@ static void recurring_monitor_stop(struct pe_operation *op)
 
 static void op_history_delete(struct pe_operation *op)
 {
-	struct resource *r;
-	qb_map_iter_t *iter;
-	const char *key;
-	struct operation_history *oh;
-
 	qb_enter();
 
 	/*
-	 * Delete this resource from any operational histories
+	 * Delete this resource's operational history
 	 */
-	iter = qb_map_iter_create(op_history_map);
-	while ((key = qb_map_iter_next(iter, (void **)&oh)) != NULL) {
-		r = (struct resource *)oh->resource;
-
-		if (r == op->resource) {
-			/* stop the recurring monitor.
-			 */
-			if (qb_loop_timer_is_running(NULL, r->monitor_timer) &&
-			    r->monitor_op) {
-				recurring_monitor_stop(r->monitor_op);
-			}
-
-			qb_map_rm(op_history_map, key);
-			free(oh->rsc_id);
-			free(oh->operation);
-			free(oh->op_digest);
-			free(oh);
-		}
-	}
-	qb_map_iter_free(iter);
+	resource_op_history_clear((struct resource *)op->resource);
 
 	qb_util_stopwatch_stop(op->time_execed);
 	pe_resource_completed(op, OCF_OK);
@@ -559,12 +916,20 @@ static void op_history_delete(struct pe_operation *op)
 
 static void resource_execute_cb(struct pe_operation *op)
 {
+	struct application *app = (struct application *)op->user_data;
 	struct resource *resource;
 	struct assembly *assembly;
 
 	qb_enter();
 
-	assembly = qb_map_get(assembly_map, op->hostname);
+	assembly = qb_map_get(app->assembly_map, op->hostname);
+	if (assembly == NULL) {
+		qb_log(LOG_DEBUG, "%s_%s_%d: %s is no longer configured",
+		       op->rname, op->method, op->interval, op->hostname);
+		resource_action_completed(op, OCF_UNKNOWN_ERROR);
+		qb_leave();
+		return;
+	}
 	resource = qb_map_get(assembly->resource_map, op->rname);
 
 	if (assembly->recover.state != RECOVER_STATE_RUNNING) {
@@ -579,9 +944,8 @@ static void resource_execute_cb(struct pe_operation *op)
 	qb_util_stopwatch_start(op->time_execed);
 
 	op->resource = resource;
-	if (strcmp(op->method, "monitor") == 0) {
-		if (strstr(op->rname, op->hostname) != NULL) {
-			assert(op->resource);
+	if (op->method == intern_monitor) {
+		if (op->resource) {
 			if (op->interval > 0) {
 				recurring_monitor_start(op);
 			} else {
@@ -592,14 +956,16 @@ static void resource_execute_cb(struct pe_operation *op)
 			pe_resource_completed(op, OCF_NOT_RUNNING);
 			pe_resource_unref(op);
 		}
-	} else if (strcmp (op->method, "start") == 0) {
+	} else if (op->method == intern_start) {
+		op_history_pending(resource, op);
 		transport_resource_action(assembly, resource, op);
-	} else if (strcmp(op->method, "stop") == 0) {
+	} else if (op->method == intern_stop) {
 		if (resource->monitor_op) {
 			recurring_monitor_stop(resource->monitor_op);
 		}
+		op_history_pending(resource, op);
 		transport_resource_action(assembly, resource, op);
-	} else if (strcmp(op->method, "delete") == 0) {
+	} else if (op->method == intern_delete) {
 		op_history_delete(op);
 	} else {
 		assert(0);
@@ -608,504 +974,1879 @@ static void resource_execute_cb(struct pe_operation *op)
 	qb_leave();
 }
 
-static void transition_completed_cb(void* user_data, int32_t result) {
-}
+static void process_schedule_timer(struct policy_domain *d);
 
-static xmlNode *insert_resource(xmlNode *status, struct resource *resource)
+static void process_run_next(void);
+
+static void domain_free(struct policy_domain *d);
+
+static void transition_completed_cb(void* user_data, int32_t result)
 {
-	xmlNode *resource_xml;
+	struct application *app = (struct application *)user_data;
+	struct policy_domain *d = process_sched.running;
 
 	qb_enter();
 
-	resource_xml = xmlNewChild (status, NULL, BAD_CAST "lrm_resource", NULL);
-	xmlNewProp(resource_xml, BAD_CAST "id", BAD_CAST resource->name);
-	xmlNewProp(resource_xml, BAD_CAST "type", BAD_CAST resource->type);
-	xmlNewProp(resource_xml, BAD_CAST "class", BAD_CAST resource->rclass);
-	if (strcmp(resource->rclass, "ocf") == 0) {
-		xmlNewProp(resource_xml, BAD_CAST "provider", BAD_CAST resource->rprovider);
+	process_sched.running = NULL;
+	orphans_free(app);
+
+	if (d->retired) {
+		domain_free(d);
+		process_run_next();
+		qb_leave();
+		return;
 	}
 
-	qb_leave();
+	d->pe_fingerprint_valid = pe_transition_succeeded(result);
+	d->pe_fingerprint = d->pe_fingerprint_pending;
 
-	return resource_xml;
+	/*
+	 * state changes that arrived during the transition are run now
+	 */
+	if (d->process_dirty) {
+		process_schedule_timer(d);
+	}
+	process_run_next();
+
+	qb_leave();
 }
 
-static void insert_status(xmlNode *status, struct assembly *assembly)
+static void node_state_insert(struct assembly *assembly)
 {
-	struct operation_history *oh;
-	xmlNode *resource_xml;
-	xmlNode *resources_xml;
 	xmlNode *lrm_xml;
-	struct resource *resource;
-	qb_map_iter_t *iter;
 
 	qb_enter();
 
-	qb_log(LOG_DEBUG, "Inserting assembly %s", assembly->name);
+	assembly->node_state_xml = xmlNewChild(assembly->application->status_xml, NULL,
+					       BAD_CAST "node_state", NULL);
+        xmlNewProp(assembly->node_state_xml, BAD_CAST "id", BAD_CAST assembly->uuid);
+        xmlNewProp(assembly->node_state_xml, BAD_CAST "uname", BAD_CAST assembly->name);
+        xmlNewProp(assembly->node_state_xml, BAD_CAST "ha", BAD_CAST "active");
+        xmlNewProp(assembly->node_state_xml, BAD_CAST "expected", BAD_CAST "member");
+        xmlNewProp(assembly->node_state_xml, BAD_CAST "in_ccm", BAD_CAST "true");
+        xmlNewProp(assembly->node_state_xml, BAD_CAST "crmd", BAD_CAST "online");
+        xmlNewProp(assembly->node_state_xml, BAD_CAST "join", BAD_CAST "pending");
+
+	lrm_xml = xmlNewChild(assembly->node_state_xml, NULL, BAD_CAST "lrm", NULL);
+	assembly->lrm_resources_xml = xmlNewChild(lrm_xml, NULL,
+						  BAD_CAST "lrm_resources", NULL);
+
+	qb_list_init(&assembly->status_dirty_list);
+	assembly_status_dirty(assembly);
+
+	qb_leave();
+}
 
-	xmlNode *node_state = xmlNewChild(status, NULL, BAD_CAST "node_state", NULL);
-        xmlNewProp(node_state, BAD_CAST "id", BAD_CAST assembly->uuid);
-        xmlNewProp(node_state, BAD_CAST "uname", BAD_CAST assembly->name);
-        xmlNewProp(node_state, BAD_CAST "ha", BAD_CAST "active");
-        xmlNewProp(node_state, BAD_CAST "expected", BAD_CAST "member");
-        xmlNewProp(node_state, BAD_CAST "in_ccm", BAD_CAST "true");
-        xmlNewProp(node_state, BAD_CAST "crmd", BAD_CAST "online");
+static void node_state_update(struct assembly *assembly)
+{
+	qb_enter();
 
-	/* check state*/
 	if (assembly->recover.state == RECOVER_STATE_RUNNING) {
-		xmlNewProp(node_state, BAD_CAST "join", BAD_CAST "member");
+		xmlSetProp(assembly->node_state_xml, BAD_CAST "join", BAD_CAST "member");
 		qb_log(LOG_DEBUG, "Assembly '%s' marked as member",
 			assembly->name);
 
 	} else {
-		xmlNewProp(node_state, BAD_CAST "join", BAD_CAST "pending");
+		xmlSetProp(assembly->node_state_xml, BAD_CAST "join", BAD_CAST "pending");
 		qb_log(LOG_DEBUG, "Assembly '%s' marked as pending",
 			assembly->name);
 	}
-	lrm_xml = xmlNewChild(node_state, NULL, BAD_CAST "lrm", NULL);
-	resources_xml = xmlNewChild(lrm_xml, NULL, BAD_CAST "lrm_resources", NULL);
-	iter = qb_map_iter_create(op_history_map);
-	while ((qb_map_iter_next(iter, (void **)&oh)) != NULL) {
-		resource = oh->resource;
+	assembly->status_version++;
 
-		if (strstr(resource->name, assembly->name) == NULL) {
-			continue;
-		}
-		resource_xml = insert_resource(resources_xml, oh->resource);
-		op_history_insert(resource_xml, oh);
+	qb_leave();
+}
+
+static void status_update(struct application *app)
+{
+	struct qb_list_head *list;
+	struct qb_list_head *list_temp;
+	struct assembly *assembly;
+	struct operation_history *oh;
+
+	qb_enter();
+
+	qb_list_for_each_safe(list, list_temp, &app->assembly_dirty_head) {
+		assembly = qb_list_entry(list, struct assembly, status_dirty_list);
+		qb_list_del(list);
+		qb_list_init(list);
+		node_state_update(assembly);
+	}
+
+	qb_list_for_each_safe(list, list_temp, &app->op_history_dirty_head) {
+		oh = qb_list_entry(list, struct operation_history, status_dirty_list);
+		qb_list_del(list);
+		qb_list_init(list);
+		op_history_insert(oh);
 	}
-	qb_map_iter_free(iter);
 
 	qb_leave();
 }
 
-static void process(void)
+static uint64_t
+fingerprint_add(uint64_t hash, const void *data, size_t len)
+{
+	const uint8_t *p = (const uint8_t *)data;
+	size_t i;
+
+	/* FNV-1a */
+	for (i = 0; i < len; i++) {
+		hash ^= p[i];
+		hash *= UINT64_C(1099511628211);
+	}
+	return hash;
+}
+
+static uint64_t
+fingerprint_add_str(uint64_t hash, const char *str)
+{
+	return fingerprint_add(hash, str, strlen(str) + 1);
+}
+
+/*
+ * A hash of what the policy engine decides on: the configuration
+ * version, the node join states and the rc, interval and digest of
+ * every history entry.  Call ids and run times are left out, they change
+ * on every monitor without changing the outcome.
+ */
+static uint64_t
+status_fingerprint_get(struct policy_domain *d)
+{
+	uint64_t hash = UINT64_C(14695981039346656037);
+	struct qb_list_head *list;
+	qb_map_iter_t *r_iter;
+	qb_map_iter_t *oh_iter;
+	struct assembly *a;
+	struct resource *r;
+	struct operation_history *oh;
+
+	hash = fingerprint_add(hash, &d->application->generation,
+			       sizeof(d->application->generation));
+	hash = fingerprint_add(hash, &d->pe_edits, sizeof(d->pe_edits));
+
+	qb_list_for_each(list, &d->assembly_head) {
+		a = qb_list_entry(list, struct assembly, domain_list);
+		hash = fingerprint_add_str(hash, a->name);
+		hash = fingerprint_add(hash, &a->recover.state,
+				       sizeof(a->recover.state));
+
+		r_iter = qb_map_iter_create(a->resource_map);
+		while ((qb_map_iter_next(r_iter, (void **)&r)) != NULL) {
+			oh_iter = qb_map_iter_create(r->op_history_map);
+			while ((qb_map_iter_next(oh_iter, (void **)&oh)) != NULL) {
+				hash = fingerprint_add_str(hash, oh->rsc_id);
+				hash = fingerprint_add(hash, &oh->rc, sizeof(oh->rc));
+				/* an rc that flapped back is a new failure */
+				hash = fingerprint_add(hash, &oh->rc_changes,
+						       sizeof(oh->rc_changes));
+				hash = fingerprint_add(hash, &oh->pending,
+						       sizeof(oh->pending));
+				hash = fingerprint_add(hash, &oh->interval,
+						       sizeof(oh->interval));
+				hash = fingerprint_add(hash, &oh->target_outcome,
+						       sizeof(oh->target_outcome));
+				hash = fingerprint_add_str(hash, oh->op_digest ?
+							   oh->op_digest : "");
+			}
+			qb_map_iter_free(oh_iter);
+		}
+		qb_map_iter_free(r_iter);
+	}
+
+	return hash;
+}
+
+static void domain_cib_update(struct policy_domain *d);
+
+static void process(struct policy_domain *d)
 {
-	xmlNode *cur_node;
-	xmlNode *status;
+	struct application *app = d->application;
 	int rc;
-	struct assembly *assembly;
-	qb_map_iter_t *iter;
-	static xmlNode *pe_root;
 
 	qb_enter();
 
+	status_update(app);
+
 	/*
-	 * Remove status descriptor
+	 * the last transition computed from the same input completed,
+	 * running the policy engine again would not change anything
 	 */
-	pe_root = xmlDocGetRootElement(_pe);
-	for (cur_node = pe_root->children; cur_node; cur_node = cur_node->next) {
-		if (cur_node->type == XML_ELEMENT_NODE &&
-			strcmp((char*)cur_node->name, "status") == 0) {
-
-			xmlUnlinkNode(cur_node);
-			xmlFreeNode(cur_node);
-			break;
-		}
+	d->pe_fingerprint_pending = status_fingerprint_get(d);
+	if (d->pe_fingerprint_valid &&
+	    d->pe_fingerprint == d->pe_fingerprint_pending) {
+		process_sched.running = NULL;
+		process_sched.stats.skipped++;
+		qb_log(LOG_DEBUG, "%s/%u: status unchanged, skipping the policy engine",
+		       app->name, d->id);
+		orphans_free(app);
+		qb_leave();
+		return;
 	}
 
-	status = xmlNewChild(pe_root, NULL, BAD_CAST "status", NULL);
-	iter = qb_map_iter_create(assembly_map);
-	while ((qb_map_iter_next(iter, (void **)&assembly)) != NULL) {
-		insert_status(status, assembly);
-	}
-	qb_map_iter_free(iter);
+	process_sched.stats.executed++;
+	qb_log(LOG_DEBUG, "processing %s/%u (%"PRIu64" requested, %"PRIu64" coalesced, %"PRIu64" executed)",
+	       app->name, d->id, process_sched.stats.requested,
+	       process_sched.stats.coalesced, process_sched.stats.executed);
 
-	rc = pe_process_state(_pe, resource_execute_cb,
+	domain_cib_update(d);
+	rc = pe_process_state(d->pe, resource_execute_cb,
 			      transition_completed_cb,
-			      NULL, cape_debug);
+			      app, cape_debug);
 
 	if (rc != 0) {
-		schedule_processing();
+		process_sched.running = NULL;
+		schedule_processing(d);
+	}
+
+	qb_leave();
+}
+
+/*
+ * Start the policy engine for the domain that has waited longest
+ */
+static void process_run_next(void)
+{
+	struct policy_domain *d;
+
+	qb_enter();
+
+	/*
+	 * when busy, transition_completed_cb() will run the next one,
+	 * a skipped run lets the next domain go straight away
+	 */
+	while (!qb_list_empty(&process_sched.run_head) &&
+	       !pe_is_busy_processing()) {
+		d = qb_list_entry(process_sched.run_head.next,
+				  struct policy_domain, process_run_list);
+		qb_list_del(&d->process_run_list);
+		qb_list_init(&d->process_run_list);
+
+		d->process_dirty = QB_FALSE;
+		process_sched.running = d;
+		process(d);
+	}
+
+	qb_leave();
+}
+
+static void process_timer_expired(void *data)
+{
+	struct policy_domain *d = (struct policy_domain *)data;
+
+	qb_enter();
+
+	if (qb_list_empty(&d->process_run_list)) {
+		qb_list_add_tail(&d->process_run_list,
+				 &process_sched.run_head);
+	}
+	process_run_next();
+
+	qb_leave();
+}
+
+/*
+ * Arm the processing timer so it expires after the settle window, but never
+ * later than max_latency after the first unprocessed state change.
+ */
+static void process_schedule_timer(struct policy_domain *d)
+{
+	uint64_t now = qb_util_nano_current_get();
+	uint64_t deadline;
+	uint64_t latest;
+
+	qb_enter();
+
+	deadline = now + process_sched.settle_msec * QB_TIME_NS_IN_MSEC;
+	latest = d->process_dirty_since +
+		process_sched.max_latency_msec * QB_TIME_NS_IN_MSEC;
+	if (deadline > latest) {
+		deadline = latest;
 	}
+	if (deadline < now) {
+		deadline = now;
+	}
+
+	qb_loop_timer_del(NULL, d->process_timer);
+	qb_loop_timer_add(NULL, cape_prio_loop_level(CAPE_PRIO_RECOVERY),
+			  deadline - now, d,
+			  process_timer_expired, &d->process_timer);
 
 	qb_leave();
 }
 
-static void process_job(void *data)
+static void schedule_processing(struct policy_domain *d)
 {
 	qb_enter();
 
-	if (pe_is_busy_processing()) {
-		schedule_processing();
+	process_sched.stats.requested++;
+	if (d->process_dirty) {
+		process_sched.stats.coalesced++;
 	} else {
-		process();
+		d->process_dirty = QB_TRUE;
+		d->process_dirty_since = qb_util_nano_current_get();
+	}
+
+	/*
+	 * a domain already waiting for its turn runs with this change,
+	 * a running one is rescheduled by transition_completed_cb()
+	 */
+	if (qb_list_empty(&d->process_run_list) &&
+	    process_sched.running != d) {
+		process_schedule_timer(d);
 	}
 
 	qb_leave();
 }
 
-static void schedule_processing(void)
+/*
+ * A failure makes the running transition of the domain obsolete, it is
+ * aborted rather than waiting for its slowest action
+ */
+static void schedule_replan(struct policy_domain *d)
 {
 	qb_enter();
 
-	qb_loop_job_add(NULL, QB_LOOP_LOW, NULL, process_job);
+	schedule_processing(d);
+	if (process_sched.running == d && pe_transition_abort() == 0) {
+		process_sched.stats.aborted++;
+	}
 
 	qb_leave();
 }
 
-static xmlNode*
-get_xml_child_by(xmlNode* parent, const char* node_name,
-		 const char* prop_name,
-		 const char* prop_value)
+void
+cape_process_window_set(uint32_t settle_msec, uint32_t max_latency_msec)
 {
-	xmlNode *child_node;
-	char *val;
+	qb_enter();
 
-	for (child_node = parent->children; child_node;
-		child_node = child_node->next) {
-		if (child_node->type != XML_ELEMENT_NODE ||
-		    strcmp((char*)child_node->name, node_name) != 0) {
+	process_sched.settle_msec = settle_msec;
+	process_sched.max_latency_msec = max_latency_msec;
+	if (process_sched.max_latency_msec < process_sched.settle_msec) {
+		process_sched.max_latency_msec = process_sched.settle_msec;
+	}
+
+	qb_leave();
+}
+
+void
+cape_process_stats_get(struct cape_process_stats *stats)
+{
+	*stats = process_sched.stats;
+}
+
+void
+cape_cloud_limits_set(uint32_t concurrency, uint32_t rate, uint32_t burst)
+{
+	cloud_limits.concurrency = concurrency;
+	cloud_limits.rate = rate;
+	cloud_limits.burst = QB_MAX(burst, 1);
+}
+
+void
+cape_cloud_limits_get(struct cape_cloud_limits *limits)
+{
+	*limits = cloud_limits;
+}
+
+void
+cape_monitor_stats_get(struct timer_wheel_stats *stats)
+{
+	timer_wheel_stats_get(&monitor_wheel, stats);
+}
+
+struct cape_op_stats *
+cape_op_stats_get(const char *rclass, const char *method)
+{
+	struct cape_op_stats *s;
+	const char *c = intern_get(rclass);
+	const char *m = intern_get(method);
+
+	s = op_stats_find(c, m, QB_FALSE);
+	intern_put(c);
+	intern_put(m);
+	return s;
+}
+
+static void
+op_stats_log(const char *what, struct cape_op_stats *s)
+{
+	if (s->latency.count == 0 && s->timeouts == 0) {
+		return;
+	}
+	qb_log(LOG_INFO, "ops %s: count:%"PRIu64" failures:%"PRIu64
+	       " timeouts:%"PRIu64" latency(us) mean:%"PRIu64" p50:%"PRIu64
+	       " p90:%"PRIu64" p99:%"PRIu64" max:%"PRIu64,
+	       what, s->latency.count, s->failures, s->timeouts,
+	       latency_mean(&s->latency),
+	       latency_percentile(&s->latency, 50),
+	       latency_percentile(&s->latency, 90),
+	       latency_percentile(&s->latency, 99),
+	       s->latency.max);
+}
+
+void
+cape_stats_log(void)
+{
+	struct timer_wheel_stats tw_stats;
+	struct pe_digest_stats digest_stats;
+	struct pe_dump_stats dump_stats;
+	struct qb_list_head *list;
+	struct cape_op_stats *s;
+	struct application *app;
+	struct assembly *a;
+	qb_map_iter_t *iter;
+	struct latency_histogram *h;
+	enum cape_prio prio;
+	char what[PATH_MAX];
+
+	qb_log(LOG_INFO, "process: requested:%"PRIu64" coalesced:%"PRIu64
+	       " executed:%"PRIu64" skipped:%"PRIu64" aborted:%"PRIu64,
+	       process_sched.stats.requested, process_sched.stats.coalesced,
+	       process_sched.stats.executed, process_sched.stats.skipped,
+	       process_sched.stats.aborted);
+
+	timer_wheel_stats_get(&monitor_wheel, &tw_stats);
+	qb_log(LOG_INFO, "monitors: active:%"PRIu32" fired:%"PRIu64
+	       " late_total:%"PRIu64"ms late_max:%"PRIu64"ms",
+	       tw_stats.active, tw_stats.fired,
+	       tw_stats.late_total, tw_stats.late_max);
+
+	pe_digest_stats_get(&digest_stats);
+	qb_log(LOG_INFO, "op digests: hits:%"PRIu64" misses:%"PRIu64
+	       " evicted:%"PRIu64" cached:%"PRIu32,
+	       digest_stats.hits, digest_stats.misses, digest_stats.evicted,
+	       digest_stats.entries);
+
+	pe_dump_stats_get(&dump_stats);
+	if (dump_stats.submitted > 0) {
+		qb_log(LOG_INFO, "pe dumps: submitted:%"PRIu64" dropped:%"PRIu64
+		       " queued:%"PRIu64"B",
+		       dump_stats.submitted, dump_stats.dropped,
+		       dump_stats.queued_bytes);
+	}
+
+	pool_stats_log();
+
+	for (prio = 0; prio < CAPE_PRIO_MAX; prio++) {
+		h = &queue_wait[prio];
+		if (h->count == 0) {
 			continue;
 		}
-		if (prop_name == NULL || prop_value == NULL) {
-			return child_node;
-		}
-		val = (char*)xmlGetProp(child_node, BAD_CAST prop_name);
-		if (val && strcmp(val, prop_value) == 0) {
-			return child_node;
+		qb_log(LOG_INFO, "queue %s: count:%"PRIu64" wait(us) mean:%"PRIu64
+		       " p50:%"PRIu64" p99:%"PRIu64" max:%"PRIu64,
+		       prio_names[prio], h->count, latency_mean(h),
+		       latency_percentile(h, 50), latency_percentile(h, 99),
+		       h->max);
+	}
+
+	qb_list_for_each(list, &op_stats_head) {
+		s = qb_list_entry(list, struct cape_op_stats, list);
+		snprintf(what, sizeof(what), "%s:%s", s->rclass, s->method);
+		op_stats_log(what, s);
+	}
+
+	qb_list_for_each(list, &application_head) {
+		app = qb_list_entry(list, struct application, list);
+		iter = qb_map_iter_create(app->assembly_map);
+		while ((qb_map_iter_next(iter, (void **)&a)) != NULL) {
+			snprintf(what, sizeof(what), "%s/%s", app->name, a->name);
+			op_stats_log(what, &a->op_stats);
 		}
+		qb_map_iter_free(iter);
 	}
-	return NULL;
 }
 
 /*
- * <cib>
- *  <configuration>
- *   <resources>
- *    <primitive id="cfg_bar_angus" class="ocf" type="script_runner" provider="pacemaker-cloud">
- *     <instance_attributes id="attrs_angus">
- *  ->  <nvpair id="param_wp_ip" name="ipaddress" value=""/>
-*/
-xmlNode*
-find_pe_parameter(const char* rsc_id, const char* parm_name)
-{
-	xmlNode *cib_node = xmlDocGetRootElement(_pe);
-	xmlNode *config_node = get_xml_child_by(cib_node, "configuration", NULL, NULL);
-	xmlNode *rscs_node;
-	xmlNode *prim_node;
-	xmlNode *insts_node;
+ * Checkpoints
+ *
+ * The operation history and what is known about the instances is written
+ * to <checkpoint_dir>/<deployable>.ckpt a while after it changes, so a
+ * restarted cape starts from the last known state instead of probing
+ * every resource again.  The file is written next to the old one and
+ * renamed over it.
+ *
+ * cape-checkpoint <version> <deployable> <uuid>
+ * assembly <name> <uuid> <recover state> <instance id> <address>
+ * op <assembly> <resource> <id> <operation> <interval> <rc> <target rc>
+ *    <call id> <last run> <last rc change> <graph id> <action id> <digest>
+ *
+ * Missing strings are written as "-".
+ */
+#define CHECKPOINT_VERSION 1
+
+static void
+checkpoint_dir_sync(void)
+{
+	int fd = open(checkpoint_dir, O_RDONLY | O_DIRECTORY);
 
-	assert(config_node);
+	if (fd < 0) {
+		return;
+	}
+	if (fsync(fd) != 0) {
+		qb_perror(LOG_WARNING, "can't sync %s", checkpoint_dir);
+	}
+	close(fd);
+}
 
-	rscs_node = get_xml_child_by(config_node, "resources", NULL, NULL);
-	assert(rscs_node);
+static void
+checkpoint_write(struct application *app)
+{
+	char path[PATH_MAX];
+	char path_tmp[PATH_MAX];
+	qb_map_iter_t *a_iter;
+	qb_map_iter_t *r_iter;
+	qb_map_iter_t *oh_iter;
+	struct assembly *a;
+	struct resource *r;
+	struct operation_history *oh;
+	FILE *f;
+	int rc;
 
-	prim_node = get_xml_child_by(rscs_node, "primitive", "id", rsc_id);
-	if (prim_node == NULL) {
-		return NULL;
+	qb_enter();
+
+	snprintf(path, PATH_MAX, "%s/%s.ckpt", checkpoint_dir, app->name);
+	snprintf(path_tmp, PATH_MAX, "%s.tmp", path);
+
+	f = fopen(path_tmp, "w");
+	if (f == NULL) {
+		qb_perror(LOG_WARNING, "can't write checkpoint %s", path_tmp);
+		qb_leave();
+		return;
 	}
-	insts_node = get_xml_child_by(prim_node, "instance_attributes", NULL, NULL);
-	if (insts_node == NULL) {
+
+	fprintf(f, "cape-checkpoint %d %s %s\n",
+		CHECKPOINT_VERSION, app->name, app->uuid);
+
+	a_iter = qb_map_iter_create(app->assembly_map);
+	while ((qb_map_iter_next(a_iter, (void **)&a)) != NULL) {
+		fprintf(f, "assembly %s %s %d %s %s\n",
+			a->name, a->uuid, a->recover.state,
+			a->instance_id[0] ? a->instance_id : "-",
+			a->address ? a->address : "-");
+
+		r_iter = qb_map_iter_create(a->resource_map);
+		while ((qb_map_iter_next(r_iter, (void **)&r)) != NULL) {
+			oh_iter = qb_map_iter_create(r->op_history_map);
+			while ((qb_map_iter_next(oh_iter, (void **)&oh)) != NULL) {
+				/*
+				 * whatever was in progress is probed again
+				 * after a restart
+				 */
+				if (oh->pending) {
+					continue;
+				}
+				fprintf(f, "op %s %s %s %s %u %d %u %u %ld %ld %u %u %s\n",
+					a->name, r->name, oh->rsc_id,
+					oh->operation, oh->interval, oh->rc,
+					oh->target_outcome, oh->call_id,
+					(long)oh->last_run,
+					(long)oh->last_rc_change,
+					oh->graph_id, oh->action_id,
+					oh->op_digest ? oh->op_digest : "-");
+			}
+			qb_map_iter_free(oh_iter);
+		}
+		qb_map_iter_free(r_iter);
+	}
+	qb_map_iter_free(a_iter);
+
+	rc = ferror(f);
+	/*
+	 * the data has to be on disk before the rename is, or a crash can
+	 * leave an empty checkpoint behind
+	 */
+	if (fflush(f) != 0 || fsync(fileno(f)) != 0) {
+		rc = -1;
+	}
+	if (fclose(f) != 0 || rc != 0 || rename(path_tmp, path) != 0) {
+		qb_perror(LOG_WARNING, "can't write checkpoint %s", path);
+		unlink(path_tmp);
+	} else {
+		checkpoint_dir_sync();
+		qb_log(LOG_DEBUG, "checkpoint of %s written", app->name);
+	}
+
+	qb_leave();
+}
+
+static void
+checkpoint_timer_expired(void *data)
+{
+	struct application *app = (struct application *)data;
+
+	app->checkpoint_pending = QB_FALSE;
+	checkpoint_write(app);
+}
+
+static void
+checkpoint_schedule(struct application *app)
+{
+	if (checkpoint_dir[0] == '\0' || app->checkpoint_pending) {
+		return;
+	}
+	app->checkpoint_pending = QB_TRUE;
+	qb_loop_timer_add(NULL, QB_LOOP_LOW,
+			  CHECKPOINT_INTERVAL * QB_TIME_NS_IN_MSEC, app,
+			  checkpoint_timer_expired, &app->checkpoint_timer);
+}
+
+static void
+checkpoint_assembly_restore(struct application *app, const char *line)
+{
+	char name[ASSEMBLY_NAME_MAX];
+	char uuid[ASSEMBLY_NAME_MAX];
+	char instance_id[64];
+	char address[256];
+	int state;
+	struct assembly *a;
+
+	if (sscanf(line, "assembly %1023s %1023s %d %63s %255s",
+		   name, uuid, &state, instance_id, address) != 5) {
+		return;
+	}
+	a = qb_map_get(app->assembly_map, name);
+	if (a == NULL || strcmp(a->uuid, uuid) != 0) {
+		return;
+	}
+	a->checkpoint_state = state;
+	if (strcmp(instance_id, "-") != 0) {
+		strcpy(a->instance_id, instance_id);
+	}
+	if (strcmp(address, "-") != 0) {
+		free(a->address);
+		a->address = strdup(address);
+	}
+}
+
+/*
+ * Only one-off operations are restored.  The policy engine then sees the
+ * resources as started but without their recurring monitor, so the first
+ * transition re-validates them with a monitor instead of probing them.
+ */
+static void
+checkpoint_op_restore(struct application *app, const char *line)
+{
+	char a_name[ASSEMBLY_NAME_MAX];
+	char r_name[ASSEMBLY_NAME_MAX + RESOURCE_NAME_MAX + 6];
+	char rsc_id[RESOURCE_NAME_MAX + METHOD_NAME_MAX + OP_NAME_MAX + 3];
+	char operation[METHOD_NAME_MAX];
+	char digest[64];
+	struct operation_history tmp;
+	struct operation_history *oh;
+	struct assembly *a;
+	struct resource *r;
+	long last_run;
+	long last_rc_change;
+	int rc;
+
+	memset(&tmp, 0, sizeof(tmp));
+	if (sscanf(line, "op %1023s %2053s %1061s %19s %u %d %u %u %ld %ld %u %u %63s",
+		   a_name, r_name, rsc_id, operation, &tmp.interval, &rc,
+		   &tmp.target_outcome, &tmp.call_id, &last_run,
+		   &last_rc_change, &tmp.graph_id, &tmp.action_id,
+		   digest) != 13) {
+		return;
+	}
+	if (tmp.interval > 0) {
+		return;
+	}
+	a = qb_map_get(app->assembly_map, a_name);
+	if (a == NULL) {
+		return;
+	}
+	r = qb_map_get(a->resource_map, r_name);
+	if (r == NULL || qb_map_get(r->op_history_map, rsc_id)) {
+		return;
+	}
+
+	oh = (struct operation_history *)calloc(1, sizeof(struct operation_history));
+	*oh = tmp;
+	oh->resource = r;
+	oh->rsc_id = strdup(rsc_id);
+	oh->operation = intern_get(operation);
+	oh->rc = rc;
+	oh->last_run = last_run;
+	oh->last_rc_change = last_rc_change;
+	if (strcmp(digest, "-") != 0) {
+		oh->op_digest = intern_get(digest);
+	}
+	qb_list_init(&oh->status_dirty_list);
+	qb_map_put(r->op_history_map, oh->rsc_id, oh);
+	op_history_dirty(oh);
+
+	if (call_order <= (int)oh->call_id) {
+		call_order = oh->call_id + 1;
+	}
+}
+
+static void
+checkpoint_restore(struct application *app)
+{
+	char path[PATH_MAX];
+	char line[COMMAND_MAX];
+	char name[ASSEMBLY_NAME_MAX];
+	char uuid[ASSEMBLY_NAME_MAX];
+	int version;
+	FILE *f;
+
+	qb_enter();
+
+	if (checkpoint_dir[0] == '\0') {
+		qb_leave();
+		return;
+	}
+	snprintf(path, PATH_MAX, "%s/%s.ckpt", checkpoint_dir, app->name);
+	f = fopen(path, "r");
+	if (f == NULL) {
+		qb_leave();
+		return;
+	}
+
+	if (fgets(line, COMMAND_MAX, f) == NULL ||
+	    sscanf(line, "cape-checkpoint %d %1023s %1023s",
+		   &version, name, uuid) != 3 ||
+	    version != CHECKPOINT_VERSION ||
+	    strcmp(uuid, app->uuid) != 0) {
+		qb_log(LOG_WARNING, "ignoring checkpoint %s", path);
+		fclose(f);
+		qb_leave();
+		return;
+	}
+
+	while (fgets(line, COMMAND_MAX, f) != NULL) {
+		if (strncmp(line, "assembly ", 9) == 0) {
+			checkpoint_assembly_restore(app, line);
+		} else if (strncmp(line, "op ", 3) == 0) {
+			checkpoint_op_restore(app, line);
+		}
+	}
+	fclose(f);
+
+	qb_log(LOG_INFO, "restored %s from checkpoint %s", app->name, path);
+
+	qb_leave();
+}
+
+void
+cape_checkpoint_dir_set(const char *dir)
+{
+	if (dir == NULL) {
+		checkpoint_dir[0] = '\0';
+	} else {
+		snprintf(checkpoint_dir, PATH_MAX, "%s", dir);
+	}
+}
+
+static xmlNode*
+get_xml_child_by(xmlNode* parent, const char* node_name,
+		 const char* prop_name,
+		 const char* prop_value)
+{
+	xmlNode *child_node;
+	char *val;
+
+	for (child_node = parent->children; child_node;
+		child_node = child_node->next) {
+		if (child_node->type != XML_ELEMENT_NODE ||
+		    strcmp((char*)child_node->name, node_name) != 0) {
+			continue;
+		}
+		if (prop_name == NULL || prop_value == NULL) {
+			return child_node;
+		}
+		val = (char*)xmlGetProp(child_node, BAD_CAST prop_name);
+		if (val && strcmp(val, prop_value) == 0) {
+			return child_node;
+		}
+	}
+	return NULL;
+}
+
+static xmlNode*
+find_pe_parameter(struct application *app,
+		  const char* rsc_id, const char* parm_name)
+{
+	xmlNode *prim_node;
+	xmlNode *insts_node;
+
+	prim_node = qb_map_get(app->primitive_index, rsc_id);
+	if (prim_node == NULL) {
+		return NULL;
+	}
+	insts_node = get_xml_child_by(prim_node, "instance_attributes", NULL, NULL);
+	if (insts_node == NULL) {
+		return NULL;
+	}
+	return get_xml_child_by(insts_node, "nvpair", "name", parm_name);
+}
+
+static void
+ref_param_index_add(struct application *app, struct reference_param *p)
+{
+	struct qb_list_head *referrers;
+
+	referrers = qb_map_get(app->ref_param_index, p->assembly);
+	if (referrers == NULL) {
+		referrers = malloc(sizeof(struct qb_list_head));
+		qb_list_init(referrers);
+		qb_map_put(app->ref_param_index, p->assembly, referrers);
+	}
+	qb_list_init(&p->referrer_list);
+	qb_list_add_tail(&p->referrer_list, referrers);
+}
+
+static void
+resource_ref_params_free(struct resource *r)
+{
+	qb_map_iter_t *iter;
+	struct reference_param *p;
+	const char *key;
+
+	if (r->ref_params_map == NULL) {
+		return;
+	}
+
+	iter = qb_map_iter_create(r->ref_params_map);
+	while ((key = qb_map_iter_next(iter, (void **)&p)) != NULL) {
+		qb_map_rm(r->ref_params_map, key);
+		qb_list_del(&p->referrer_list);
+		intern_put(p->assembly);
+		xmlFree(p->name);
+		xmlFree(p->parameter);
+		free(p);
+	}
+	qb_map_iter_free(iter);
+}
+
+static void
+resource_add_ref_params(xmlNode *params_node, struct resource *r)
+{
+	struct application *app = r->assembly->application;
+	struct assembly *referenced;
+	xmlNode *child_node;
+	xmlNode *ref_node;
+	struct reference_param *p;
+	char *assembly_name;
+
+	qb_enter();
+
+	if (params_node == NULL || params_node->children == NULL) {
+		return;
+	}
+
+	for (child_node = params_node->children; child_node;
+		child_node = child_node->next) {
+		if (child_node->type != XML_ELEMENT_NODE ||
+		    strcmp((char*)child_node->name, "parameter") != 0) {
+			continue;
+		}
+
+		for (ref_node = child_node->children; ref_node;
+		     ref_node = ref_node->next) {
+			if (ref_node->type != XML_ELEMENT_NODE ||
+			    strcmp((char*)ref_node->name, "reference") != 0) {
+				continue;
+			}
+			if (r->ref_params_map == NULL) {
+				r->ref_params_map = qb_skiplist_create();
+			}
+			p = calloc(1, sizeof(struct reference_param));
+
+			/* example:
+			 * <parameter name="mysql_ip" type="scalar">
+			 *   <reference assembly="mysql" parameter="ipaddress"/>
+			 * </parameter>
+			 */
+			p->name = (char*)xmlGetProp(child_node, BAD_CAST "name");
+			p->parameter = (char*)xmlGetProp(ref_node, BAD_CAST "parameter");
+			p->xmlnode = find_pe_parameter(app, r->name, p->name);
+			if (p->xmlnode == NULL) {
+				qb_log(LOG_ERR, "%s has no parameter %s in the cib",
+				       r->name, p->name);
+				xmlFree(p->name);
+				xmlFree(p->parameter);
+				free(p);
+				continue;
+			}
+			assembly_name = (char*)xmlGetProp(ref_node, BAD_CAST "assembly");
+			p->assembly = intern_get(assembly_name);
+			xmlFree(assembly_name);
+			ref_param_index_add(app, p);
+			qb_log(LOG_INFO, "angus: adding reference_param %s to %s",
+			       p->name, r->name);
+			qb_map_put(r->ref_params_map, p->name, p);
+
+			/*
+			 * after a reload the referenced assembly may
+			 * already be up
+			 */
+			referenced = qb_map_get(app->assembly_map, p->assembly);
+			if (referenced &&
+			    referenced->recover.state == RECOVER_STATE_RUNNING) {
+				ref_param_value_set(p, referenced);
+			}
+		}
+	}
+}
+
+/*
+ * A resource that is still part of the deployable after a reload keeps its
+ * object and so its operation history and monitor, a changed definition is
+ * picked up by the policy engine from the cib.
+ */
+static struct resource *
+resource_get(struct assembly *assembly, const char *name,
+	     const char *type, const char *rclass, const char *rprovider,
+	     const char *escalation_failures, const char *escalation_period)
+{
+	struct resource *resource;
+	const char *old;
+
+	resource = qb_map_get(assembly->resource_map, name);
+	if (resource) {
+		if (resource->orphan) {
+			qb_list_del(&resource->orphan_list);
+			qb_list_init(&resource->orphan_list);
+			resource->orphan = QB_FALSE;
+		}
+		resource_ref_params_free(resource);
+
+		old = resource->type;
+		resource->type = intern_get(type);
+		intern_put(old);
+		old = resource->rclass;
+		resource->rclass = intern_get(rclass);
+		intern_put(old);
+		old = resource->rprovider;
+		resource->rprovider = intern_get(rprovider);
+		intern_put(old);
+
+		resource->generation = assembly->application->generation;
+		return resource;
+	}
+
+	resource = calloc(1, sizeof (struct resource));
+	resource->name = intern_get(name);
+	resource->type = intern_get(type);
+	resource->rclass = intern_get(rclass);
+	resource->rprovider = intern_get(rprovider);
+
+	recover_init(&resource->recover,
+		    escalation_failures, escalation_period,
+		    resource_recover_restart,
+		    resource_recover_escalate,
+		    resource_state_change_event);
+	resource->recover.instance = resource;
+
+	resource->assembly = assembly;
+	resource->op_history_map = qb_skiplist_create();
+	timer_wheel_entry_init(&resource->monitor_timer);
+	qb_list_init(&resource->orphan_list);
+	resource->generation = assembly->application->generation;
+	qb_map_put(assembly->resource_map, resource->name, resource);
+
+	return resource;
+}
+
+static void
+resource_free(struct resource *resource)
+{
+	qb_enter();
+
+	qb_log(LOG_INFO, "Resource (%s): removed", resource->name);
+
+	resource_op_history_clear(resource);
+	resource_ref_params_free(resource);
+	qb_list_del(&resource->orphan_list);
+
+	qb_map_rm(resource->assembly->resource_map, resource->name);
+	qb_map_destroy(resource->op_history_map);
+	if (resource->ref_params_map) {
+		qb_map_destroy(resource->ref_params_map);
+	}
+	if (resource->recover.sw) {
+		qb_util_stopwatch_free(resource->recover.sw);
+	}
+	intern_put(resource->name);
+	intern_put(resource->type);
+	intern_put(resource->rclass);
+	intern_put(resource->rprovider);
+	free(resource);
+
+	qb_leave();
+}
+
+/*
+ * A resource dropped from the deployable stays around until the policy
+ * engine has stopped it and deleted its history.
+ */
+static void
+resource_orphan(struct resource *resource)
+{
+	qb_enter();
+
+	qb_log(LOG_INFO, "Resource (%s): no longer configured", resource->name);
+
+	resource->orphan = QB_TRUE;
+	resource_ref_params_free(resource);
+	qb_list_add_tail(&resource->orphan_list,
+			 &resource->assembly->application->orphan_head);
+
+	qb_leave();
+}
+
+static void
+orphans_free(struct application *app)
+{
+	struct qb_list_head *list;
+	struct qb_list_head *list_temp;
+	struct resource *resource;
+
+	qb_list_for_each_safe(list, list_temp, &app->orphan_head) {
+		resource = qb_list_entry(list, struct resource, orphan_list);
+		if (qb_map_count_get(resource->op_history_map) > 0 &&
+		    resource->assembly->recover.state == RECOVER_STATE_RUNNING) {
+			continue;
+		}
+		resource_free(resource);
+	}
+}
+
+static void
+configure_resource_create(xmlNode *rsc_node, xmlNode *params_node, struct assembly *assembly)
+{
+	struct resource *resource;
+	char *name;
+	/* 6 = rsc__ and terminator */
+	char resource_name[ASSEMBLY_NAME_MAX + RESOURCE_NAME_MAX + 6];
+
+	qb_enter();
+
+	name = (char*)xmlGetProp(rsc_node, BAD_CAST "name");
+	snprintf(resource_name, ASSEMBLY_NAME_MAX + RESOURCE_NAME_MAX + 6,
+		"cfg_%s_%s", assembly->name, name);
+	xmlFree(name);
+
+	resource = resource_get(assembly, resource_name,
+				"script_runner", intern_ocf, "pacemaker-cloud",
+				"-1", "-1");
+	resource_add_ref_params(params_node, resource);
+
+	qb_leave();
+}
+
+
+static void resource_create(xmlNode *cur_node, struct assembly *assembly)
+{
+	struct resource *resource;
+	xmlNode *child_node;
+	xmlNode *params_node = NULL;
+	char *name;
+	char *type;
+	char *rclass;
+	char *rprovider;
+	/* 6 = rsc__ and terminator */
+	char resource_name[ASSEMBLY_NAME_MAX + RESOURCE_NAME_MAX + 6];
+	char *escalation_failures;
+	char *escalation_period;
+
+	qb_enter();
+
+
+	for (child_node = cur_node->children; child_node;
+		child_node = child_node->next) {
+		if (child_node->type != XML_ELEMENT_NODE) {
+			continue;
+		}
+		if (strcmp((char*)child_node->name, "parameters") == 0) {
+			params_node = child_node;
+			break;
+		}
+	}
+
+
+	for (child_node = cur_node->children; child_node;
+		child_node = child_node->next) {
+		if (child_node->type != XML_ELEMENT_NODE) {
+			continue;
+		}
+		if (strcmp((char*)child_node->name, "configure_executable") == 0) {
+			configure_resource_create(cur_node, params_node, assembly);
+			break;
+		}
+	}
+
+	name = (char*)xmlGetProp(cur_node, BAD_CAST "name");
+	snprintf(resource_name, ASSEMBLY_NAME_MAX + RESOURCE_NAME_MAX + 6,
+		"rsc_%s_%s", assembly->name, name);
+	type = (char*)xmlGetProp(cur_node, BAD_CAST "type");
+	rclass = (char*)xmlGetProp(cur_node, BAD_CAST "class");
+	rprovider = (char*)xmlGetProp(cur_node, BAD_CAST "provider");
+	escalation_failures = (char*)xmlGetProp(cur_node, BAD_CAST "escalation_failures");
+	escalation_period = (char*)xmlGetProp(cur_node, BAD_CAST "escalation_period");
+
+	resource = resource_get(assembly, resource_name, type, rclass, rprovider,
+				escalation_failures, escalation_period);
+
+	xmlFree(name);
+	xmlFree(type);
+	xmlFree(rclass);
+	xmlFree(rprovider);
+	xmlFree(escalation_failures);
+	xmlFree(escalation_period);
+
+	if (resource->rclass == intern_ocf) {
+		resource_add_ref_params(params_node, resource);
+	}
+
+	qb_leave();
+}
+
+static struct assembly *
+assembly_create(struct application *app, xmlNode *cur_node)
+{
+	struct assembly *assembly;
+	char *name;
+	char *uuid;
+	char *escalation_failures;
+	char *escalation_period;
+
+	qb_enter();
+
+	assembly = calloc(1, sizeof (struct assembly));
+	name = (char*)xmlGetProp(cur_node, BAD_CAST "name");
+	assembly->name = intern_get(name);
+	xmlFree(name);
+	uuid = (char*)xmlGetProp(cur_node, BAD_CAST "uuid");
+	assembly->uuid = intern_get(uuid);
+	xmlFree(uuid);
+	assembly->resource_map = qb_skiplist_create();
+	qb_list_init(&assembly->domain_list);
+	assembly->sw_instance_create = qb_util_stopwatch_create();
+	assembly->sw_instance_connected = qb_util_stopwatch_create();
+	assembly->application = app;
+
+	escalation_failures = (char*)xmlGetProp(cur_node, BAD_CAST "escalation_failures");
+	escalation_period = (char*)xmlGetProp(cur_node, BAD_CAST "escalation_period");
+
+	recover_init(&assembly->recover,
+		    escalation_failures, escalation_period,
+		    node_recover_restart,
+		    node_recover_escalate,
+		    node_state_change_event);
+	assembly->recover.instance = assembly;
+	xmlFree(escalation_failures);
+	xmlFree(escalation_period);
+
+	node_state_insert(assembly);
+
+	assembly->instance_pending = QB_TRUE;
+	assembly->adopt = QB_TRUE;
+	qb_map_put(app->assembly_map, assembly->name, assembly);
+
+	qb_leave();
+	return assembly;
+}
+
+/*
+ * Take an assembly that is no longer part of the deployable out of the
+ * model.  The assembly itself is not freed, completions of the cloud API
+ * may still refer to it.
+ */
+static void
+assembly_retire(struct assembly *assembly)
+{
+	struct application *app = assembly->application;
+	qb_map_iter_t *iter;
+	struct resource *resource;
+	const char *key;
+
+	qb_enter();
+
+	qb_log(LOG_INFO, "Assembly '%s' removed from %s",
+	       assembly->name, app->name);
+
+	assembly->retired = QB_TRUE;
+	qb_map_rm(app->assembly_map, assembly->name);
+	qb_list_del(&assembly->domain_list);
+	qb_list_init(&assembly->domain_list);
+	assembly->domain = NULL;
+
+	transport_disconnect(assembly);
+	node_op_history_clear(assembly);
+
+	iter = qb_map_iter_create(assembly->resource_map);
+	while ((key = qb_map_iter_next(iter, (void **)&resource)) != NULL) {
+		resource_ref_params_free(resource);
+		if (resource->orphan) {
+			qb_list_del(&resource->orphan_list);
+			qb_list_init(&resource->orphan_list);
+		}
+	}
+	qb_map_iter_free(iter);
+
+	if (assembly->instance_id[0] != '\0') {
+		instance_destroy(assembly);
+	}
+
+	qb_list_del(&assembly->status_dirty_list);
+	qb_list_init(&assembly->status_dirty_list);
+	xmlUnlinkNode(assembly->node_state_xml);
+	xmlFreeNode(assembly->node_state_xml);
+	assembly->node_state_xml = NULL;
+	assembly->lrm_resources_xml = NULL;
+
+	qb_leave();
+}
+
+/*
+ * cf2pe_compile() callbacks, the model is built in the same pass over the
+ * deployable that generates the cib.
+ */
+static void
+compile_cib_created(void *user_data, xmlDocPtr pe)
+{
+	struct application *app = (struct application *)user_data;
+	qb_map_iter_t *iter;
+	const char *key;
+	void *prim_node;
+
+	app->pe = pe;
+
+	/*
+	 * The status section is kept between transitions, only the
+	 * node_state and lrm_rsc_op entries that changed since the last
+	 * transition are rewritten by status_update().  It moves over to
+	 * the new cib on a reload.
+	 */
+	if (app->status_xml == NULL) {
+		app->status_xml = xmlNewChild(xmlDocGetRootElement(app->pe), NULL,
+					      BAD_CAST "status", NULL);
+	} else {
+		xmlUnlinkNode(app->status_xml);
+		xmlAddChild(xmlDocGetRootElement(app->pe), app->status_xml);
+	}
+
+	if (app->primitive_index) {
+		iter = qb_map_iter_create(app->primitive_index);
+		while ((key = qb_map_iter_next(iter, &prim_node)) != NULL) {
+			intern_put(key);
+		}
+		qb_map_iter_free(iter);
+		qb_map_destroy(app->primitive_index);
+	}
+	app->primitive_index = qb_hashtable_create(256);
+}
+
+static void *
+compile_assembly(void *user_data, xmlNode *assembly_xml)
+{
+	struct application *app = (struct application *)user_data;
+	struct assembly *assembly;
+	char *name;
+	char *uuid;
+
+	name = (char*)xmlGetProp(assembly_xml, BAD_CAST "name");
+	uuid = (char*)xmlGetProp(assembly_xml, BAD_CAST "uuid");
+
+	assembly = qb_map_get(app->assembly_map, name);
+	if (assembly &&
+	    (uuid == NULL || strcmp(assembly->uuid, uuid) != 0)) {
+		assembly_retire(assembly);
+		assembly = NULL;
+	}
+	if (assembly == NULL) {
+		assembly = assembly_create(app, assembly_xml);
+	}
+	assembly->generation = app->generation;
+
+	xmlFree(name);
+	xmlFree(uuid);
+	return assembly;
+}
+
+static void
+primitive_index_add(struct application *app, xmlNode *prim_node)
+{
+	char *id;
+
+	if (prim_node == NULL) {
+		return;
+	}
+	id = (char*)xmlGetProp(prim_node, BAD_CAST "id");
+	if (id) {
+		qb_map_put(app->primitive_index, intern_get(id), prim_node);
+		xmlFree(id);
+	}
+}
+
+static void
+compile_service(void *user_data, void *assembly, xmlNode *service_xml,
+		xmlNode *primitive_xml, xmlNode *cfg_primitive_xml)
+{
+	struct application *app = (struct application *)user_data;
+
+	primitive_index_add(app, primitive_xml);
+	primitive_index_add(app, cfg_primitive_xml);
+	resource_create(service_xml, (struct assembly *)assembly);
+}
+
+static const struct cf2pe_ops compile_ops = {
+	.cib_created = compile_cib_created,
+	.assembly = compile_assembly,
+	.service = compile_service,
+};
+
+/*
+ * Policy domains
+ */
+static void
+domain_free(struct policy_domain *d)
+{
+	qb_loop_timer_del(NULL, d->process_timer);
+	qb_list_del(&d->process_run_list);
+	if (d->pe) {
+		xmlFreeDoc(d->pe);
+	}
+	free(d);
+}
+
+static struct policy_domain *
+domain_create(struct application *app)
+{
+	struct policy_domain *d = calloc(1, sizeof(struct policy_domain));
+
+	d->application = app;
+	d->id = app->num_domains++;
+	qb_list_init(&d->process_run_list);
+	qb_list_init(&d->assembly_head);
+	qb_list_init(&d->list);
+	qb_list_add_tail(&d->list, &app->domain_head);
+	return d;
+}
+
+static struct assembly *
+domain_root_get(struct assembly *a)
+{
+	while (a->domain_parent != a) {
+		a->domain_parent = a->domain_parent->domain_parent;
+		a = a->domain_parent;
+	}
+	return a;
+}
+
+static void
+domain_join(struct assembly *a, struct assembly *b)
+{
+	if (a == NULL || b == NULL) {
+		return;
+	}
+	a = domain_root_get(a);
+	b = domain_root_get(b);
+	if (a != b) {
+		b->domain_parent = a;
+	}
+}
+
+static xmlNode *
+xml_child_get(xmlNode *parent, const char *name)
+{
+	xmlNode *n;
+
+	for (n = parent ? parent->children : NULL; n; n = n->next) {
+		if (n->type == XML_ELEMENT_NODE &&
+		    strcmp((char*)n->name, name) == 0) {
+			return n;
+		}
+	}
+	return NULL;
+}
+
+static struct assembly *
+resource_assembly_get(struct application *app, xmlNode *n, const char *attr)
+{
+	struct assembly *a;
+	char *value = (char*)xmlGetProp(n, BAD_CAST attr);
+
+	if (value == NULL) {
 		return NULL;
 	}
-	return get_xml_child_by(insts_node, "nvpair", "name", parm_name);
+	a = qb_map_get(app->resource_index, value);
+	xmlFree(value);
+	return a;
 }
 
-
+/*
+ * Split the deployable into connected components: assemblies end up in
+ * the same domain when an ordering constraint or a reference parameter
+ * links their resources.
+ */
 static void
-resource_add_ref_params(xmlNode *params_node, struct resource *r)
+domains_build(struct application *app)
 {
-	xmlNode *child_node;
-	xmlNode *ref_node;
+	struct qb_list_head *list;
+	struct qb_list_head *list_temp;
+	struct policy_domain *d;
+	qb_map_iter_t *iter;
+	qb_map_iter_t *r_iter;
+	qb_map_iter_t *p_iter;
+	struct assembly *a;
+	struct resource *r;
 	struct reference_param *p;
+	xmlNode *cur;
+	xmlNode *n;
 
 	qb_enter();
 
-	if (params_node == NULL || params_node->children == NULL) {
-		return;
+	qb_list_for_each_safe(list, list_temp, &app->domain_head) {
+		d = qb_list_entry(list, struct policy_domain, list);
+		qb_list_del(&d->list);
+		qb_list_init(&d->assembly_head);
+		if (process_sched.running == d) {
+			/* freed by transition_completed_cb() */
+			d->retired = QB_TRUE;
+		} else {
+			domain_free(d);
+		}
 	}
+	app->num_domains = 0;
 
-	for (child_node = params_node->children; child_node;
-		child_node = child_node->next) {
-		if (child_node->type != XML_ELEMENT_NODE ||
-		    strcmp((char*)child_node->name, "parameter") != 0) {
-			continue;
+	if (app->resource_index) {
+		qb_map_destroy(app->resource_index);
+	}
+	app->resource_index = qb_hashtable_create(256);
+
+	iter = qb_map_iter_create(app->assembly_map);
+	while ((qb_map_iter_next(iter, (void **)&a)) != NULL) {
+		a->domain = NULL;
+		a->domain_parent = a;
+		a->domain_state_xml = NULL;
+		qb_list_init(&a->domain_list);
+
+		r_iter = qb_map_iter_create(a->resource_map);
+		while ((qb_map_iter_next(r_iter, (void **)&r)) != NULL) {
+			if (!r->orphan) {
+				qb_map_put(app->resource_index, r->name, a);
+			}
 		}
+		qb_map_iter_free(r_iter);
+	}
+	qb_map_iter_free(iter);
 
-		for (ref_node = child_node->children; ref_node;
-		     ref_node = ref_node->next) {
-			if (ref_node->type != XML_ELEMENT_NODE ||
-			    strcmp((char*)ref_node->name, "reference") != 0) {
+	iter = qb_map_iter_create(app->assembly_map);
+	while ((qb_map_iter_next(iter, (void **)&a)) != NULL) {
+		r_iter = qb_map_iter_create(a->resource_map);
+		while ((qb_map_iter_next(r_iter, (void **)&r)) != NULL) {
+			if (r->ref_params_map == NULL) {
 				continue;
 			}
-			if (r->ref_params_map == NULL) {
-				r->ref_params_map = qb_skiplist_create();
+			p_iter = qb_map_iter_create(r->ref_params_map);
+			while ((qb_map_iter_next(p_iter, (void **)&p)) != NULL) {
+				domain_join(a, qb_map_get(app->assembly_map,
+							  p->assembly));
 			}
-			p = calloc(1, sizeof(struct reference_param));
-
-			/* example:
-			 * <parameter name="mysql_ip" type="scalar">
-			 *   <reference assembly="mysql" parameter="ipaddress"/>
-			 * </parameter>
-			 */
-			p->name = (char*)xmlGetProp(child_node, BAD_CAST "name");
-			p->parameter = (char*)xmlGetProp(ref_node, BAD_CAST "parameter");
-			p->assembly = (char*)xmlGetProp(ref_node, BAD_CAST "assembly");
-			p->xmlnode = find_pe_parameter(r->name, p->name);
-			assert(p->xmlnode);
-			qb_log(LOG_INFO, "angus: adding reference_param %s to %s",
-			       p->name, r->name);
-			qb_map_put(r->ref_params_map, p->name, p);
+			qb_map_iter_free(p_iter);
 		}
+		qb_map_iter_free(r_iter);
 	}
-}
-
-static void
-configure_resource_create(xmlNode *rsc_node, xmlNode *params_node, struct assembly *assembly)
-{
-	struct resource *resource;
-	char *name;
-	/* 6 = rsc__ and terminator */
-	char resource_name[ASSEMBLY_NAME_MAX + RESOURCE_NAME_MAX + 6];
-
-	qb_enter();
-
-	resource = calloc(1, sizeof (struct resource));
+	qb_map_iter_free(iter);
 
-	name = (char*)xmlGetProp(rsc_node, BAD_CAST "name");
-	snprintf(resource_name, ASSEMBLY_NAME_MAX + RESOURCE_NAME_MAX + 6,
-		"cfg_%s_%s", assembly->name, name);
-	resource->name = strdup(resource_name);
-	resource->type = strdup("script_runner");
-	resource->rclass = strdup("ocf");
-	resource->rprovider = strdup("pacemaker-cloud");
+	cur = xml_child_get(xmlDocGetRootElement(app->pe), "configuration");
+	cur = xml_child_get(cur, "constraints");
+	for (n = cur ? cur->children : NULL; n; n = n->next) {
+		if (n->type != XML_ELEMENT_NODE) {
+			continue;
+		}
+		domain_join(resource_assembly_get(app, n, "first"),
+			    resource_assembly_get(app, n, "then"));
+		domain_join(resource_assembly_get(app, n, "rsc"),
+			    resource_assembly_get(app, n, "with-rsc"));
+	}
 
-	recover_init(&resource->recover,
-		    "-1", "-1",
-		    resource_recover_restart,
-		    resource_recover_escalate,
-		    resource_state_change_event);
-	resource->recover.instance = resource;
+	iter = qb_map_iter_create(app->assembly_map);
+	while ((qb_map_iter_next(iter, (void **)&a)) != NULL) {
+		struct assembly *root = domain_root_get(a);
 
-	resource->assembly = assembly;
-	qb_map_put(assembly->resource_map, resource->name, resource);
+		if (root->domain == NULL) {
+			root->domain = domain_create(app);
+		}
+		a->domain = root->domain;
+		qb_list_add_tail(&a->domain_list, &a->domain->assembly_head);
+		a->domain->num_assemblies++;
+	}
+	qb_map_iter_free(iter);
 
-	resource_add_ref_params(params_node, resource);
+	qb_log(LOG_INFO, "%s: %zu assemblies in %u policy domains",
+	       app->name, qb_map_count_get(app->assembly_map),
+	       app->num_domains);
 
 	qb_leave();
 }
 
+/*
+ * Whether an element of the configuration section belongs to the domain,
+ * elements that can't be placed go everywhere.
+ */
+static int
+domain_owns(struct policy_domain *d, xmlNode *n)
+{
+	struct application *app = d->application;
+	struct assembly *a = NULL;
+	char *uname;
+
+	if (strcmp((char*)n->name, "node") == 0) {
+		uname = (char*)xmlGetProp(n, BAD_CAST "uname");
+		if (uname) {
+			a = qb_map_get(app->assembly_map, uname);
+			xmlFree(uname);
+		}
+	} else if (strcmp((char*)n->parent->name, "constraints") == 0) {
+		a = resource_assembly_get(app, n, "rsc");
+		if (a == NULL) {
+			a = resource_assembly_get(app, n, "first");
+		}
+	} else {
+		a = resource_assembly_get(app, n, "id");
+	}
+	return (a == NULL || a->domain == d);
+}
 
-static void resource_create(xmlNode *cur_node, struct assembly *assembly)
+/*
+ * The configuration part of the domain cib is cut from the deployable's
+ * when the domain is created or its parameters were edited.  The status
+ * part is kept between runs, only the node_state of the assemblies whose
+ * status changed since the last run is copied over again.
+ */
+static void
+domain_cib_update(struct policy_domain *d)
 {
-	struct resource *resource;
-	xmlNode *child_node;
-	xmlNode *params_node = NULL;
-	char *name;
-	char *type;
-	char *rclass;
-	char *rprovider;
-	/* 6 = rsc__ and terminator */
-	char resource_name[ASSEMBLY_NAME_MAX + RESOURCE_NAME_MAX + 6];
-	char *escalation_failures;
-	char *escalation_period;
+	struct application *app = d->application;
+	struct qb_list_head *list;
+	struct assembly *a;
+	xmlNode *cib;
+	xmlNode *cur;
+	xmlNode *section;
+	xmlNode *configuration;
+	xmlNode *to;
+	xmlNode *n;
+	xmlNode *copy;
+	int rebuilt = QB_FALSE;
 
 	qb_enter();
 
-
-	for (child_node = cur_node->children; child_node;
-		child_node = child_node->next) {
-		if (child_node->type != XML_ELEMENT_NODE) {
-			continue;
+	if (d->pe == NULL || d->pe_built != d->pe_edits) {
+		if (d->pe) {
+			xmlFreeDoc(d->pe);
 		}
-		if (strcmp((char*)child_node->name, "parameters") == 0) {
-			params_node = child_node;
-			break;
+		d->pe = xmlNewDoc(BAD_CAST "1.0");
+		cib = xmlDocCopyNode(xmlDocGetRootElement(app->pe), d->pe, 2);
+		xmlDocSetRootElement(d->pe, cib);
+
+		for (cur = xmlDocGetRootElement(app->pe)->children; cur;
+		     cur = cur->next) {
+			if (cur->type != XML_ELEMENT_NODE ||
+			    strcmp((char*)cur->name, "status") == 0) {
+				continue;
+			}
+			if (strcmp((char*)cur->name, "configuration") != 0) {
+				xmlAddChild(cib, xmlDocCopyNode(cur, d->pe, 1));
+				continue;
+			}
+			configuration = xmlAddChild(cib, xmlDocCopyNode(cur, d->pe, 2));
+			for (section = cur->children; section;
+			     section = section->next) {
+				if (section->type != XML_ELEMENT_NODE) {
+					continue;
+				}
+				if (strcmp((char*)section->name, "nodes") != 0 &&
+				    strcmp((char*)section->name, "resources") != 0 &&
+				    strcmp((char*)section->name, "constraints") != 0) {
+					xmlAddChild(configuration,
+						    xmlDocCopyNode(section, d->pe, 1));
+					continue;
+				}
+				to = xmlAddChild(configuration,
+						 xmlDocCopyNode(section, d->pe, 2));
+				for (n = section->children; n; n = n->next) {
+					if (n->type == XML_ELEMENT_NODE &&
+					    domain_owns(d, n)) {
+						xmlAddChild(to, xmlDocCopyNode(n, d->pe, 1));
+					}
+				}
+			}
 		}
+		d->pe_built = d->pe_edits;
+		d->status_xml = xmlNewChild(cib, NULL, BAD_CAST "status", NULL);
+		rebuilt = QB_TRUE;
 	}
 
-
-	for (child_node = cur_node->children; child_node;
-		child_node = child_node->next) {
-		if (child_node->type != XML_ELEMENT_NODE) {
+	qb_list_for_each(list, &d->assembly_head) {
+		a = qb_list_entry(list, struct assembly, domain_list);
+		if (!rebuilt && a->domain_state_xml &&
+		    a->domain_state_version == a->status_version) {
 			continue;
 		}
-		if (strcmp((char*)child_node->name, "configure_executable") == 0) {
-			configure_resource_create(cur_node, params_node, assembly);
-			break;
+		copy = xmlDocCopyNode(a->node_state_xml, d->pe, 1);
+		if (!rebuilt && a->domain_state_xml) {
+			xmlReplaceNode(a->domain_state_xml, copy);
+			xmlFreeNode(a->domain_state_xml);
+		} else {
+			xmlAddChild(d->status_xml, copy);
 		}
+		a->domain_state_xml = copy;
+		a->domain_state_version = a->status_version;
 	}
 
-	resource = calloc(1, sizeof (struct resource));
-	name = (char*)xmlGetProp(cur_node, BAD_CAST "name");
-	snprintf(resource_name, ASSEMBLY_NAME_MAX + RESOURCE_NAME_MAX + 6,
-		"rsc_%s_%s", assembly->name, name);
-	resource->name = strdup(resource_name);
-	type = (char*)xmlGetProp(cur_node, BAD_CAST "type");
-	resource->type = strdup(type);
-	rclass = (char*)xmlGetProp(cur_node, BAD_CAST "class");
-	resource->rclass = strdup(rclass);
-
-	rprovider = (char*)xmlGetProp(cur_node, BAD_CAST "provider");
-	if (rprovider) {
-		resource->rprovider = strdup(rprovider);
-	} else {
-		resource->rprovider = NULL;
-	}
-	escalation_failures = (char*)xmlGetProp(cur_node, BAD_CAST "escalation_failures");
-	escalation_period = (char*)xmlGetProp(cur_node, BAD_CAST "escalation_period");
-
-	recover_init(&resource->recover,
-		    escalation_failures, escalation_period,
-		    resource_recover_restart,
-		    resource_recover_escalate,
-		    resource_state_change_event);
-	resource->recover.instance = resource;
-
-	resource->assembly = assembly;
-	qb_map_put(assembly->resource_map, resource->name, resource);
+	qb_leave();
+}
 
-	if (strcmp(resource->rclass, "ocf") == 0) {
-		resource_add_ref_params(params_node, resource);
+/*
+ * First start of an assembly.  The state it had before a restart decides
+ * whether its instance is taken over: a failed one was about to be
+ * replaced and an unrecoverable one stays down.
+ */
+static void
+assembly_start(struct assembly *assembly)
+{
+	switch (assembly->checkpoint_state) {
+	case RECOVER_STATE_UNRECOVERABLE:
+		qb_log(LOG_NOTICE, "Assembly '%s' was unrecoverable before the restart",
+		       assembly->name);
+		recover_state_set(&assembly->recover, RECOVER_STATE_UNRECOVERABLE);
+		break;
+	case RECOVER_STATE_FAILED:
+		qb_log(LOG_NOTICE, "Assembly '%s' was failed before the restart, replacing it",
+		       assembly->name);
+		if (assembly->instance_id[0] != '\0') {
+			instance_destroy(assembly);
+			assembly->instance_id[0] = '\0';
+		}
+		assembly->adopt = QB_FALSE;
+		recover_state_set(&assembly->recover, RECOVER_STATE_FAILED);
+		break;
+	default:
+		/*
+		 * a running one is adopted, it counts as running again once
+		 * the transport connected
+		 */
+		instance_create(assembly);
+		break;
 	}
-
-	qb_leave();
 }
 
-static void resources_create(xmlNode *cur_node, struct assembly *assembly)
+static struct application *
+application_find(const char *name)
 {
-	qb_enter();
+	struct qb_list_head *list;
+	struct application *app;
 
-	for (; cur_node; cur_node = cur_node->next) {
-		if (cur_node->type != XML_ELEMENT_NODE) {
-			continue;
+	qb_list_for_each(list, &application_head) {
+		app = qb_list_entry(list, struct application, list);
+		if (strcmp(app->name, name) == 0) {
+			return app;
 		}
-		resource_create(cur_node, assembly);
 	}
+	return NULL;
+}
 
-	qb_leave();
+static void
+application_free(struct application *app)
+{
+	qb_list_del(&app->list);
+	qb_map_destroy(app->assembly_map);
+	qb_map_destroy(app->ref_param_index);
+	free(app->name);
+	free(app->uuid);
+	free(app);
 }
 
-static void assembly_create(xmlNode *cur_node)
+static struct application *
+application_create(xmlNode *dep_node)
 {
-	struct assembly *assembly;
+	struct application *app;
 	char *name;
 	char *uuid;
-	xmlNode *child_node;
-	char *escalation_failures;
-	char *escalation_period;
 
-	qb_enter();
+	app = calloc(1, sizeof(struct application));
+	app->assembly_map = qb_skiplist_create();
+	app->ref_param_index = qb_hashtable_create(64);
+	qb_list_init(&app->assembly_dirty_head);
+	qb_list_init(&app->op_history_dirty_head);
+	qb_list_init(&app->domain_head);
+	qb_list_init(&app->orphan_head);
 
-	assembly = calloc(1, sizeof (struct assembly));
-	name = (char*)xmlGetProp(cur_node, BAD_CAST "name");
-	assembly->name = strdup(name);
-	uuid = (char*)xmlGetProp(cur_node, BAD_CAST "uuid");
-	assembly->uuid = strdup(uuid);
-	assembly->resource_map = qb_skiplist_create();
-	assembly->sw_instance_create = qb_util_stopwatch_create();
-	assembly->sw_instance_connected = qb_util_stopwatch_create();
-	assembly->application = application;
+	name = (char*)xmlGetProp(dep_node, BAD_CAST "name");
+	app->name = strdup(name);
+	xmlFree(name);
+	uuid = (char*)xmlGetProp(dep_node, BAD_CAST "uuid");
+	app->uuid = strdup(uuid);
+	xmlFree(uuid);
 
-	escalation_failures = (char*)xmlGetProp(cur_node, BAD_CAST "escalation_failures");
-	escalation_period = (char*)xmlGetProp(cur_node, BAD_CAST "escalation_period");
+	qb_list_init(&app->list);
+	qb_list_add_tail(&app->list, &application_head);
 
-	recover_init(&assembly->recover,
-		    escalation_failures, escalation_period,
-		    node_recover_restart,
-		    node_recover_escalate,
-		    node_state_change_event);
-	assembly->recover.instance = assembly;
+	return app;
+}
 
-	instance_create(assembly);
-	qb_map_put(assembly_map, name, assembly);
+/*
+ * Bring the model of a deployable in line with config.  The cib is
+ * compiled again, but only assemblies and resources that were added or
+ * removed are created or torn down.  The others keep their transports
+ * and operation history, and one transition applies the difference.
+ *
+ * A deployable that does not compile leaves the model as it was.
+ */
+static int
+application_configure(struct application *app, xmlDocPtr config)
+{
+	xmlDocPtr pe_old = app->pe;
+	qb_map_iter_t *iter;
+	qb_map_iter_t *r_iter;
+	struct qb_list_head *list;
+	struct policy_domain *d;
+	struct assembly *assembly;
+	struct resource *resource;
 
-	for (child_node = cur_node->children; child_node;
-		child_node = child_node->next) {
-		if (child_node->type != XML_ELEMENT_NODE) {
+	qb_enter();
+
+	app->generation++;
+	if (cf2pe_compile(config, &compile_ops, app) == NULL) {
+		qb_log(LOG_ERR, "could not compile the deployable %s", app->name);
+		app->generation--;
+		xmlFreeDoc(config);
+		qb_leave();
+		return -EINVAL;
+	}
+
+	if (pe_old == NULL) {
+		checkpoint_restore(app);
+	}
+
+	iter = qb_map_iter_create(app->assembly_map);
+	while ((qb_map_iter_next(iter, (void **)&assembly)) != NULL) {
+		if (assembly->generation != app->generation) {
+			assembly_retire(assembly);
 			continue;
 		}
-		if (strcmp((char*)child_node->name, "services") == 0) {
-			resources_create(child_node->children, assembly);
+
+		r_iter = qb_map_iter_create(assembly->resource_map);
+		while ((qb_map_iter_next(r_iter, (void **)&resource)) != NULL) {
+			if (resource->generation != app->generation &&
+			    !resource->orphan) {
+				resource_orphan(resource);
+			}
 		}
+		qb_map_iter_free(r_iter);
 	}
+	qb_map_iter_free(iter);
 
-	qb_leave();
-}
-
-static void assemblies_create(xmlNode *xml)
-{
-	xmlNode *cur_node;
+	domains_build(app);
 
-	qb_enter();
+	iter = qb_map_iter_create(app->assembly_map);
+	while ((qb_map_iter_next(iter, (void **)&assembly)) != NULL) {
+		/*
+		 * only start the instances once every resource of the
+		 * deployable exists
+		 */
+		if (assembly->instance_pending) {
+			assembly->instance_pending = QB_FALSE;
+			assembly_start(assembly);
+		}
+	}
+	qb_map_iter_free(iter);
 
-        for (cur_node = xml; cur_node; cur_node = cur_node->next) {
-                if (cur_node->type != XML_ELEMENT_NODE) {
-                        continue;
-                }
-		assembly_create(cur_node);
+	if (app->config) {
+		xmlFreeDoc(app->config);
+	}
+	app->config = config;
+
+	if (pe_old) {
+		/*
+		 * transitions run on the cibs of the domains, a running one
+		 * keeps its domain until it completes
+		 */
+		xmlFreeDoc(pe_old);
+		if (process_sched.running == NULL ||
+		    process_sched.running->application != app) {
+			orphans_free(app);
+		}
+		qb_list_for_each(list, &app->domain_head) {
+			d = qb_list_entry(list, struct policy_domain, list);
+			schedule_processing(d);
+		}
 	}
 
 	qb_leave();
+	return 0;
 }
 
-static void
-parse_and_load(void)
+static int
+parse_and_load(xmlDocPtr config)
 {
-	char *name;
-	char *uuid;
-	xmlNode *cur_node;
+	struct application *app;
 	xmlNode *dep_node;
-        xsltStylesheetPtr ss;
-	const char *params[1];
+	char *name;
+	int rc;
 
 	qb_enter();
 
-	ss = xsltParseStylesheetFile(BAD_CAST "/usr/share/pacemaker-cloud/cf2pe.xsl");
-	params[0] = NULL;
-
-        _pe = xsltApplyStylesheet(ss, _config, params);
-        xsltFreeStylesheet(ss);
-        dep_node = xmlDocGetRootElement(_config);
-
-	application = calloc(1, sizeof(struct application));
+	if (config == NULL) {
+		qb_log(LOG_ERR, "could not parse the deployable");
+		qb_leave();
+		return -EINVAL;
+	}
 
+	dep_node = xmlDocGetRootElement(config);
 	name = (char*)xmlGetProp(dep_node, BAD_CAST "name");
-	application->name = strdup(name);
-	uuid = (char*)xmlGetProp(dep_node, BAD_CAST "uuid");
-	application->uuid = strdup(uuid);
-
-        for (cur_node = dep_node->children; cur_node;
-             cur_node = cur_node->next) {
-                if (cur_node->type == XML_ELEMENT_NODE) {
-                        if (strcmp((char*)cur_node->name, "assemblies") == 0) {
-				assemblies_create(cur_node->children);
-                        }
-                }
-        }
+	app = application_find(name);
+	if (app == NULL) {
+		app = application_create(dep_node);
+	} else {
+		qb_log(LOG_INFO, "reloading deployable %s", name);
+	}
+	xmlFree(name);
+
+	/* a deployable that never compiled is not kept around */
+	rc = application_configure(app, config);
+	if (rc != 0 && app->pe == NULL) {
+		application_free(app);
+	}
 
 	qb_leave();
+	return rc;
 }
 
-void
+int
 cape_load_from_buffer(const char *buffer)
 {
+	int rc;
+
 	qb_enter();
 
-	_config = xmlParseMemory(buffer, strlen(buffer));
-	parse_and_load();
+	rc = parse_and_load(xmlParseMemory(buffer, strlen(buffer)));
 
 	qb_leave();
+	return rc;
 }
 
 int
 cape_load(const char * name)
 {
 	char cfg[PATH_MAX];
+	int rc;
 
 	qb_enter();
 
 	snprintf(cfg, PATH_MAX, "/var/run/%s.xml", name);
 	if (access(cfg, R_OK) != 0) {
-		return -errno;
+		rc = -errno;
+		qb_leave();
+		return rc;
 	}
-	_config = xmlParseFile(cfg);
-	parse_and_load();
+	rc = parse_and_load(xmlParseFile(cfg));
 
 	qb_leave();
 
-	return 0;
+	return rc;
 }
 
 void
@@ -1120,24 +2861,35 @@ cape_init(int debug)
 	uuid_generate(uuid_temp_id);
 	uuid_unparse(uuid_temp_id, crmd_uuid);
 
-	assembly_map = qb_skiplist_create();
-	op_history_map = qb_skiplist_create();
+	timer_wheel_init(&monitor_wheel, QB_LOOP_LOW);
 
 	qb_leave();
 }
 
 void cape_exit(void)
 {
+	struct application *app;
 	struct assembly *assembly;
+	struct qb_list_head *list;
 	qb_map_iter_t *iter;
 
 	qb_enter();
 
-	iter = qb_map_iter_create(assembly_map);
-	while ((qb_map_iter_next(iter, (void **)&assembly)) != NULL) {
-		transport_disconnect(assembly);
+	qb_list_for_each(list, &application_head) {
+		app = qb_list_entry(list, struct application, list);
+		if (checkpoint_dir[0] != '\0') {
+			qb_loop_timer_del(NULL, app->checkpoint_timer);
+			checkpoint_write(app);
+		}
+		iter = qb_map_iter_create(app->assembly_map);
+		while ((qb_map_iter_next(iter, (void **)&assembly)) != NULL) {
+			transport_disconnect(assembly);
+		}
+		qb_map_iter_free(iter);
 	}
-	qb_map_iter_free(iter);
+
+	cape_stats_log();
+	pe_dump_exit();
 
 	qb_leave();
 }
@@ -36,6 +36,9 @@ extern "C" {
 #endif
 
 #include "pcmk_pe.h"
+#include "intern.h"
+#include "timer_wheel.h"
+#include "latency.h"
 
 /*
  * Limits of the system
@@ -47,21 +50,76 @@ extern "C" {
 #define OP_NAME_MAX 15			/* Maximum interval length in bytes */
 #define RESOURCE_COMMAND_MAX 4096	/* Command maximum */
 #define RESOURCE_ENVIRONMENT_MAX 2048	/* Maximum environment allowed */
+#define MONITOR_BATCH_MAX 16		/* Maximum monitors sent in one batch */
 
 /*
  * Timers of the system
  */
 #define KEEPALIVE_TIMEOUT 15		/* seconds */
 #define SSH_TIMEOUT 5000		/* milliseconds */
+#define SSH_CONNECT_RETRY 1000		/* milliseconds */
 #define PENDING_TIMEOUT 250		/* milliseconds */
 #define HEALTHCHECK_TIMEOUT 3000	/* milliseconds */
+#define PROCESS_SETTLE_TIMEOUT 50	/* milliseconds */
+#define PROCESS_MAX_LATENCY 500		/* milliseconds */
+#define MONITOR_BATCH_WINDOW 20		/* milliseconds */
+#define MONITOR_BATCH_TIMEOUT 60000	/* milliseconds, op timeouts of a batch */
+#define CHECKPOINT_INTERVAL 2000	/* milliseconds */
+#define CLOUD_OP_CONCURRENCY 4		/* instance creates in flight */
+#define CLOUD_OP_RATE 5			/* cloud requests per second */
+#define CLOUD_OP_BURST 10		/* cloud requests back to back */
 
 #define OCF_ROOT "/usr/lib/ocf"		/* OCF root directory */
+#define CHECKPOINT_DIR "/var/lib/pacemaker-cloud"	/* checkpoint directory */
 
+/*
+ * One deployable managed by this process
+ */
 struct application {
 	char *name;
 	char *uuid;
 	qb_map_t *node_map;
+	qb_map_t *assembly_map;
+	xmlDocPtr config;
+	xmlDocPtr pe;
+	xmlNode *status_xml;
+	qb_map_t *primitive_index;
+	qb_map_t *ref_param_index;
+	qb_map_t *resource_index;	/* resource name -> assembly */
+	uint32_t generation;		/* bumped by every (re)load */
+	struct qb_list_head domain_head;
+	uint32_t num_domains;
+	struct qb_list_head orphan_head;
+	int checkpoint_pending;
+	qb_loop_timer_handle checkpoint_timer;
+	struct qb_list_head assembly_dirty_head;
+	struct qb_list_head op_history_dirty_head;
+	struct qb_list_head list;
+};
+
+/*
+ * A set of assemblies with no ordering constraint or reference parameter
+ * to any assembly outside of it.  Each domain has its own cut of the cib
+ * and the policy engine only runs for the domains whose status changed.
+ */
+struct policy_domain {
+	struct application *application;
+	uint32_t id;
+	xmlDocPtr pe;
+	xmlNode *status_xml;
+	uint32_t pe_edits;		/* cib edits between reloads */
+	uint32_t pe_built;		/* pe_edits the cib was cut at */
+	uint64_t pe_fingerprint;	/* status of the last completed transition */
+	uint64_t pe_fingerprint_pending;
+	int pe_fingerprint_valid;
+	int process_dirty;
+	uint64_t process_dirty_since;
+	qb_loop_timer_handle process_timer;
+	struct qb_list_head process_run_list;
+	struct qb_list_head assembly_head;
+	uint32_t num_assemblies;
+	int retired;			/* replaced by a reload while running */
+	struct qb_list_head list;
 };
 
 enum recover_state {
@@ -97,47 +155,162 @@ void recover_init(struct recover* r,
 
 void recover_state_set(struct recover* r, enum recover_state state);
 
+/*
+ * Work that recovers a deployable goes ahead of routine monitoring
+ */
+enum cape_prio {
+	CAPE_PRIO_RECOVERY = 0,		/* transition actions and probes */
+	CAPE_PRIO_ROUTINE,		/* recurring monitors and healthchecks */
+	CAPE_PRIO_MAX
+};
+
+/*
+ * Operation outcomes, kept per (resource class, method) and per assembly
+ */
+struct cape_op_stats {
+	const char *rclass;		/* interned */
+	const char *method;		/* interned */
+	uint64_t timeouts;		/* overran op->timeout or never returned */
+	uint64_t failures;		/* results other than the target rc */
+	struct latency_histogram latency;	/* microseconds */
+	struct qb_list_head list;
+};
+
 struct assembly {
-	char *name;
-	char *uuid;
+	const char *name;		/* interned */
+	const char *uuid;		/* interned */
 	char *address;
 	char instance_id[64];
 	char image_id[64];
 	struct application *application;
+	struct policy_domain *domain;
+	struct qb_list_head domain_list;
+	struct assembly *domain_parent;	/* while the domains are built */
 	qb_map_t *resource_map;
 	int fd;
 	void *transport;
 	qb_util_stopwatch_t *sw_instance_create;
 	qb_util_stopwatch_t *sw_instance_connected;
 	struct recover recover;
+	xmlNode *node_state_xml;
+	xmlNode *lrm_resources_xml;
+	struct qb_list_head status_dirty_list;
+	uint32_t status_version;	/* bumped when node_state_xml changes */
+	xmlNode *domain_state_xml;	/* its copy in the domain cib */
+	uint32_t domain_state_version;	/* status_version of that copy */
+	struct pe_operation *monitor_batch[MONITOR_BATCH_MAX];
+	uint32_t monitor_batch_len;
+	qb_loop_timer_handle monitor_batch_timer;
+	uint32_t generation;		/* last (re)load it was configured in */
+	int instance_pending;
+	int adopt;			/* look for a running instance first */
+	int retired;
+	enum recover_state checkpoint_state;	/* last known before a restart */
+	struct cape_op_stats op_stats;
+	enum cape_prio cloud_prio;	/* of its cloud requests */
+	int cloud_slot;			/* holds an instance create slot */
 };
 
 struct reference_param {
 	char *name;
-	char *assembly;
+	const char *assembly;		/* interned */
 	char *parameter;
 	xmlNode *xmlnode;
+	struct qb_list_head referrer_list;	/* of the referenced assembly */
 };
 
 struct resource {
-	char *name;
-	char *type;
-	char *rclass;
-	char *rprovider;
+	const char *name;		/* interned */
+	const char *type;		/* interned */
+	const char *rclass;		/* interned */
+	const char *rprovider;		/* interned */
 	struct assembly *assembly;
 	struct pe_operation *monitor_op;
-	qb_loop_timer_handle monitor_timer;
+	struct timer_wheel_entry monitor_timer;
 	struct recover recover;
 	qb_map_t *ref_params_map;
+	qb_map_t *op_history_map;
+	int monitor_batched;
+	uint32_t generation;		/* last (re)load it was configured in */
+	int orphan;
+	struct qb_list_head orphan_list;
 };
 
 void resource_action_completed(struct pe_operation *op, enum ocf_exitcode rc);
 
+/*
+ * The transport gave up waiting for the result of op
+ */
+void resource_action_timedout(struct pe_operation *op);
+
 void cape_init(int debug);
 
+struct cape_process_stats {
+	uint64_t requested;	/* calls to schedule a policy engine run */
+	uint64_t coalesced;	/* requests merged into an already pending run */
+	uint64_t executed;	/* policy engine runs started */
+	uint64_t skipped;	/* runs skipped as the status was unchanged */
+	uint64_t aborted;	/* transitions aborted by a new failure */
+};
+
+void cape_process_window_set(uint32_t settle_msec, uint32_t max_latency_msec);
+
+void cape_process_stats_get(struct cape_process_stats *stats);
+
+/*
+ * Limits on the requests made to the cloud API, 0 means unlimited
+ */
+struct cape_cloud_limits {
+	uint32_t concurrency;	/* instance creates until the instance is active */
+	uint32_t rate;		/* requests per second */
+	uint32_t burst;		/* requests allowed back to back */
+};
+
+void cape_cloud_limits_set(uint32_t concurrency, uint32_t rate, uint32_t burst);
+
+void cape_cloud_limits_get(struct cape_cloud_limits *limits);
+
+void cape_monitor_stats_get(struct timer_wheel_stats *stats);
+
+/*
+ * Returns NULL until an operation of that class and method completed
+ */
+struct cape_op_stats *cape_op_stats_get(const char *rclass, const char *method);
+
+enum cape_prio cape_op_prio_get(struct pe_operation *op);
+
+/*
+ * The loop priority jobs of that class are run at
+ */
+enum qb_loop_priority cape_prio_loop_level(enum cape_prio prio);
+
+/*
+ * Transports report how long an operation waited in their queue
+ */
+void cape_queue_wait_record(enum cape_prio prio, uint64_t wait_us);
+
+struct latency_histogram *cape_queue_wait_get(enum cape_prio prio);
+
+/*
+ * Log the scheduler, monitor, pool and operation latency statistics
+ */
+void cape_stats_log(void);
+
+/*
+ * Loading a deployable that is already managed applies the difference
+ * between the new and the current configuration.  Returns 0 or -errno,
+ * a deployable that does not parse or compile is rejected with -EINVAL
+ * and the one already managed keeps running as it was.
+ */
 int cape_load(const char * name);
 
-void cape_load_from_buffer(const char *buffer);
+/*
+ * Where checkpoints are kept, they are disabled until this is called.
+ * NULL disables them again.
+ */
+void cape_checkpoint_dir_set(const char *dir);
+
+int cape_load_from_buffer(const char *buffer);
 
 int32_t cape_admin_init(void);
 
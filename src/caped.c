@@ -26,6 +26,7 @@
 #include <pacemaker/crm_config.h>
 
 #include "cape.h"
+#include "pe_dump.h"
 
 #define LOG_TAG_QPID 1
 #define LOG_TAG_GLIB 2
@@ -86,13 +87,28 @@ static void
 show_usage(const char *name)
 {
 	printf("usage: \n");
-	printf("%s <options> [cloud app name]\n", name);
+	printf("%s <options> [cloud app name]...\n", name);
 	printf("\n");
 	printf("  options:\n");
 	printf("\n");
 	printf("  -v             verbose\n");
-	printf("  -g             debug\n");
+	printf("  -g             debug, record the policy engine inputs to\n");
+	printf("                 <dir>/cape-<first cloud app name>\n");
+	printf("  -gg            as -g and validate the inputs against the schema\n");
+	printf("  -D <dir>       directory for the inputs recorded (default %s)\n",
+	       PE_DUMP_DIR);
 	printf("  -o             log to stdout\n");
+	printf("  -p             compute transitions in a helper process\n");
+	printf("  -w <msec>      policy engine settle window (default %d)\n",
+	       PROCESS_SETTLE_TIMEOUT);
+	printf("  -m <msec>      policy engine maximum latency (default %d)\n",
+	       PROCESS_MAX_LATENCY);
+	printf("  -c <num>       instance creates in flight (default %d, 0 unlimited)\n",
+	       CLOUD_OP_CONCURRENCY);
+	printf("  -r <num>       cloud requests per second (default %d, 0 unlimited)\n",
+	       CLOUD_OP_RATE);
+	printf("  -b <num>       cloud request burst (default %d)\n",
+	       CLOUD_OP_BURST);
 	printf("  -h             show this help text\n");
 	printf("\n");
 }
@@ -106,17 +122,56 @@ signal_int(int32_t rsignal, void *data)
 	return -1;
 }
 
+static char **app_names;
+static int num_app_names;
+
+/*
+ * reload the configuration of every deployable, only what changed in
+ * them is applied
+ */
+static int32_t
+signal_hup(int32_t rsignal, void *data)
+{
+	int i;
+	int rc;
+
+	qb_log(LOG_INFO, "reloading on signal %d", rsignal);
+	for (i = 0; i < num_app_names; i++) {
+		rc = cape_load(app_names[i]);
+		if (rc != 0) {
+			qb_log(LOG_ERR, "failed to reload the configuration of %s: %s",
+			       app_names[i], strerror(-rc));
+		}
+	}
+	return 0;
+}
+
+static int32_t
+signal_usr1(int32_t rsignal, void *data)
+{
+	cape_stats_log();
+	return 0;
+}
+
 int
 main(int argc, char * argv[])
 {
-	const char *options = "vhodg";
+	const char *options = "vhodgpw:m:c:r:b:D:";
 	int32_t opt;
 	int32_t do_stdout = QB_FALSE;
 	int daemonize = 0;
 	int debug = 0;
 	int loglevel = LOG_INFO;
+	uint32_t settle_msec = PROCESS_SETTLE_TIMEOUT;
+	uint32_t max_latency_msec = PROCESS_MAX_LATENCY;
+	uint32_t cloud_concurrency = CLOUD_OP_CONCURRENCY;
+	uint32_t cloud_rate = CLOUD_OP_RATE;
+	uint32_t cloud_burst = CLOUD_OP_BURST;
+	const char *dump_base = PE_DUMP_DIR;
+	char dump_dir[PATH_MAX];
 	qb_loop_t *loop;
-	char *cloud_app = NULL;
+	int i;
+	int rc;
 	char *prog_name = strrchr(argv[0], '/');
 
 	if (prog_name) {
@@ -139,6 +194,27 @@ main(int argc, char * argv[])
 		case 'g':
 			debug++;
 			break;
+		case 'p':
+			pe_offload_set(QB_TRUE);
+			break;
+		case 'w':
+			settle_msec = strtoul(optarg, NULL, 10);
+			break;
+		case 'm':
+			max_latency_msec = strtoul(optarg, NULL, 10);
+			break;
+		case 'c':
+			cloud_concurrency = strtoul(optarg, NULL, 10);
+			break;
+		case 'r':
+			cloud_rate = strtoul(optarg, NULL, 10);
+			break;
+		case 'b':
+			cloud_burst = strtoul(optarg, NULL, 10);
+			break;
+		case 'D':
+			dump_base = optarg;
+			break;
 		case 'h':
 		default:
 			show_usage(argv[0]);
@@ -147,9 +223,7 @@ main(int argc, char * argv[])
 		}
 	}
 
-	if (optind < argc) {
-		cloud_app =  argv[optind];
-	} else {
+	if (optind >= argc) {
 		show_usage(prog_name);
 		exit(EXIT_FAILURE);
 	}
@@ -171,16 +245,37 @@ main(int argc, char * argv[])
 	loop = qb_loop_create();
 
 	qb_loop_signal_add(NULL, QB_LOOP_LOW, SIGINT, NULL, signal_int, NULL);
+	qb_loop_signal_add(NULL, QB_LOOP_LOW, SIGHUP, NULL, signal_hup, NULL);
+	qb_loop_signal_add(NULL, QB_LOOP_LOW, SIGUSR1, NULL, signal_usr1, NULL);
 
+	cape_checkpoint_dir_set(CHECKPOINT_DIR);
+	/*
+	 * one caped runs per deployable, each keeps its own ring of dumps
+	 */
+	snprintf(dump_dir, PATH_MAX, "%s/cape-%s", dump_base, argv[optind]);
+	pe_dump_config_set(dump_dir, PE_DUMP_MAX_FILES, PE_DUMP_MAX_BYTES,
+			   debug > 1);
 	cape_init(debug);
+	cape_process_window_set(settle_msec, max_latency_msec);
+	cape_cloud_limits_set(cloud_concurrency, cloud_rate, cloud_burst);
 
 	cape_admin_init();
 
-	if (cape_load(cloud_app) != 0) {
-		qb_perror(LOG_ERR, "failed to load the configuration");
-		qb_log_fini();
-		exit(EXIT_FAILURE);
+	/*
+	 * every deployable named on the command line is managed by
+	 * this one process
+	 */
+	for (i = optind; i < argc; i++) {
+		rc = cape_load(argv[i]);
+		if (rc != 0) {
+			qb_log(LOG_ERR, "failed to load the configuration of %s: %s",
+			       argv[i], strerror(-rc));
+			qb_log_fini();
+			exit(EXIT_FAILURE);
+		}
 	}
+	app_names = &argv[optind];
+	num_app_names = argc - optind;
 
 	qb_loop_run(loop);
 
@@ -0,0 +1,509 @@
+/*
+ * Copyright (C) 2012 Red Hat, Inc.
+ *
+ * Authors: Steven Dake <sdake@redhat.com>
+ *          Angus Salkeld <asalkeld@redhat.com>
+ *
+ * This file is part of pacemaker-cloud.
+ *
+ * pacemaker-cloud is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * pacemaker-cloud is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pacemaker-cloud.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <qb/qbdefs.h>
+#include <qb/qblog.h>
+#include <libxml/parser.h>
+#include <libxml/tree.h>
+
+#include "cf2pe.h"
+
+/*
+ * A native translation of cf2pe.xsl.  The deployable is walked once, the
+ * nodes, resources and constraints sections are filled in as each
+ * assembly and service is visited.
+ */
+
+/*
+ * ids are "<prefix>_<assembly>_<service>", the prefixes are short
+ */
+#define ID_MAX (2 * CF2PE_NAME_MAX + 32)
+
+static int
+is_element(xmlNode *n, const char *name)
+{
+	return n->type == XML_ELEMENT_NODE &&
+		strcmp((char*)n->name, name) == 0;
+}
+
+static xmlNode *
+child_get(xmlNode *parent, const char *name)
+{
+	xmlNode *n;
+
+	for (n = parent->children; n; n = n->next) {
+		if (is_element(n, name)) {
+			return n;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Copy an attribute, an absent one is copied as the empty string like
+ * <xsl:value-of select="@name"/> does.
+ */
+static void
+prop_copy(xmlNode *to, const char *to_name, xmlNode *from, const char *name)
+{
+	xmlChar *val = xmlGetProp(from, BAD_CAST name);
+
+	xmlNewProp(to, BAD_CAST to_name, val ? val : BAD_CAST "");
+	xmlFree(val);
+}
+
+static void
+prop_printf(xmlNode *to, const char *name, const char *format,
+	    const char *a, const char *b)
+{
+	char buf[ID_MAX];
+
+	snprintf(buf, ID_MAX, format, a, b);
+	xmlNewProp(to, BAD_CAST name, BAD_CAST buf);
+}
+
+static xmlNode *
+nvpair_add(xmlNode *parent, const char *id, const char *name, const char *value)
+{
+	xmlNode *nvpair = xmlNewChild(parent, NULL, BAD_CAST "nvpair", NULL);
+
+	xmlNewProp(nvpair, BAD_CAST "id", BAD_CAST id);
+	xmlNewProp(nvpair, BAD_CAST "name", BAD_CAST name);
+	xmlNewProp(nvpair, BAD_CAST "value", BAD_CAST value);
+	return nvpair;
+}
+
+static void
+crm_config_add(xmlNode *config)
+{
+	xmlNode *crm_config = xmlNewChild(config, NULL, BAD_CAST "crm_config", NULL);
+	xmlNode *props;
+	xmlNode *rsc_defaults;
+	xmlNode *meta;
+
+	props = xmlNewChild(crm_config, NULL, BAD_CAST "cluster_property_set", NULL);
+	xmlNewProp(props, BAD_CAST "id", BAD_CAST "bootstrap-options");
+	nvpair_add(props, "opt-startup-fencing", "startup-fencing", "false");
+	nvpair_add(props, "opt-health-strategy", "node-health-strategy", "none");
+	nvpair_add(props, "opt-no-start-failure", "start-failure-is-fatal", "false");
+	nvpair_add(props, "opt-not-symmetric", "symmetric-cluster", "false");
+	nvpair_add(props, "opt-stonith-disabled", "stonith-enabled", "false");
+	nvpair_add(props, "opt-no-quorum-policy", "no-quorum-policy", "ignore");
+
+	rsc_defaults = xmlNewChild(config, NULL, BAD_CAST "rsc_defaults", NULL);
+	meta = xmlNewChild(rsc_defaults, NULL, BAD_CAST "meta_attributes", NULL);
+	xmlNewProp(meta, BAD_CAST "id", BAD_CAST "opt1");
+	nvpair_add(meta, "rsc-default-2", "is-managed-default", "true");
+	meta = xmlNewChild(rsc_defaults, NULL, BAD_CAST "meta_attributes", NULL);
+	xmlNewProp(meta, BAD_CAST "id", BAD_CAST "opt2");
+	nvpair_add(meta, "rsc-default-3", "multiple-active", "stop_start");
+}
+
+/*
+ * <parameters><parameter name="x"><value>y</value></parameter></parameters>
+ */
+static void
+parameters_add(xmlNode *insts, xmlNode *service)
+{
+	xmlNode *params;
+	xmlNode *param;
+	xmlNode *value;
+	xmlNode *nvpair;
+	xmlChar *name;
+	xmlChar *content;
+	char id[ID_MAX];
+
+	for (params = service->children; params; params = params->next) {
+		if (!is_element(params, "parameters")) {
+			continue;
+		}
+		for (param = params->children; param; param = param->next) {
+			if (!is_element(param, "parameter")) {
+				continue;
+			}
+			name = xmlGetProp(param, BAD_CAST "name");
+			value = child_get(param, "value");
+			content = value ? xmlNodeGetContent(value) : NULL;
+
+			snprintf(id, ID_MAX, "param_%s", name ? (char*)name : "");
+			nvpair = xmlNewChild(insts, NULL, BAD_CAST "nvpair", NULL);
+			xmlNewProp(nvpair, BAD_CAST "id", BAD_CAST id);
+			xmlNewProp(nvpair, BAD_CAST "name",
+				   name ? name : BAD_CAST "");
+			xmlNewProp(nvpair, BAD_CAST "value",
+				   content ? content : BAD_CAST "");
+			xmlFree(name);
+			xmlFree(content);
+		}
+	}
+}
+
+static xmlNode *
+instance_attributes_add(xmlNode *primitive, const char *svc_name)
+{
+	xmlNode *insts;
+
+	insts = xmlNewChild(primitive, NULL, BAD_CAST "instance_attributes", NULL);
+	prop_printf(insts, "id", "attrs_%s%s", svc_name, "");
+	return insts;
+}
+
+static xmlNode *
+primitive_add(xmlNode *resources, xmlNode *service,
+	      const char *ass_name, const char *svc_name)
+{
+	xmlNode *primitive;
+	xmlNode *ops;
+	xmlNode *op;
+	xmlChar *rclass;
+
+	primitive = xmlNewChild(resources, NULL, BAD_CAST "primitive", NULL);
+	prop_printf(primitive, "id", "rsc_%s_%s", ass_name, svc_name);
+	prop_copy(primitive, "class", service, "class");
+	prop_copy(primitive, "type", service, "type");
+
+	rclass = xmlGetProp(service, BAD_CAST "class");
+	if (rclass && strcmp((char*)rclass, "ocf") == 0) {
+		prop_copy(primitive, "provider", service, "provider");
+		parameters_add(instance_attributes_add(primitive, svc_name),
+			       service);
+	}
+	xmlFree(rclass);
+
+	ops = xmlNewChild(primitive, NULL, BAD_CAST "operations", NULL);
+	op = xmlNewChild(ops, NULL, BAD_CAST "op", NULL);
+	prop_printf(op, "id", "monitor_%s_%s", ass_name, svc_name);
+	xmlNewProp(op, BAD_CAST "name", BAD_CAST "monitor");
+	prop_copy(op, "interval", service, "monitor_interval");
+
+	return primitive;
+}
+
+static xmlNode *
+cfg_primitive_add(xmlNode *resources, xmlNode *service, xmlNode *cfg_exec,
+		  const char *ass_name, const char *svc_name)
+{
+	xmlNode *primitive;
+	xmlNode *insts;
+	xmlChar *url;
+	char id[ID_MAX];
+
+	primitive = xmlNewChild(resources, NULL, BAD_CAST "primitive", NULL);
+	prop_printf(primitive, "id", "cfg_%s_%s", ass_name, svc_name);
+	xmlNewProp(primitive, BAD_CAST "class", BAD_CAST "ocf");
+	xmlNewProp(primitive, BAD_CAST "type", BAD_CAST "script_runner");
+	xmlNewProp(primitive, BAD_CAST "provider", BAD_CAST "pacemaker-cloud");
+
+	insts = instance_attributes_add(primitive, svc_name);
+	url = xmlGetProp(cfg_exec, BAD_CAST "url");
+	snprintf(id, ID_MAX, "param_url_%s", svc_name);
+	nvpair_add(insts, id, "executable_url", url ? (char*)url : "");
+	xmlFree(url);
+	parameters_add(insts, service);
+
+	return primitive;
+}
+
+static void
+rsc_location_add(xmlNode *constraints, const char *prefix,
+		 const char *ass_name, const char *svc_name)
+{
+	xmlNode *loc = xmlNewChild(constraints, NULL, BAD_CAST "rsc_location", NULL);
+	char id[ID_MAX];
+	char rsc[ID_MAX];
+
+	snprintf(id, ID_MAX, "loc_%s%s_%s", prefix, ass_name, svc_name);
+	snprintf(rsc, ID_MAX, "%s_%s_%s", prefix[0] ? "cfg" : "rsc",
+		 ass_name, svc_name);
+	xmlNewProp(loc, BAD_CAST "id", BAD_CAST id);
+	xmlNewProp(loc, BAD_CAST "rsc", BAD_CAST rsc);
+	xmlNewProp(loc, BAD_CAST "score", BAD_CAST "INFINITY");
+	xmlNewProp(loc, BAD_CAST "node", BAD_CAST ass_name);
+}
+
+static void
+service_compile(xmlNode *resources, xmlNode *constraints, xmlNode *service,
+		const char *ass_name, const struct cf2pe_ops *ops,
+		void *user_data, void *assembly)
+{
+	xmlNode *primitive;
+	xmlNode *cfg_primitive = NULL;
+	xmlNode *cfg_exec;
+	xmlNode *order;
+	xmlChar *name;
+	const char *svc_name;
+
+	name = xmlGetProp(service, BAD_CAST "name");
+	svc_name = name ? (char*)name : "";
+
+	primitive = primitive_add(resources, service, ass_name, svc_name);
+	cfg_exec = child_get(service, "configure_executable");
+	if (cfg_exec) {
+		cfg_primitive = cfg_primitive_add(resources, service, cfg_exec,
+						  ass_name, svc_name);
+	}
+
+	rsc_location_add(constraints, "", ass_name, svc_name);
+	if (cfg_exec) {
+		order = xmlNewChild(constraints, NULL, BAD_CAST "rsc_order", NULL);
+		prop_printf(order, "id", "depend_%s_%s", ass_name, svc_name);
+		prop_printf(order, "first", "cfg_%s_%s", ass_name, svc_name);
+		prop_printf(order, "then", "rsc_%s_%s", ass_name, svc_name);
+		xmlNewProp(order, BAD_CAST "score", BAD_CAST "INFINITY");
+		rsc_location_add(constraints, "cfg_", ass_name, svc_name);
+	}
+
+	if (ops && ops->service) {
+		ops->service(user_data, assembly, service,
+			     primitive, cfg_primitive);
+	}
+	xmlFree(name);
+}
+
+static void
+assembly_compile(xmlNode *nodes, xmlNode *resources, xmlNode *constraints,
+		 xmlNode *assembly_xml, const struct cf2pe_ops *ops,
+		 void *user_data)
+{
+	xmlNode *node;
+	xmlNode *services;
+	xmlNode *service;
+	xmlChar *name;
+	const char *ass_name;
+	void *assembly = NULL;
+
+	name = xmlGetProp(assembly_xml, BAD_CAST "name");
+	ass_name = name ? (char*)name : "";
+
+	node = xmlNewChild(nodes, NULL, BAD_CAST "node", NULL);
+	prop_copy(node, "id", assembly_xml, "uuid");
+	prop_copy(node, "uname", assembly_xml, "name");
+	xmlNewProp(node, BAD_CAST "type", BAD_CAST "normal");
+
+	if (ops && ops->assembly) {
+		assembly = ops->assembly(user_data, assembly_xml);
+	}
+
+	for (services = assembly_xml->children; services;
+	     services = services->next) {
+		if (!is_element(services, "services")) {
+			continue;
+		}
+		for (service = services->children; service;
+		     service = service->next) {
+			if (is_element(service, "service")) {
+				service_compile(resources, constraints, service,
+						ass_name, ops, user_data,
+						assembly);
+			}
+		}
+	}
+	xmlFree(name);
+}
+
+static void
+dependancies_compile(xmlNode *constraints, xmlNode *deps)
+{
+	xmlNode *dep;
+	xmlNode *order;
+	xmlChar *id;
+
+	for (dep = deps->children; dep; dep = dep->next) {
+		if (!is_element(dep, "service_dependancy")) {
+			continue;
+		}
+		id = xmlGetProp(dep, BAD_CAST "id");
+		order = xmlNewChild(constraints, NULL, BAD_CAST "rsc_order", NULL);
+		prop_printf(order, "id", "depend_%s%s", id ? (char*)id : "", "");
+		prop_copy(order, "first", dep, "first");
+		prop_copy(order, "then", dep, "then");
+		xmlNewProp(order, BAD_CAST "score", BAD_CAST "INFINITY");
+		xmlFree(id);
+	}
+}
+
+static int
+name_check(xmlNode *n, const char *what)
+{
+	const char *attr = strcmp(what, "dependency") == 0 ? "id" : "name";
+	xmlChar *name = xmlGetProp(n, BAD_CAST attr);
+	int rc = 0;
+
+	if (name && strlen((char*)name) >= CF2PE_NAME_MAX) {
+		qb_log(LOG_ERR, "%s name longer than %d bytes: %.64s...",
+		       what, CF2PE_NAME_MAX - 1, (char*)name);
+		rc = -1;
+	}
+	xmlFree(name);
+	return rc;
+}
+
+static int
+service_check(xmlNode *service)
+{
+	xmlNode *params;
+	xmlNode *param;
+
+	if (name_check(service, "service") != 0) {
+		return -1;
+	}
+	for (params = service->children; params; params = params->next) {
+		if (!is_element(params, "parameters")) {
+			continue;
+		}
+		for (param = params->children; param; param = param->next) {
+			if (is_element(param, "parameter") &&
+			    name_check(param, "parameter") != 0) {
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+static int
+assembly_check(xmlNode *assembly_xml)
+{
+	xmlNode *services;
+	xmlNode *service;
+
+	if (name_check(assembly_xml, "assembly") != 0) {
+		return -1;
+	}
+	for (services = assembly_xml->children; services;
+	     services = services->next) {
+		if (!is_element(services, "services")) {
+			continue;
+		}
+		for (service = services->children; service;
+		     service = service->next) {
+			if (is_element(service, "service") &&
+			    service_check(service) != 0) {
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+ * Every generated id fits in ID_MAX once the names do, so the deployable
+ * is checked up front and a compile either fails before the callbacks
+ * built anything or succeeds.
+ */
+static int
+deployable_check(xmlNode *dep_node)
+{
+	xmlNode *cur;
+	xmlNode *n;
+
+	for (cur = dep_node->children; cur; cur = cur->next) {
+		if (is_element(cur, "assemblies")) {
+			for (n = cur->children; n; n = n->next) {
+				if (is_element(n, "assembly") &&
+				    assembly_check(n) != 0) {
+					return -1;
+				}
+			}
+		} else if (is_element(cur, "constraints")) {
+			for (n = cur->children; n; n = n->next) {
+				if (is_element(n, "service_dependancy") &&
+				    name_check(n, "dependency") != 0) {
+					return -1;
+				}
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+ * External API
+ */
+xmlDocPtr
+cf2pe_compile(xmlDocPtr config, const struct cf2pe_ops *ops, void *user_data)
+{
+	xmlNode *dep_node = xmlDocGetRootElement(config);
+	xmlDocPtr pe;
+	xmlNode *cib;
+	xmlNode *configuration;
+	xmlNode *nodes;
+	xmlNode *resources;
+	xmlNode *constraints;
+	xmlNode *cur;
+	xmlNode *assembly_xml;
+
+	qb_enter();
+
+	if (dep_node == NULL || !is_element(dep_node, "deployable")) {
+		qb_log(LOG_ERR, "not a deployable");
+		qb_leave();
+		return NULL;
+	}
+	if (deployable_check(dep_node) != 0) {
+		qb_leave();
+		return NULL;
+	}
+
+	pe = xmlNewDoc(BAD_CAST "1.0");
+	cib = xmlNewDocNode(pe, NULL, BAD_CAST "cib", NULL);
+	xmlDocSetRootElement(pe, cib);
+	xmlNewProp(cib, BAD_CAST "admin_epoch", BAD_CAST "1");
+	xmlNewProp(cib, BAD_CAST "epoch", BAD_CAST "1");
+	xmlNewProp(cib, BAD_CAST "num_updates", BAD_CAST "1");
+	xmlNewProp(cib, BAD_CAST "have-quorum", BAD_CAST "1");
+	xmlNewProp(cib, BAD_CAST "dc-uuid", BAD_CAST "0");
+	xmlNewProp(cib, BAD_CAST "validate-with", BAD_CAST "pacemaker-1.2");
+
+	configuration = xmlNewChild(cib, NULL, BAD_CAST "configuration", NULL);
+	crm_config_add(configuration);
+	nodes = xmlNewChild(configuration, NULL, BAD_CAST "nodes", NULL);
+	resources = xmlNewChild(configuration, NULL, BAD_CAST "resources", NULL);
+	constraints = xmlNewChild(configuration, NULL, BAD_CAST "constraints", NULL);
+
+	if (ops && ops->cib_created) {
+		ops->cib_created(user_data, pe);
+	}
+
+	for (cur = dep_node->children; cur; cur = cur->next) {
+		if (!is_element(cur, "assemblies")) {
+			continue;
+		}
+		for (assembly_xml = cur->children; assembly_xml;
+		     assembly_xml = assembly_xml->next) {
+			if (is_element(assembly_xml, "assembly")) {
+				assembly_compile(nodes, resources, constraints,
+						 assembly_xml, ops, user_data);
+			}
+		}
+	}
+
+	for (cur = dep_node->children; cur; cur = cur->next) {
+		if (is_element(cur, "constraints")) {
+			dependancies_compile(constraints, cur);
+		}
+	}
+
+	qb_leave();
+	return pe;
+}
@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2012 Red Hat, Inc.
+ *
+ * Authors: Steven Dake <sdake@redhat.com>
+ *          Angus Salkeld <asalkeld@redhat.com>
+ *
+ * This file is part of pacemaker-cloud.
+ *
+ * pacemaker-cloud is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * pacemaker-cloud is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pacemaker-cloud.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef CF2PE_H_DEFINED
+#define CF2PE_H_DEFINED
+
+#include <libxml/parser.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Called while the deployable is compiled, so the caller can build its
+ * own model in the same pass.
+ *
+ * cib_created is called once the cib and configuration elements exist.
+ * service is called with the primitive of the service and, when the
+ * service has a configure_executable, the primitive of its configure
+ * resource (otherwise NULL).  The value returned by assembly is handed
+ * to service for every service of that assembly.
+ */
+struct cf2pe_ops {
+	void (*cib_created)(void *user_data, xmlDocPtr pe);
+	void *(*assembly)(void *user_data, xmlNode *assembly_xml);
+	void (*service)(void *user_data, void *assembly,
+			xmlNode *service_xml,
+			xmlNode *primitive_xml,
+			xmlNode *cfg_primitive_xml);
+};
+
+/*
+ * Longest assembly, service, parameter or dependency name accepted, the
+ * same as ASSEMBLY_NAME_MAX and RESOURCE_NAME_MAX in cape.h
+ */
+#define CF2PE_NAME_MAX 1024
+
+/*
+ * Translate a deployable into a pacemaker CIB, this gives the same
+ * document as applying cf2pe.xsl.  ops may be NULL.
+ *
+ * A deployable that can not be translated, for example one with a name
+ * longer than CF2PE_NAME_MAX, gives NULL before any of the ops is called.
+ */
+xmlDocPtr cf2pe_compile(xmlDocPtr config, const struct cf2pe_ops *ops,
+			void *user_data);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CF2PE_H_DEFINED */
@@ -20,6 +20,7 @@
  * along with pacemaker-cloud.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <errno.h>
 #include <qb/qblog.h>
 #include <libdeltacloud/libdeltacloud.h>
 
@@ -49,18 +50,26 @@ void instance_state_get(char *instance_id,
 	}
 
 	rc = deltacloud_get_instance_by_id(&api, instance_id, &instance);
-	if (strcmp(instance.state, "RUNNING") == 0 && instance.private_addresses->address) {
+	if (rc < 0) {
+		completion_func("UNKNOWN", NULL, data);
+	} else if (strcmp(instance.state, "RUNNING") == 0 &&
+		   instance.private_addresses &&
+		   instance.private_addresses->address) {
 		completion_func("ACTIVE", instance.private_addresses->address, data);
-	} else {
+	} else if (strcmp(instance.state, "PENDING") == 0) {
 		completion_func("PENDING", NULL, data);
+	} else {
+		completion_func(instance.state, NULL, data);
 	}
 }
 
 void instance_create_from_image_id(char *image_id,
+	const char *instance_name,
 	void (*completion_func)(char *instance_id, void *data),
 	void *data)
 {
 	struct deltacloud_api api;
+	struct deltacloud_create_parameter param;
 	char *instance_id;
 	int rc;
 
@@ -72,7 +81,9 @@ void instance_create_from_image_id(char *image_id,
 		qb_leave();
 		return;
 	}
-	rc = deltacloud_create_instance(&api, image_id, NULL, 0, &instance_id);
+	deltacloud_prepare_parameter(&param, "name", instance_name);
+	rc = deltacloud_create_instance(&api, image_id, &param, 1, &instance_id);
+	deltacloud_free_parameter_value(&param);
 	if (rc < 0) {
 		qb_log(LOG_ERR, "Failed to initialize libdeltacloud: %s",
 		       deltacloud_get_last_error_string());
@@ -85,7 +96,7 @@ void instance_create_from_image_id(char *image_id,
 }
 
 
-void image_id_get(char *image_name,
+void image_id_get(const char *image_name,
 	void (*completion_func)(char *image_id, void *data),
 	void *data)
 {
@@ -125,6 +136,51 @@ void image_id_get(char *image_name,
 	qb_leave();
 }
 
+void instance_find_by_name(const char *instance_name,
+	void (*completion_func)(int32_t rc, char *instance_id, void *data),
+	void *data)
+{
+	struct deltacloud_api api;
+	struct deltacloud_instance *instances_head;
+	struct deltacloud_instance *instances;
+	int rc;
+
+	qb_enter();
+
+	if (deltacloud_initialize(&api, "http://localhost:3001/api",
+				  "dep-wp", "") < 0) {
+		qb_log(LOG_ERR, "Failed to initialize libdeltacloud: %s",
+		       deltacloud_get_last_error_string());
+
+		completion_func(-EIO, NULL, data);
+		qb_leave();
+		return;
+	}
+	rc = deltacloud_get_instances(&api, &instances);
+	if (rc < 0) {
+		qb_log(LOG_ERR, "Failed to list instances: %s",
+		       deltacloud_get_last_error_string());
+
+		completion_func(-EIO, NULL, data);
+		deltacloud_free(&api);
+		qb_leave();
+		return;
+	}
+
+	for (instances_head = instances; instances; instances = instances->next) {
+		if (instances->name &&
+		    strcmp(instances->name, instance_name) == 0 &&
+		    strcmp(instances->state, "STOPPED") != 0) {
+			break;
+		}
+	}
+	completion_func(0, instances ? instances->id : NULL, data);
+	deltacloud_free_instance_list(&instances_head);
+	deltacloud_free(&api);
+
+	qb_leave();
+}
+
 void instance_destroy_by_instance_id(char *instance_id,
 	void (*completion_func)(void *data),
 	void *data)
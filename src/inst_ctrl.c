@@ -25,6 +25,7 @@
 #include <assert.h>
 #include <curl/curl.h>
 #include <memory.h>
+#include <limits.h>
 #include <libxml2/libxml/parser.h>
 #include <qb/qbutil.h>
 
@@ -33,16 +34,65 @@
 #include "cape.h"
 #include "trans.h"
 #include "inst_ctrl.h"
+#include "pool.h"
 
 /*
- * Internal implementation
+ * Cloud operations
+ *
+ * Every call into the cloud API is queued here and run one per main loop
+ * iteration, as the API calls block.  Requests are paced by a token
+ * bucket and instance creates are limited in number until the instance is
+ * active.  Recovering assemblies of running deployables go first.
  */
+enum cloud_op_type {
+	CLOUD_OP_BOOT,
+	CLOUD_OP_POLL,
+	CLOUD_OP_ADOPT_POLL,
+	CLOUD_OP_ADOPT_FIND,
+	CLOUD_OP_DESTROY,
+};
+
+struct cloud_op {
+	enum cloud_op_type type;
+	struct assembly *assembly;
+	char instance_id[64];
+	struct qb_list_head list;
+};
+
+static struct {
+	struct qb_list_head queue[CAPE_PRIO_MAX];
+	uint32_t in_flight;		/* creates not active yet */
+	uint64_t tokens;		/* thousandths of a request */
+	uint64_t refilled;		/* nanoseconds */
+	int scheduled;
+	qb_loop_timer_handle timer;
+} cloud_sched;
+
+static struct pool cloud_op_pool = POOL_INITIALIZER("cloud_op",
+						    struct cloud_op, 16);
+
+static void cloud_op_queue(struct assembly *assembly, enum cloud_op_type type);
+
+static void cloud_sched_kick(void);
+
 static void instance_state_completion(char *state, char *address, void *data);
 
+static void instance_adopt_state_completion(char *state, char *address, void *data);
+
+static void instance_adopt_find_completion(int32_t rc, char *instance_id, void *data);
+
 static void my_instance_state_get(void *data)
 {
 	struct assembly *assembly = (struct assembly *)data;
-	instance_state_get(assembly->instance_id, instance_state_completion, data);
+
+	cloud_op_queue(assembly, CLOUD_OP_POLL);
+}
+
+static void my_instance_find(void *data)
+{
+	struct assembly *assembly = (struct assembly *)data;
+
+	cloud_op_queue(assembly, CLOUD_OP_ADOPT_FIND);
 }
 
 static void image_id_get_completion(char *image_id, void *data)
@@ -61,16 +111,36 @@ static void instance_create_completion(char *instance_id, void *data)
 
 static void instance_destroy_completion(void *data)
 {
-	struct assembly *assembly = (struct assembly *)data;
+	struct cloud_op *op = (struct cloud_op *)data;
 
-	assembly->instance_id[0] = '\0';
+	/*
+	 * the assembly may have booted a new instance meanwhile
+	 */
+	if (strcmp(op->assembly->instance_id, op->instance_id) == 0) {
+		op->assembly->instance_id[0] = '\0';
+	}
+}
+
+static void instance_slot_release(struct assembly *assembly)
+{
+	if (assembly->cloud_slot) {
+		assembly->cloud_slot = QB_FALSE;
+		cloud_sched.in_flight--;
+		cloud_sched_kick();
+	}
 }
 
 static void instance_state_completion(char *state, char *address, void *data)
 {
 	struct assembly *assembly = (struct assembly *)data;
 
+	if (assembly->retired) {
+		instance_slot_release(assembly);
+		return;
+	}
 	if (strcmp(state, "ACTIVE") == 0) {
+		instance_slot_release(assembly);
+		free(assembly->address);
 		assembly->address = strdup(address);
 		qb_util_stopwatch_stop(assembly->sw_instance_create);
 		qb_log(LOG_INFO, "Instance '%s' with address '%s' changed to RUNNING in (%lld ms).",
@@ -78,14 +148,262 @@ static void instance_state_completion(char *state, char *address, void *data)
 			qb_util_stopwatch_us_elapsed_get(assembly->sw_instance_create) / 1000);
 		qb_util_stopwatch_start(assembly->sw_instance_connected);
 		transport_connect(assembly);
-	} else {
+	} else if (strcmp(state, "BUILD") == 0 ||
+		   strcmp(state, "PENDING") == 0) {
 		recover_state_set(&assembly->recover, RECOVER_STATE_UNKNOWN);
 		qb_loop_timer_add(NULL, QB_LOOP_LOW,
 			PENDING_TIMEOUT * QB_TIME_NS_IN_MSEC, assembly,
 			my_instance_state_get, NULL);
+	} else {
+		/*
+		 * ERROR, STOPPED, UNKNOWN ... the instance will never come
+		 * up, get rid of it and let the recovery boot a new one
+		 */
+		qb_log(LOG_WARNING, "Instance '%s' of assembly '%s' is %s, replacing it",
+			assembly->instance_id, assembly->name, state);
+		instance_destroy(assembly);
+		recover_state_set(&assembly->recover, RECOVER_STATE_FAILED);
 	}
 }
 
+/*
+ * Instances are named after the deployable and the assembly so a restarted
+ * cape can find the ones it booted before.
+ */
+static void instance_name_get(struct assembly *assembly, char *name, size_t len)
+{
+	snprintf(name, len, "%s-%s", assembly->application->name, assembly->name);
+}
+
+static void instance_boot(struct assembly *assembly)
+{
+	char name[PATH_MAX];
+
+	instance_name_get(assembly, name, sizeof(name));
+	image_id_get(assembly->name, image_id_get_completion, assembly);
+	instance_create_from_image_id(assembly->image_id, name,
+		instance_create_completion, assembly);
+	cloud_op_queue(assembly, CLOUD_OP_POLL);
+}
+
+static void instance_adopt_state_completion(char *state, char *address, void *data)
+{
+	struct assembly *assembly = (struct assembly *)data;
+
+	if (assembly->retired) {
+		return;
+	}
+	if (strcmp(state, "ACTIVE") == 0 ||
+	    strcmp(state, "BUILD") == 0 ||
+	    strcmp(state, "PENDING") == 0) {
+		/*
+		 * the transport connect is the liveness check, if the
+		 * instance does not answer the assembly fails and is
+		 * recovered by booting a new one
+		 */
+		qb_log(LOG_NOTICE, "Adopting instance '%s' (%s) of assembly '%s'",
+			assembly->instance_id, state, assembly->name);
+		free(assembly->address);
+		assembly->address = NULL;
+		instance_state_completion(state, address, data);
+	} else {
+		qb_log(LOG_INFO, "Instance '%s' of assembly '%s' is %s, creating a new one",
+			assembly->instance_id, assembly->name, state);
+		assembly->instance_id[0] = '\0';
+		cloud_op_queue(assembly, CLOUD_OP_BOOT);
+	}
+}
+
+static void instance_adopt_find_completion(int32_t rc, char *instance_id, void *data)
+{
+	struct assembly *assembly = (struct assembly *)data;
+
+	if (assembly->retired) {
+		return;
+	}
+	if (rc < 0) {
+		/*
+		 * the instance may well exist, booting now could run the
+		 * assembly twice
+		 */
+		qb_log(LOG_WARNING, "Looking up the instance of assembly '%s' failed, retrying",
+			assembly->name);
+		qb_loop_timer_add(NULL, QB_LOOP_LOW,
+			PENDING_TIMEOUT * QB_TIME_NS_IN_MSEC, assembly,
+			my_instance_find, NULL);
+		return;
+	}
+	if (instance_id == NULL) {
+		cloud_op_queue(assembly, CLOUD_OP_BOOT);
+		return;
+	}
+	strcpy(assembly->instance_id, instance_id);
+	cloud_op_queue(assembly, CLOUD_OP_ADOPT_POLL);
+}
+
+static void cloud_op_queue(struct assembly *assembly, enum cloud_op_type type)
+{
+	struct cloud_op *op;
+	enum cape_prio prio = assembly->cloud_prio;
+	int i;
+
+	if (cloud_sched.queue[0].next == NULL) {
+		for (i = 0; i < CAPE_PRIO_MAX; i++) {
+			qb_list_init(&cloud_sched.queue[i]);
+		}
+	}
+
+	op = pool_alloc(&cloud_op_pool);
+	op->type = type;
+	op->assembly = assembly;
+	strcpy(op->instance_id, assembly->instance_id);
+	if (type == CLOUD_OP_DESTROY) {
+		prio = CAPE_PRIO_RECOVERY;
+	}
+	qb_list_init(&op->list);
+	qb_list_add_tail(&op->list, &cloud_sched.queue[prio]);
+
+	cloud_sched_kick();
+}
+
+static void cloud_op_run(struct cloud_op *op)
+{
+	struct assembly *assembly = op->assembly;
+	char name[PATH_MAX];
+
+	if (assembly->retired && op->type != CLOUD_OP_DESTROY) {
+		instance_slot_release(assembly);
+		return;
+	}
+
+	switch (op->type) {
+	case CLOUD_OP_BOOT:
+		instance_boot(assembly);
+		break;
+	case CLOUD_OP_POLL:
+		instance_state_get(assembly->instance_id,
+			instance_state_completion, assembly);
+		break;
+	case CLOUD_OP_ADOPT_POLL:
+		instance_state_get(assembly->instance_id,
+			instance_adopt_state_completion, assembly);
+		break;
+	case CLOUD_OP_ADOPT_FIND:
+		instance_name_get(assembly, name, sizeof(name));
+		instance_find_by_name(name,
+			instance_adopt_find_completion, assembly);
+		break;
+	case CLOUD_OP_DESTROY:
+		instance_destroy_by_instance_id(op->instance_id,
+			instance_destroy_completion, op);
+		break;
+	}
+}
+
+static void cloud_tokens_refill(void)
+{
+	struct cape_cloud_limits limits;
+	uint64_t now = qb_util_nano_current_get();
+	uint64_t max;
+
+	cape_cloud_limits_get(&limits);
+	max = (uint64_t)limits.burst * 1000;
+	if (cloud_sched.refilled == 0) {
+		cloud_sched.tokens = max;
+	} else {
+		cloud_sched.tokens += (now - cloud_sched.refilled) *
+			limits.rate / QB_TIME_NS_IN_MSEC;
+	}
+	if (cloud_sched.tokens > max) {
+		cloud_sched.tokens = max;
+	}
+	cloud_sched.refilled = now;
+}
+
+/*
+ * The first queued operation allowed to run, boots wait for a free slot
+ */
+static struct cloud_op *cloud_op_next(void)
+{
+	struct cape_cloud_limits limits;
+	struct qb_list_head *list;
+	struct cloud_op *op;
+	int prio;
+
+	cape_cloud_limits_get(&limits);
+	for (prio = 0; prio < CAPE_PRIO_MAX; prio++) {
+		qb_list_for_each(list, &cloud_sched.queue[prio]) {
+			op = qb_list_entry(list, struct cloud_op, list);
+			if (op->type != CLOUD_OP_BOOT ||
+			    op->assembly->cloud_slot ||
+			    limits.concurrency == 0 ||
+			    cloud_sched.in_flight < limits.concurrency) {
+				return op;
+			}
+		}
+	}
+	return NULL;
+}
+
+static void cloud_sched_run(void *data)
+{
+	struct cape_cloud_limits limits;
+	struct cloud_op *op;
+
+	qb_enter();
+
+	cloud_sched.scheduled = QB_FALSE;
+
+	op = cloud_op_next();
+	if (op == NULL) {
+		qb_leave();
+		return;
+	}
+
+	cape_cloud_limits_get(&limits);
+	cloud_tokens_refill();
+	if (limits.rate > 0 && cloud_sched.tokens < 1000) {
+		qb_log(LOG_DEBUG, "cloud request rate limited");
+		cloud_sched.scheduled = QB_TRUE;
+		qb_loop_timer_add(NULL, QB_LOOP_LOW,
+			(1000 - cloud_sched.tokens) * QB_TIME_NS_IN_MSEC /
+			limits.rate + 1,
+			NULL, cloud_sched_run, &cloud_sched.timer);
+		qb_leave();
+		return;
+	}
+	if (cloud_sched.tokens >= 1000) {
+		cloud_sched.tokens -= 1000;
+	}
+
+	qb_list_del(&op->list);
+	if (op->type == CLOUD_OP_BOOT && !op->assembly->cloud_slot) {
+		op->assembly->cloud_slot = QB_TRUE;
+		cloud_sched.in_flight++;
+	}
+	cloud_op_run(op);
+	pool_free(&cloud_op_pool, op);
+
+	/*
+	 * one blocking request per main loop iteration
+	 */
+	cloud_sched_kick();
+
+	qb_leave();
+}
+
+static void cloud_sched_kick(void)
+{
+	if (cloud_sched.scheduled) {
+		return;
+	}
+	if (cloud_op_next() == NULL) {
+		return;
+	}
+	cloud_sched.scheduled = QB_TRUE;
+	qb_loop_job_add(NULL, QB_LOOP_LOW, NULL, cloud_sched_run);
+}
+
 /*
  * External API
  */
@@ -94,9 +412,27 @@ int32_t instance_create(struct assembly *assembly)
 	qb_enter();
 
 	qb_util_stopwatch_start(assembly->sw_instance_create);
-	image_id_get(assembly->name, image_id_get_completion, assembly);
-	instance_create_from_image_id(assembly->image_id, instance_create_completion, assembly);
-	qb_loop_job_add(NULL, QB_LOOP_LOW, assembly, my_instance_state_get);
+	if (!assembly->adopt) {
+		/*
+		 * an assembly that ran before is being recovered
+		 */
+		assembly->cloud_prio = CAPE_PRIO_RECOVERY;
+		cloud_op_queue(assembly, CLOUD_OP_BOOT);
+		qb_leave();
+		return 0;
+	}
+
+	/*
+	 * first start of the assembly, an instance from a previous run
+	 * (known from the checkpoint or by name) is taken over
+	 */
+	assembly->adopt = QB_FALSE;
+	assembly->cloud_prio = CAPE_PRIO_ROUTINE;
+	if (assembly->instance_id[0] != '\0') {
+		cloud_op_queue(assembly, CLOUD_OP_ADOPT_POLL);
+	} else {
+		cloud_op_queue(assembly, CLOUD_OP_ADOPT_FIND);
+	}
 
 	qb_leave();
 
@@ -107,8 +443,8 @@ int instance_destroy(struct assembly *a)
 {
 	qb_enter();
 
-	instance_destroy_by_instance_id(a->instance_id,
-		instance_destroy_completion, a);
+	instance_slot_release(a);
+	cloud_op_queue(a, CLOUD_OP_DESTROY);
 
 	qb_leave();
 
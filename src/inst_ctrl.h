@@ -26,14 +26,23 @@ void instance_state_get(char *instance_id,
 	void (*completion_func)(char *status, char *ip_addr, void *data),
 	void *data);
 
-void image_id_get(char *image_name,
+void image_id_get(const char *image_name,
 	void (*completion_func)(char *image_id, void *data),
 	void *data);
 
 void instance_create_from_image_id(char *image_id,
+	const char *instance_name,
 	void (*completion_func)(char *instance_id, void *data),
 	void *data);
 
+/*
+ * completion_func is always called, rc is negative if the lookup failed
+ * and instance_id is NULL if no instance has that name
+ */
+void instance_find_by_name(const char *instance_name,
+	void (*completion_func)(int32_t rc, char *instance_id, void *data),
+	void *data);
+
 void instance_destroy_by_instance_id(char *instance_id,
         void (*completion_func)(void *data),
         void *data);
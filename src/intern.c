@@ -0,0 +1,114 @@
+/*
+ * Copyright (C) 2012 Red Hat, Inc.
+ *
+ * Authors: Steven Dake <sdake@redhat.com>
+ *          Angus Salkeld <asalkeld@redhat.com>
+ *
+ * This file is part of pacemaker-cloud.
+ *
+ * pacemaker-cloud is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * pacemaker-cloud is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pacemaker-cloud.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <qb/qbdefs.h>
+#include <qb/qbmap.h>
+#include <qb/qblog.h>
+#include <assert.h>
+
+#include "intern.h"
+
+#define INTERN_HASH_SIZE 4096
+
+struct intern_entry {
+	uint32_t refcount;
+	char str[];
+};
+
+static qb_map_t *intern_map = NULL;
+
+const char *intern_monitor;
+const char *intern_start;
+const char *intern_stop;
+const char *intern_delete;
+const char *intern_lsb;
+const char *intern_ocf;
+
+static void
+intern_init(void)
+{
+	intern_map = qb_hashtable_create(INTERN_HASH_SIZE);
+
+	/*
+	 * these are never put back
+	 */
+	intern_monitor = intern_get("monitor");
+	intern_start = intern_get("start");
+	intern_stop = intern_get("stop");
+	intern_delete = intern_get("delete");
+	intern_lsb = intern_get("lsb");
+	intern_ocf = intern_get("ocf");
+}
+
+const char *
+intern_get(const char *str)
+{
+	struct intern_entry *ie;
+	size_t len;
+
+	if (str == NULL) {
+		return NULL;
+	}
+	if (intern_map == NULL) {
+		intern_init();
+	}
+
+	ie = qb_map_get(intern_map, str);
+	if (ie == NULL) {
+		len = strlen(str);
+		ie = malloc(sizeof(struct intern_entry) + len + 1);
+		memcpy(ie->str, str, len + 1);
+		ie->refcount = 0;
+		qb_map_put(intern_map, ie->str, ie);
+	}
+	ie->refcount++;
+	return ie->str;
+}
+
+void
+intern_put(const char *str)
+{
+	struct intern_entry *ie;
+
+	if (str == NULL) {
+		return;
+	}
+
+	ie = (struct intern_entry *)(str - offsetof(struct intern_entry, str));
+	assert(ie->refcount > 0);
+	ie->refcount--;
+	if (ie->refcount == 0) {
+		qb_map_rm(intern_map, ie->str);
+		free(ie);
+	}
+}
+
+uint32_t
+intern_count_get(void)
+{
+	if (intern_map == NULL) {
+		return 0;
+	}
+	return (uint32_t)qb_map_count_get(intern_map);
+}
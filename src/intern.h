@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2012 Red Hat, Inc.
+ *
+ * Authors: Steven Dake <sdake@redhat.com>
+ *          Angus Salkeld <asalkeld@redhat.com>
+ *
+ * This file is part of pacemaker-cloud.
+ *
+ * pacemaker-cloud is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * pacemaker-cloud is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pacemaker-cloud.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef INTERN_H_DEFINED
+#define INTERN_H_DEFINED
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Interned strings are shared by everyone holding the same name, so
+ * two interned strings are equal exactly when the pointers are equal.
+ */
+const char *intern_get(const char *str);
+
+void intern_put(const char *str);
+
+uint32_t intern_count_get(void);
+
+/*
+ * Names the hot path compares against
+ */
+extern const char *intern_monitor;
+extern const char *intern_start;
+extern const char *intern_stop;
+extern const char *intern_delete;
+extern const char *intern_lsb;
+extern const char *intern_ocf;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* INTERN_H_DEFINED */
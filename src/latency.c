@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) 2012 Red Hat, Inc.
+ *
+ * Authors: Steven Dake <sdake@redhat.com>
+ *          Angus Salkeld <asalkeld@redhat.com>
+ *
+ * This file is part of pacemaker-cloud.
+ *
+ * pacemaker-cloud is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * pacemaker-cloud is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pacemaker-cloud.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <string.h>
+#include <qb/qbdefs.h>
+
+#include "latency.h"
+
+static uint32_t
+bucket_index(uint64_t value)
+{
+	uint32_t msb;
+
+	if (value < LATENCY_SUB_BUCKETS) {
+		return value;
+	}
+	msb = 63 - __builtin_clzll(value);
+	return (msb - LATENCY_SUB_BITS + 1) * LATENCY_SUB_BUCKETS +
+		((value >> (msb - LATENCY_SUB_BITS)) & (LATENCY_SUB_BUCKETS - 1));
+}
+
+static uint64_t
+bucket_upper(uint32_t idx)
+{
+	uint32_t group = idx / LATENCY_SUB_BUCKETS;
+	uint64_t sub = idx % LATENCY_SUB_BUCKETS;
+
+	if (group == 0) {
+		return sub;
+	}
+	return ((LATENCY_SUB_BUCKETS + sub + 1) << (group - 1)) - 1;
+}
+
+void
+latency_init(struct latency_histogram *h)
+{
+	memset(h, 0, sizeof(struct latency_histogram));
+}
+
+void
+latency_record(struct latency_histogram *h, uint64_t value)
+{
+	h->buckets[bucket_index(value)]++;
+	h->count++;
+	h->sum += value;
+	if (value > h->max) {
+		h->max = value;
+	}
+}
+
+uint64_t
+latency_percentile(struct latency_histogram *h, uint32_t percent)
+{
+	uint64_t rank;
+	uint64_t seen = 0;
+	uint32_t i;
+
+	if (h->count == 0) {
+		return 0;
+	}
+	rank = (h->count * percent + 99) / 100;
+	if (rank == 0) {
+		rank = 1;
+	}
+	for (i = 0; i < LATENCY_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen >= rank) {
+			return QB_MIN(bucket_upper(i), h->max);
+		}
+	}
+	return h->max;
+}
+
+uint64_t
+latency_mean(struct latency_histogram *h)
+{
+	if (h->count == 0) {
+		return 0;
+	}
+	return h->sum / h->count;
+}
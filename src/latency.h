@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2012 Red Hat, Inc.
+ *
+ * Authors: Steven Dake <sdake@redhat.com>
+ *          Angus Salkeld <asalkeld@redhat.com>
+ *
+ * This file is part of pacemaker-cloud.
+ *
+ * pacemaker-cloud is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * pacemaker-cloud is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pacemaker-cloud.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef LATENCY_H_DEFINED
+#define LATENCY_H_DEFINED
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Log-linear latency histogram: every power of two range is split into
+ * LATENCY_SUB_BUCKETS linear buckets, which keeps the relative error
+ * below 1/LATENCY_SUB_BUCKETS over the whole uint64_t range in a fixed
+ * size array.  Recording never allocates.
+ */
+#define LATENCY_SUB_BITS 3
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BITS)
+#define LATENCY_GROUPS (64 - LATENCY_SUB_BITS + 1)
+#define LATENCY_BUCKETS (LATENCY_GROUPS * LATENCY_SUB_BUCKETS)
+
+struct latency_histogram {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint32_t buckets[LATENCY_BUCKETS];
+};
+
+void latency_init(struct latency_histogram *h);
+
+void latency_record(struct latency_histogram *h, uint64_t value);
+
+/*
+ * Upper bound of the bucket holding the given percentile,
+ * 0 for an empty histogram
+ */
+uint64_t latency_percentile(struct latency_histogram *h, uint32_t percent);
+
+uint64_t latency_mean(struct latency_histogram *h);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LATENCY_H_DEFINED */
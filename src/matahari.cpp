@@ -131,10 +131,10 @@ Matahari::resource_action(struct pe_operation *op)
 
 	qb_enter();
 
-	if (strcmp(op->method, "monitor") == 0) {
+	if (op->method == intern_monitor) {
 		is_monitor_op = true;
 	}
-	if (strstr(op->rname, op->hostname) == NULL) {
+	if (op->resource == NULL) {
 		if (is_monitor_op) {
 			resource_action_completed(op, OCF_NOT_RUNNING);
 		} else {
@@ -146,7 +146,7 @@ Matahari::resource_action(struct pe_operation *op)
 	in_args["timeout"] = op->timeout;
 	qb_log(LOG_DEBUG, "%s setting timeout to %d", op->method, op->timeout);
 
-	if (strcmp(op->rclass, "lsb") == 0) {
+	if (op->rclass == intern_lsb) {
 		if (is_monitor_op) {
 			rmethod = "status";
 			in_args["interval"] = 0;
@@ -316,6 +316,20 @@ transport_resource_action(struct assembly * a,
 	m->resource_action(op);
 }
 
+void
+transport_resource_monitor_batch(struct assembly *a,
+				 struct pe_operation **ops,
+				 uint32_t num_ops)
+{
+	Matahari *m = (Matahari *)a->transport;
+
+	/* every QMF method call is already asynchronous on a shared session
+	 */
+	for (uint32_t i = 0; i < num_ops; i++) {
+		m->resource_action(ops[i]);
+	}
+}
+
 void*
 transport_connect(struct assembly * a)
 {
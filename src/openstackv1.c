@@ -25,6 +25,7 @@
 #include <assert.h>
 #include <curl/curl.h>
 #include <memory.h>
+#include <errno.h>
 #include <libxml2/libxml/parser.h>
 #include <qb/qbutil.h>
 
@@ -45,7 +46,7 @@ struct instance_state_get_data {
 struct image_id_get_data {
 	void (*completion_func)(char *, void *);
 	void *data;
-	char *image_name;
+	const char *image_name;
 };
 
 struct instance_create_data {
@@ -55,6 +56,12 @@ struct instance_create_data {
 	char *instance_id;
 };
 	
+struct instance_find_data {
+	const char *instance_name;
+	char *buf;
+	size_t len;
+};
+
 struct instance_destroy_data {
 	void (*completion_func)(void *);
 	void *data;
@@ -79,7 +86,7 @@ static size_t instance_state_get_curl_callback(void *ptr, size_t size, size_t nm
 	 * Find private address
 	 * UGH
 	 */
-	if (strcmp((char *)status, "ACTIVE") == 0) {
+	if (status && strcmp((char *)status, "ACTIVE") == 0) {
 		for (cur_node = cur_node->children; cur_node; cur_node = cur_node->next) {
 			if (strcmp((char *)cur_node->name, "addresses") == 0) {
 				if (cur_node->children) {
@@ -98,9 +105,11 @@ static size_t instance_state_get_curl_callback(void *ptr, size_t size, size_t nm
 		}
 	}
 done:
-	if (status) {
-		instance_state_get_data->completion_func((char *)status, (char *)ip_addr, instance_state_get_data->data);
-	}
+	/*
+	 * no status means the server is gone
+	 */
+	instance_state_get_data->completion_func(status ? (char *)status : "UNKNOWN",
+		(char *)ip_addr, instance_state_get_data->data);
 	free(instance_state_get_data);
 	xmlFreeDoc(xml);
 	return 0;
@@ -154,6 +163,57 @@ static size_t instance_create_curl_callback(void *ptr, size_t size, size_t nmemb
 	return 0;
 }
 
+/*
+ * The server list can come in several pieces, it is parsed once the
+ * transfer is done
+ */
+static size_t instance_find_curl_callback(void *ptr, size_t size, size_t nmemb, void *data)
+{
+	struct instance_find_data *instance_find_data = (struct instance_find_data *)data;
+	size_t bytes = size * nmemb;
+	char *buf;
+
+	buf = realloc(instance_find_data->buf, instance_find_data->len + bytes);
+	if (buf == NULL) {
+		return 0;
+	}
+	memcpy(buf + instance_find_data->len, ptr, bytes);
+	instance_find_data->buf = buf;
+	instance_find_data->len += bytes;
+	return bytes;
+}
+
+static int32_t instance_find_parse(struct instance_find_data *instance_find_data,
+	xmlChar **id)
+{
+	xmlDocPtr xml;
+	xmlNodePtr cur_node;
+	xmlChar *name;
+
+	xml = xmlReadMemory(instance_find_data->buf, instance_find_data->len,
+		"test.com", NULL,
+		XML_PARSE_NOENT | XML_PARSE_NONET | XML_PARSE_NOERROR | XML_PARSE_NOWARNING);
+	cur_node = xmlDocGetRootElement(xml);
+	if (cur_node == NULL) {
+		xmlFreeDoc(xml);
+		return -EINVAL;
+	}
+
+	for (cur_node = cur_node->children; cur_node; cur_node = cur_node->next) {
+		if (cur_node->type == XML_ELEMENT_NODE) {
+			name = xmlGetProp(cur_node, (const xmlChar *)"name");
+			if (name && strcmp((char *)name, instance_find_data->instance_name) == 0) {
+				*id = xmlGetProp(cur_node, (const xmlChar *)"id");
+			}
+			xmlFree(name);
+			if (*id) {
+				break;
+			}
+		}
+	}
+	xmlFreeDoc(xml);
+	return 0;
+}
 
 static size_t instance_destroy_curl_callback(void *ptr, size_t size, size_t nmemb, void *data)
 {
@@ -202,7 +262,7 @@ void instance_state_get(char *instance_id,
 	curl_easy_cleanup(curl);
 }
 
-void image_id_get(char *image_name,
+void image_id_get(const char *image_name,
 	void (*completion_func)(char *, void *),
 	void *data)
 {
@@ -233,6 +293,7 @@ void image_id_get(char *image_name,
 }
 
 void instance_create_from_image_id(char *image_id,
+	const char *instance_name,
 	void (*completion_func)(char *instance_id, void *data),
 	void *data)
 {
@@ -241,7 +302,7 @@ void instance_create_from_image_id(char *image_id,
 	struct instance_create_data *instance_create_data;
 
 	char command[1024];
-	sprintf (command, "<?xml version=\"1.0\" encoding=\"UTF-8\"?><server xmlns=\"http://docs.rackspacecloud.com/servers/api/v1.0\" name=\"test\" imageId=\"%s\" flavorId=\"1\"> </server>", image_id);
+	sprintf (command, "<?xml version=\"1.0\" encoding=\"UTF-8\"?><server xmlns=\"http://docs.rackspacecloud.com/servers/api/v1.0\" name=\"%s\" imageId=\"%s\" flavorId=\"1\"> </server>", instance_name, image_id);
 	instance_create_data = calloc(1, sizeof(struct instance_create_data));
 	instance_create_data->completion_func = completion_func;
 	instance_create_data->data = data;
@@ -265,6 +326,62 @@ void instance_create_from_image_id(char *image_id,
 	curl_easy_cleanup(curl);
 }
 
+void instance_find_by_name(const char *instance_name,
+	void (*completion_func)(int32_t, char *, void *),
+	void *data)
+{
+	struct curl_slist *headers = NULL;
+	CURL *curl;
+	CURLcode res;
+	long http_code = 0;
+	struct instance_find_data instance_find_data;
+	xmlChar *id = NULL;
+	int32_t rc;
+
+	memset(&instance_find_data, 0, sizeof(instance_find_data));
+	instance_find_data.instance_name = instance_name;
+
+	curl = curl_easy_init();
+	curl_easy_setopt(curl, CURLOPT_URL, "http://localhost:8774/v1.0/servers");
+	curl_easy_setopt(curl, CURLOPT_USERNAME, "sdake");
+	curl_easy_setopt(curl, CURLOPT_PASSWORD, "sdake");
+	headers = curl_slist_append(headers, "Accept: application/xml");
+	headers = curl_slist_append(headers, "X-Auth_token: sdake:dep-wp");
+	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+	curl_easy_setopt(curl, CURLOPT_POST, 0);
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, instance_find_curl_callback);
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, &instance_find_data);
+	curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1);
+
+	res = curl_easy_perform(curl);
+	if (res == CURLE_OK) {
+		curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
+	}
+	curl_slist_free_all(headers);
+	curl_easy_cleanup(curl);
+
+	/*
+	 * a failed request is not the same as no instance of that name,
+	 * the caller would boot a second one
+	 */
+	if (res != CURLE_OK) {
+		qb_log(LOG_ERR, "Failed to list servers: %s",
+			curl_easy_strerror(res));
+		rc = -EIO;
+	} else if (http_code < 200 || http_code >= 300) {
+		qb_log(LOG_ERR, "Failed to list servers: HTTP %ld", http_code);
+		rc = -EIO;
+	} else {
+		rc = instance_find_parse(&instance_find_data, &id);
+		if (rc < 0) {
+			qb_log(LOG_ERR, "Failed to parse the server list");
+		}
+	}
+	completion_func(rc, (char *)id, data);
+	xmlFree(id);
+	free(instance_find_data.buf);
+}
+
 void instance_destroy_by_instance_id(char *instance_id,
 	void (*completion_func)(void *data),
 	void *data)
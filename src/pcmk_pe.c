@@ -21,9 +21,16 @@
 #include "config.h"
 
 #include <stdio.h>
+#include <inttypes.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
 #include <glib.h>
 #include <libxml/parser.h>
 #include <crm/transition.h>
@@ -34,6 +41,9 @@
 #include <qb/qbloop.h>
 #include <qb/qbutil.h>
 #include "pcmk_pe.h"
+#include "pe_dump.h"
+#include "intern.h"
+#include "pool.h"
 
 #define LSB_PENDING -1
 #define	LSB_OK  0
@@ -65,16 +75,55 @@ static pe_transition_completed_t completed_fn = NULL;
 static void * run_user_data = NULL;
 static pe_working_set_t *working_set = NULL;
 static int graph_updated = FALSE;
+static int graph_scheduled = FALSE;
+static crm_graph_t *active_graph = NULL;
+static int abort_requested = FALSE;
 static int pe_log_tag = 0;
 
 static int transition_count = 0;
 
+/*
+ * Offloaded mode: do_calculations() runs in a forked helper that writes
+ * the resulting graph back over a pipe, the loop keeps dispatching
+ * transport I/O meanwhile.
+ */
+static int offload = FALSE;
+static pid_t compute_pid = 0;
+static int compute_fd = -1;
+static char *compute_buf = NULL;
+static size_t compute_len = 0;
+static size_t compute_size = 0;
+
+static struct pool pe_op_pool = POOL_INITIALIZER("pe_operation",
+						 struct pe_operation, 64);
+
+/*
+ * Operation digests keyed on a hash of the parameter set, so the
+ * recurring actions of a resource don't rebuild and hash the same
+ * parameter XML every transition.  A parameter change (an updated
+ * reference address) gives a new key.  When full, the digest used
+ * least recently makes room.
+ */
+#define DIGEST_CACHE_SIZE 256
+
+struct digest_entry {
+	char key[64];
+	const char *digest;
+	struct qb_list_head list;
+};
+
+static qb_map_t *digest_cache = NULL;
+static struct qb_list_head digest_lru;	/* least recently used first */
+static struct pool digest_pool = POOL_INITIALIZER("op_digest",
+						  struct digest_entry, 64);
+static struct pe_digest_stats digest_stats;
+
 enum ocf_exitcode
 pe_resource_ocf_exitcode_get(struct pe_operation *op, int lsb_exitcode)
 {
 	qb_enter();
 
-	if (strcmp(op->rclass, "lsb") == 0 && strcmp("monitor", op->method) == 0) {
+	if (op->rclass == intern_lsb && op->method == intern_monitor) {
 		switch(lsb_exitcode) {
 		case LSB_STATUS_OK:		return OCF_OK;
 		case LSB_STATUS_VAR_PID:	return OCF_NOT_RUNNING;
@@ -130,6 +179,10 @@ pe_resource_reason_get(enum ocf_exitcode exitcode)
 		qb_leave();
 		return "Operation pending";
 	}
+	if (exitcode == OCF_TIMEOUT) {
+		qb_leave();
+		return "Operation timed out";
+	}
 	if (exitcode < OCF_OK || exitcode > OCF_FAILED_MASTER) {
 		qb_leave();
 		return "Unknown Error";
@@ -148,11 +201,47 @@ void pe_resource_ref(struct pe_operation *op)
 	qb_leave();
 }
 
-static int32_t qb_map_transverse_rm(const char *key, void *value, void *user_data)
+static void
+params_clear(qb_map_t *params)
 {
-	free((char *)key);
-	free(value);
-	return 0;
+	qb_map_iter_t *iter;
+	const char *key;
+	void *value;
+
+	iter = qb_map_iter_create(params);
+	while ((key = qb_map_iter_next(iter, &value)) != NULL) {
+		qb_map_rm(params, key);
+		free((char *)key);
+		free(value);
+	}
+	qb_map_iter_free(iter);
+}
+
+/*
+ * Operations are recycled through pe_op_pool, the params map and the
+ * stopwatch stay with the object.
+ */
+static struct pe_operation *
+pe_operation_alloc(void)
+{
+	struct pe_operation *op;
+	qb_map_t *params;
+	qb_util_stopwatch_t *sw;
+
+	op = pool_alloc(&pe_op_pool);
+	params = op->params;
+	sw = op->time_execed;
+	memset(op, 0, sizeof(struct pe_operation));
+
+	if (params == NULL) {
+		params = qb_skiplist_create();
+	}
+	if (sw == NULL) {
+		sw = qb_util_stopwatch_create();
+	}
+	op->params = params;
+	op->time_execed = sw;
+	return op;
 }
 
 void pe_resource_unref(struct pe_operation *op)
@@ -165,24 +254,38 @@ void pe_resource_unref(struct pe_operation *op)
 	       op->rname, op->method, op->interval,
 	       op->refcount);
 	if (op->refcount == 0) {
-		crm_free(op->hostname);
-		crm_free(op->rprovider);
-		crm_free(op->rtype);
-		crm_free(op->rclass);
-		crm_free(op->node_uuid);
-		crm_free(op->op_digest);
-		free(op->method);
-		free(op->rname);
-                qb_map_foreach(op->params, qb_map_transverse_rm, op->params);
-		qb_map_destroy(op->params);
-
-		qb_util_stopwatch_free(op->time_execed);
-		free(op);
+		intern_put(op->hostname);
+		intern_put(op->rprovider);
+		intern_put(op->rtype);
+		intern_put(op->rclass);
+		intern_put(op->node_uuid);
+		intern_put(op->op_digest);
+		intern_put(op->method);
+		intern_put(op->rname);
+		params_clear(op->params);
+		pool_free(&pe_op_pool, op);
 	}
 
 	qb_leave();
 }
 
+static void process_next_job(void* data);
+
+/*
+ * Something in the graph changed, queue a single run_graph() pass.
+ * Nothing runs while the transition waits on outstanding actions.
+ */
+static void
+graph_schedule(void)
+{
+	graph_updated = TRUE;
+	if (active_graph == NULL || graph_scheduled) {
+		return;
+	}
+	graph_scheduled = TRUE;
+	qb_loop_job_add(NULL, QB_LOOP_MED, active_graph, process_next_job);
+}
+
 void
 pe_resource_completed(struct pe_operation *op, uint32_t return_code)
 {
@@ -191,7 +294,18 @@ pe_resource_completed(struct pe_operation *op, uint32_t return_code)
 
 	qb_enter();
 
-	if (working_set == NULL) {
+	/*
+	 * the graph of an operation belongs to the transition that
+	 * created it, which may have been another deployable's or
+	 * one that was aborted since
+	 */
+	if (working_set == NULL || op->transition != transition_count) {
+		qb_leave();
+		return;
+	}
+	if (abort_requested) {
+		qb_log(LOG_DEBUG, "%s_%s_%d superseded",
+		       op->rname, op->method, op->interval);
 		qb_leave();
 		return;
 	}
@@ -202,7 +316,7 @@ pe_resource_completed(struct pe_operation *op, uint32_t return_code)
 	}
 	action->confirmed = TRUE;
 	update_graph(graph, action);
-	graph_updated = TRUE;
+	graph_schedule();
 
 	qb_leave();
 }
@@ -217,6 +331,123 @@ dup_attr(gpointer key, gpointer value, gpointer user_data)
 	qb_leave();
 }
 
+static uint64_t
+fnv1a_64(uint64_t hash, const char *str)
+{
+	const char *p;
+
+	for (p = str; *p; p++) {
+		hash ^= (uint8_t)*p;
+		hash *= UINT64_C(1099511628211);
+	}
+	/* keep "ab"+"c" apart from "a"+"bc" */
+	hash ^= 0xff;
+	hash *= UINT64_C(1099511628211);
+	return hash;
+}
+
+static void
+params_hash_add(gpointer key, gpointer value, gpointer user_data)
+{
+	uint64_t *sum = (uint64_t *)user_data;
+	uint64_t h;
+
+	h = fnv1a_64(UINT64_C(14695981039346656037), key);
+	h = fnv1a_64(h, value ? value : "");
+
+	/*
+	 * the table has no stable order, so combine the pairs with a sum
+	 * after a finalizer spreads each one over all the bits
+	 */
+	h ^= h >> 33;
+	h *= UINT64_C(0xff51afd7ed558ccd);
+	h ^= h >> 33;
+	*sum += h;
+}
+
+static void
+digest_cache_evict(void)
+{
+	struct digest_entry *e;
+
+	e = qb_list_entry(digest_lru.next, struct digest_entry, list);
+	qb_list_del(&e->list);
+	qb_map_rm(digest_cache, e->key);
+	intern_put(e->digest);
+	pool_free(&digest_pool, e);
+	digest_stats.entries--;
+	digest_stats.evicted++;
+}
+
+/*
+ * Returns an interned digest, the caller owns the reference
+ */
+static const char *
+op_digest_get(GHashTable *params)
+{
+	char key[64];
+	uint64_t sum = 0;
+	struct digest_entry *e;
+	const char *digest;
+	char *calculated;
+	xmlNode *params_all;
+
+	if (digest_cache == NULL) {
+		digest_cache = qb_hashtable_create(DIGEST_CACHE_SIZE);
+		qb_list_init(&digest_lru);
+	}
+
+	if (params != NULL) {
+		g_hash_table_foreach(params, params_hash_add, &sum);
+	}
+	snprintf(key, sizeof(key), "%s:%u:%016"PRIx64, PE_CRM_VERSION,
+		 params ? g_hash_table_size(params) : 0, sum);
+
+	e = qb_map_get(digest_cache, key);
+	if (e != NULL) {
+		qb_list_del(&e->list);
+		qb_list_add_tail(&e->list, &digest_lru);
+		digest_stats.hits++;
+		return intern_get(e->digest);
+	}
+	digest_stats.misses++;
+
+	params_all = create_xml_node(NULL, XML_TAG_PARAMS);
+	if (params != NULL) {
+		g_hash_table_foreach(params, hash2field, params_all);
+	}
+/*
+ * TODO at some point.
+	g_hash_table_foreach(action->extra, hash2field, params_all);
+	g_hash_table_foreach(rsc->parameters, hash2field, params_all);
+	g_hash_table_foreach(action->meta, hash2metafield, params_all);
+*/
+	filter_action_parameters(params_all, PE_CRM_VERSION);
+	calculated = calculate_operation_digest(params_all, PE_CRM_VERSION);
+	digest = intern_get(calculated);
+	crm_free(calculated);
+	free_xml(params_all);
+
+	if (digest_stats.entries >= DIGEST_CACHE_SIZE) {
+		digest_cache_evict();
+	}
+	e = pool_alloc(&digest_pool);
+	strcpy(e->key, key);
+	e->digest = intern_get(digest);
+	qb_list_init(&e->list);
+	qb_list_add_tail(&e->list, &digest_lru);
+	qb_map_put(digest_cache, e->key, e);
+	digest_stats.entries++;
+
+	return digest;
+}
+
+void
+pe_digest_stats_get(struct pe_digest_stats *stats)
+{
+	*stats = digest_stats;
+}
+
 static gboolean
 exec_rsc_action(crm_graph_t *graph, crm_action_t *action)
 {
@@ -224,62 +455,44 @@ exec_rsc_action(crm_graph_t *graph, crm_action_t *action)
 	struct pe_operation *pe_op;
 	const char *target_rc_s = crm_meta_value(action->params, XML_ATTR_TE_TARGET_RC);
 	xmlNode *action_rsc = first_named_child(action->xml, XML_CIB_TAG_RESOURCE);
-	char *node = crm_element_value_copy(action->xml, XML_LRM_ATTR_TARGET);
-	char *uuid;
-	const char *tmp_provider;
-	xmlNode *params_all;
+	const char *node = crm_element_value(action->xml, XML_LRM_ATTR_TARGET);
 
 	qb_enter();
 
 	if (safe_str_eq(crm_element_value(action->xml, "operation"), "probe_complete")) {
-		crm_free(node);
 		action->confirmed = TRUE;
 		update_graph(graph, action);
-		graph_updated = TRUE;
+		graph_schedule();
 		qb_leave();
 		return TRUE;
 	}
 
 	if (action_rsc == NULL) {
 		crm_log_xml_err(action->xml, "Bad");
-		crm_free(node);
 		qb_leave();
 		return FALSE;
 	}
-	uuid = crm_element_value_copy(action->xml, XML_LRM_ATTR_TARGET_UUID);
 
-	pe_op = calloc(1, sizeof(struct pe_operation));
+	pe_op = pe_operation_alloc();
 	pe_op->refcount = 1;
-	pe_op->hostname = node;
-	pe_op->node_uuid = uuid;
+	pe_op->hostname = intern_get(node);
+	pe_op->node_uuid = intern_get(crm_element_value(action->xml,
+							XML_LRM_ATTR_TARGET_UUID));
 	pe_op->user_data = run_user_data;
-	pe_op->rname = strdup(ID(action_rsc));
-	pe_op->rclass = strdup(crm_element_value(action_rsc, XML_AGENT_ATTR_CLASS));
-	tmp_provider = crm_element_value(action_rsc, XML_AGENT_ATTR_PROVIDER);
-	if (tmp_provider) {
-		pe_op->rprovider = strdup(tmp_provider);
-	}
-	pe_op->rtype = strdup(crm_element_value(action_rsc, XML_ATTR_TYPE));
+	pe_op->rname = intern_get(ID(action_rsc));
+	pe_op->rclass = intern_get(crm_element_value(action_rsc, XML_AGENT_ATTR_CLASS));
+	pe_op->rprovider = intern_get(crm_element_value(action_rsc, XML_AGENT_ATTR_PROVIDER));
+	pe_op->rtype = intern_get(crm_element_value(action_rsc, XML_ATTR_TYPE));
 
 	if (target_rc_s != NULL) {
 		pe_op->target_outcome = crm_parse_int(target_rc_s, "0");
 	}
 	op = convert_graph_action(NULL, action, 0, pe_op->target_outcome);
 
-	params_all = create_xml_node(NULL, XML_TAG_PARAMS);
-	g_hash_table_foreach(op->params, hash2field, params_all);
-/*
- * TODO at some point.
-	g_hash_table_foreach(action->extra, hash2field, params_all);
-	g_hash_table_foreach(rsc->parameters, hash2field, params_all);
-	g_hash_table_foreach(action->meta, hash2metafield, params_all);
-*/
-	filter_action_parameters(params_all, PE_CRM_VERSION);
-	pe_op->op_digest = calculate_operation_digest(params_all, PE_CRM_VERSION);
+	pe_op->op_digest = op_digest_get(op->params);
 
-	pe_op->method = strdup(op->op_type);
+	pe_op->method = intern_get(op->op_type);
 
-	pe_op->params = qb_skiplist_create();
 	if (op->params != NULL) {
 		g_hash_table_foreach(op->params, dup_attr, pe_op->params);
 	}
@@ -297,10 +510,9 @@ exec_rsc_action(crm_graph_t *graph, crm_action_t *action)
 	pe_op->graph = graph;
 	pe_op->action_id = action->id;
 	pe_op->graph_id = graph->id;
-	pe_op->time_execed = qb_util_stopwatch_create();
+	pe_op->transition = transition_count;
 
 	free_lrm_op(op);
-	free_xml(params_all);
 
 	run_fn(pe_op);
 
@@ -316,7 +528,7 @@ exec_pseudo_action(crm_graph_t *graph, crm_action_t *action)
 
 	action->confirmed = TRUE;
 	update_graph(graph, action);
-	graph_updated = TRUE;
+	graph_schedule();
 
 	qb_leave();
 
@@ -330,7 +542,7 @@ exec_crmd_action(crm_graph_t *graph, crm_action_t *action)
 
 	action->confirmed = TRUE;
 	update_graph(graph, action);
-	graph_updated = TRUE;
+	graph_schedule();
 
 	qb_leave();
 
@@ -350,7 +562,7 @@ exec_stonith_action(crm_graph_t *graph, crm_action_t *action)
 
 	action->confirmed = TRUE;
 	update_graph(graph, action);
-	graph_updated = TRUE;
+	graph_schedule();
 
 	qb_leave();
 	return TRUE;
@@ -364,6 +576,36 @@ static crm_graph_functions_t graph_exec_fns =
 	exec_stonith_action,
 };
 
+/*
+ * transition is NULL when the graph could not be computed
+ */
+static void
+transition_finish(crm_graph_t *transition, enum transition_status graph_rc)
+{
+	if (graph_rc != transition_complete && graph_rc != transition_terminated) {
+		qb_log(LOG_ERR, "Transition failed: %s",
+		       transition_status(graph_rc));
+	}
+	if (graph_scheduled) {
+		qb_loop_job_del(NULL, QB_LOOP_MED, transition, process_next_job);
+		graph_scheduled = FALSE;
+	}
+	active_graph = NULL;
+	graph_updated = FALSE;
+	abort_requested = FALSE;
+	if (transition) {
+		destroy_graph(transition);
+	}
+
+	// we don't want to free the input xml
+	working_set->input = NULL;
+	cleanup_alloc_calculations(working_set);
+	free(working_set);
+	working_set = NULL;
+
+	completed_fn(run_user_data, graph_rc);
+}
+
 static void
 process_next_job(void* data)
 {
@@ -372,8 +614,17 @@ process_next_job(void* data)
 
 	qb_enter();
 
+	graph_scheduled = FALSE;
+
+	if (abort_requested) {
+		qb_log(LOG_NOTICE, "Transition %d aborted with %d actions outstanding",
+		       transition_count, transition->pending);
+		abort_requested = FALSE;
+		graph_rc = transition_terminated;
+		goto done;
+	}
+
 	if (!graph_updated) {
-		qb_loop_job_add(NULL, QB_LOOP_MED, transition, process_next_job);
 		qb_leave();
 		return;
 	}
@@ -383,28 +634,52 @@ process_next_job(void* data)
 
 	qb_log(LOG_DEBUG, "run_graph returned: %s", transition_status(graph_rc));
 
+	/*
+	 * the next pass is queued by graph_schedule() when an action
+	 * completes
+	 */
 	if (graph_rc == transition_active || graph_rc == transition_pending) {
-		qb_loop_job_add(NULL, QB_LOOP_MED, transition, process_next_job);
 		qb_leave();
 		return;
 	}
 
-	if (graph_rc != transition_complete) {
-		qb_log(LOG_ERR, "Transition failed: %s",
-		       transition_status(graph_rc));
-	}
-	destroy_graph(transition);
+done:
+	transition_finish(transition, graph_rc);
 
-	// we don't want to free the input xml
-	working_set->input = NULL;
-	cleanup_alloc_calculations(working_set);
-	free(working_set);
-	working_set = NULL;
+	qb_leave();
+	return;
+}
 
-	completed_fn(run_user_data, graph_rc);
+int32_t
+pe_transition_abort(void)
+{
+	qb_enter();
+
+	if (working_set == NULL) {
+		qb_leave();
+		return -ENOENT;
+	}
+	if (abort_requested) {
+		qb_leave();
+		return -EALREADY;
+	}
+
+	/*
+	 * run_graph() may be on the stack, the graph is torn down by
+	 * process_next_job().  A graph still being computed is dropped
+	 * as soon as it arrives.
+	 */
+	abort_requested = TRUE;
+	graph_schedule();
 
 	qb_leave();
-	return;
+	return 0;
+}
+
+int32_t
+pe_transition_succeeded(int32_t result)
+{
+	return (result == transition_complete);
 }
 
 int32_t
@@ -477,6 +752,167 @@ pe_log_init(int log_tag, int loglevel)
 	qb_log_filter_ctl(log_tag, QB_LOG_TAG_SET, QB_LOG_FILTER_FILE, "graph.c", loglevel);
 }
 
+static void
+graph_execute(crm_graph_t *transition)
+{
+	graph_updated = TRUE;
+	graph_scheduled = TRUE;
+	active_graph = transition;
+
+	qb_loop_job_add(NULL, QB_LOOP_HIGH, transition, process_next_job);
+}
+
+static void
+compute_child(xmlNode *xml_input, int fd)
+{
+	char *graph;
+	size_t len;
+	size_t written = 0;
+	ssize_t rc;
+
+	do_calculations(working_set, xml_input, NULL);
+	graph = dump_xml_unformatted(working_set->graph);
+	if (graph == NULL) {
+		_exit(EXIT_FAILURE);
+	}
+
+	len = strlen(graph);
+	while (written < len) {
+		rc = write(fd, graph + written, len - written);
+		if (rc < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			_exit(EXIT_FAILURE);
+		}
+		written += rc;
+	}
+	_exit(EXIT_SUCCESS);
+}
+
+static void
+compute_done(void)
+{
+	crm_graph_t *transition = NULL;
+	int status = 0;
+
+	qb_loop_poll_del(NULL, compute_fd);
+	close(compute_fd);
+	compute_fd = -1;
+
+	/* the helper closed its end, it is about to exit */
+	while (waitpid(compute_pid, &status, 0) < 0 && errno == EINTR) {
+	}
+	compute_pid = 0;
+
+	if (WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS &&
+	    compute_len > 0) {
+		compute_buf[compute_len] = '\0';
+		working_set->graph = string2xml(compute_buf);
+	}
+	compute_len = 0;
+
+	if (working_set->graph) {
+		transition = unpack_graph(working_set->graph, __func__);
+	}
+	if (transition == NULL) {
+		qb_log(LOG_ERR, "Transition %d: graph computation failed (status %d)",
+		       transition_count, status);
+		transition_finish(NULL, transition_failed);
+		return;
+	}
+	graph_execute(transition);
+}
+
+static int32_t
+compute_read(int32_t fd, int32_t revents, void *data)
+{
+	ssize_t rc;
+	char *buf;
+
+	qb_enter();
+
+	while (QB_TRUE) {
+		/* keep room for the terminator */
+		if (compute_size - compute_len < 2) {
+			buf = realloc(compute_buf, compute_size ? compute_size * 2 : 4096);
+			if (buf == NULL) {
+				break;
+			}
+			compute_buf = buf;
+			compute_size = compute_size ? compute_size * 2 : 4096;
+		}
+		rc = read(fd, compute_buf + compute_len,
+			  compute_size - compute_len - 1);
+		if (rc > 0) {
+			compute_len += rc;
+			continue;
+		}
+		if (rc < 0 && errno == EINTR) {
+			continue;
+		}
+		if (rc < 0 && errno == EAGAIN) {
+			qb_leave();
+			return 0;
+		}
+		break;
+	}
+
+	compute_done();
+
+	qb_leave();
+	return 0;
+}
+
+/*
+ * The helper gets a copy of the status at the time of the fork, the
+ * caller may change or free its document once this returns.
+ */
+static int32_t
+compute_start(xmlNode *xml_input)
+{
+	int fds[2];
+	pid_t pid;
+	int rc;
+
+	if (pipe(fds) < 0) {
+		qb_perror(LOG_WARNING, "pipe");
+		return -errno;
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		rc = -errno;
+		qb_perror(LOG_WARNING, "fork");
+		close(fds[0]);
+		close(fds[1]);
+		return rc;
+	}
+	if (pid == 0) {
+		close(fds[0]);
+		compute_child(xml_input, fds[1]);
+	}
+	close(fds[1]);
+
+	fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	rc = qb_loop_poll_add(NULL, QB_LOOP_HIGH, fds[0], POLLIN,
+			      NULL, compute_read);
+	if (rc != 0) {
+		/* the helper runs into a broken pipe */
+		close(fds[0]);
+		waitpid(pid, NULL, 0);
+		return rc;
+	}
+
+	compute_pid = pid;
+	compute_fd = fds[0];
+	compute_len = 0;
+	qb_log(LOG_DEBUG, "Transition %d computed by helper %d",
+	       transition_count, pid);
+	return 0;
+}
+
 int32_t
 pe_process_state(xmlDocPtr doc,
 		 pe_resource_execute_t exec_fn,
@@ -496,19 +932,10 @@ pe_process_state(xmlDocPtr doc,
 
 	transition_count++;
 	if (debug) {
-		char filename[PATH_MAX];
-
-		assert(validate_xml(xml_input, "pacemaker-1.2", FALSE) == TRUE);
-
-		snprintf(filename, PATH_MAX, "/tmp/pe-%d-%d.xml",
-			 getpid(), transition_count);
-		xmlSaveFormatFileEnc(filename, doc, "UTF-8", 1);
-		qb_log(LOG_INFO, "Executing deployable transition [%s]",
-		       filename);
-	} else {
-		qb_log(LOG_INFO, "Executing deployable transition [%d]",
-		       transition_count);
+		pe_dump_submit(doc, transition_count);
 	}
+	qb_log(LOG_INFO, "Executing deployable transition [%d]",
+	       transition_count);
 	working_set = calloc(1, sizeof(pe_working_set_t));
 	run_fn = exec_fn;
 	completed_fn = done_fn;
@@ -517,17 +944,26 @@ pe_process_state(xmlDocPtr doc,
 
 	set_working_set_defaults(working_set);
 
+	if (offload && compute_start(xml_input) == 0) {
+		qb_leave();
+		return 0;
+	}
+
 	/* calculate output */
 	do_calculations(working_set, xml_input, NULL);
 
 	transition = unpack_graph(working_set->graph, __func__);
 	//print_graph(LOG_INFO, transition);
 
-	graph_updated = TRUE;
-
-	qb_loop_job_add(NULL, QB_LOOP_HIGH, transition, process_next_job);
+	graph_execute(transition);
 
 	qb_leave();
 	return 0;
 }
 
+void
+pe_offload_set(int enabled)
+{
+	offload = enabled;
+}
+
@@ -34,6 +34,7 @@ extern "C" {
 
 #define PE_CRM_VERSION "3.0.5"
 #define PE_DEFAULT_TIMEOUT 10000
+#define PE_OP_STATUS_PENDING -1	/* op-status of an operation in progress */
 
 enum ocf_exitcode {
 	OCF_PENDING = -1,
@@ -47,18 +48,22 @@ enum ocf_exitcode {
 	OCF_NOT_RUNNING = 7,
 	OCF_RUNNING_MASTER = 8,
 	OCF_FAILED_MASTER = 9,
+	OCF_TIMEOUT = 198,		/* no result within the op timeout */
 };
 
+/*
+ * All the names of an operation are interned (see intern.h)
+ */
 struct pe_operation {
-	char *hostname;
-	char *node_uuid;
-	char *method;
-	char *rname;
-	char *rclass;
-	char *rprovider;
-	char *rtype;
+	const char *hostname;
+	const char *node_uuid;
+	const char *method;
+	const char *rname;
+	const char *rclass;
+	const char *rprovider;
+	const char *rtype;
 	qb_map_t *params;
-	char *op_digest;
+	const char *op_digest;
 	uint32_t timeout;
 	uint32_t times_executed;
 	uint32_t interval;
@@ -69,10 +74,18 @@ struct pe_operation {
 	void *resource;
 	uint32_t graph_id;
 	uint32_t action_id;
+	uint32_t transition;	/* pe_process_state() run it was created by */
 	uint32_t refcount;
 	qb_util_stopwatch_t *time_execed;
 };
 
+struct pe_digest_stats {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evicted;
+	uint32_t entries;
+};
+
 typedef void (*pe_resource_execute_t)(struct pe_operation *op);
 typedef void (*pe_transition_completed_t)(void* user_data, int32_t result);
 
@@ -93,6 +106,26 @@ int32_t pe_process_state(xmlDocPtr doc,
 
 int32_t pe_is_busy_processing(void);
 
+/*
+ * Whether a done_fn result means every action of the graph completed
+ */
+int32_t pe_transition_succeeded(int32_t result);
+
+/*
+ * Compute the graph in a helper process instead of on the main loop,
+ * the transition is executed once the graph comes back.
+ */
+void pe_offload_set(int enabled);
+
+/*
+ * Stop the running transition without waiting for its outstanding
+ * actions.  Their results no longer count against any graph, done_fn is
+ * called with transition_terminated from the main loop.
+ */
+int32_t pe_transition_abort(void);
+
+void pe_digest_stats_get(struct pe_digest_stats *stats);
+
 void pe_log_init(int log_tag, int loglevel);
 
 #ifdef __cplusplus
@@ -0,0 +1,628 @@
+/*
+ * Copyright (C) 2012 Red Hat, Inc.
+ *
+ * Authors: Steven Dake <sdake@redhat.com>
+ *          Angus Salkeld <asalkeld@redhat.com>
+ *
+ * This file is part of pacemaker-cloud.
+ *
+ * pacemaker-cloud is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * pacemaker-cloud is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pacemaker-cloud.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "config.h"
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <glib.h>
+#include <libxml/tree.h>
+#include <libxml/xmlIO.h>
+#include <crm/crm.h>
+#include <crm/common/xml.h>
+
+#include <qb/qbdefs.h>
+#include <qb/qblist.h>
+#include <qb/qblog.h>
+#include <qb/qbloop.h>
+#include "pe_dump.h"
+
+/*
+ * Serializing the input is the only part left on the main loop.  The
+ * buffers are queued and streamed to the writer over a socket pair as
+ * the socket drains, the writer compresses them, validates them and
+ * trims the ring of files on disk.
+ *
+ * Dumps are numbered on from the ones already in the directory, so what
+ * earlier runs left behind counts against the bounds and goes first.
+ */
+
+#define PE_DUMP_COMPRESSION	6
+#define PE_DUMP_VALIDATED	16	/* configurations known to validate */
+
+struct dump_hdr {
+	uint32_t transition;
+	uint32_t len;
+};
+
+struct dump_file {
+	uint32_t seq;
+	uint64_t size;
+};
+
+struct dump_buf {
+	struct qb_list_head list;
+	struct dump_hdr hdr;
+	xmlChar *data;
+	size_t off;			/* over header and data */
+};
+
+static char dump_dir[PATH_MAX] = PE_DUMP_DIR;
+static uint32_t dump_max_files = PE_DUMP_MAX_FILES;
+static uint64_t dump_max_bytes = PE_DUMP_MAX_BYTES;
+static int dump_validate = QB_FALSE;
+
+static int dump_disabled = QB_FALSE;
+static pid_t writer_pid = 0;
+static int writer_fd = -1;
+static int writer_polled = QB_FALSE;
+static QB_LIST_DECLARE(dump_queue);
+static struct pe_dump_stats stats;
+
+/*
+ * Writer process
+ */
+static int
+read_full(int fd, void *buf, size_t len)
+{
+	char *p = buf;
+	ssize_t rc;
+
+	while (len > 0) {
+		rc = read(fd, p, len);
+		if (rc < 0 && errno == EINTR) {
+			continue;
+		}
+		if (rc <= 0) {
+			return -1;
+		}
+		p += rc;
+		len -= rc;
+	}
+	return 0;
+}
+
+static uint64_t
+config_hash_get(const char *input)
+{
+	uint64_t hash = UINT64_C(14695981039346656037);
+	const char *start = strstr(input, "<configuration");
+	const char *end;
+	const char *p;
+
+	if (start == NULL) {
+		return 0;
+	}
+	end = strstr(start, "</configuration>");
+	if (end == NULL) {
+		return 0;
+	}
+
+	/* FNV-1a */
+	for (p = start; p < end; p++) {
+		hash ^= (uint8_t)*p;
+		hash *= UINT64_C(1099511628211);
+	}
+	return hash;
+}
+
+/*
+ * The status section is generated by cape and only changes in the
+ * operation results, so a configuration that validated once does not
+ * need to be checked again.
+ */
+static void
+input_validate(uint32_t transition, const char *input)
+{
+	static uint64_t validated[PE_DUMP_VALIDATED];
+	static uint32_t next;
+	uint64_t hash = config_hash_get(input);
+	xmlNode *xml;
+	uint32_t i;
+
+	for (i = 0; hash != 0 && i < PE_DUMP_VALIDATED; i++) {
+		if (validated[i] == hash) {
+			return;
+		}
+	}
+
+	xml = string2xml(input);
+	if (xml == NULL) {
+		qb_log(LOG_ERR, "Transition %u input is not well formed",
+		       transition);
+		return;
+	}
+	if (validate_xml(xml, "pacemaker-1.2", FALSE) == TRUE) {
+		validated[next] = hash;
+		next = (next + 1) % PE_DUMP_VALIDATED;
+	} else {
+		qb_log(LOG_ERR, "Transition %u input does not validate",
+		       transition);
+	}
+	free_xml(xml);
+}
+
+static void
+dump_filename_get(char *filename, uint32_t seq)
+{
+	snprintf(filename, PATH_MAX, "%s/pe-input-%u.xml.gz", dump_dir, seq);
+}
+
+static int
+dump_file_cmp(const void *a, const void *b)
+{
+	const struct dump_file *fa = a;
+	const struct dump_file *fb = b;
+
+	if (fa->seq == fb->seq) {
+		return 0;
+	}
+	return fa->seq < fb->seq ? -1 : 1;
+}
+
+/*
+ * The dumps already in the directory, oldest first
+ */
+static uint32_t
+dumps_find(struct dump_file **files)
+{
+	DIR *d = opendir(dump_dir);
+	struct dirent *de;
+	struct dump_file *f = NULL;
+	struct dump_file *grown;
+	uint32_t count = 0;
+	uint32_t len = 0;
+	char filename[PATH_MAX];
+	struct stat st;
+	uint32_t seq;
+	int end;
+
+	*files = NULL;
+	if (d == NULL) {
+		return 0;
+	}
+	while ((de = readdir(d)) != NULL) {
+		end = 0;
+		if (sscanf(de->d_name, "pe-input-%u.xml.gz%n", &seq, &end) != 1 ||
+		    de->d_name[end] != '\0' || end == 0) {
+			continue;
+		}
+		dump_filename_get(filename, seq);
+		if (stat(filename, &st) != 0 || !S_ISREG(st.st_mode)) {
+			continue;
+		}
+		if (count == len) {
+			len = len ? len * 2 : 64;
+			grown = realloc(f, len * sizeof(struct dump_file));
+			if (grown == NULL) {
+				break;
+			}
+			f = grown;
+		}
+		f[count].seq = seq;
+		f[count].size = st.st_size;
+		count++;
+	}
+	closedir(d);
+
+	qsort(f, count, sizeof(struct dump_file), dump_file_cmp);
+	*files = f;
+	return count;
+}
+
+/*
+ * The writer gets nothing of the daemon but its end of the socket pair,
+ * it must not keep assembly connections or the admin socket open.
+ */
+static void
+fds_close(int keep)
+{
+	DIR *d = opendir("/proc/self/fd");
+	struct dirent *de;
+	long max;
+	int fd;
+
+	if (d == NULL) {
+		max = sysconf(_SC_OPEN_MAX);
+		for (fd = STDERR_FILENO + 1; fd < max; fd++) {
+			if (fd != keep) {
+				close(fd);
+			}
+		}
+		return;
+	}
+	while ((de = readdir(d)) != NULL) {
+		fd = atoi(de->d_name);
+		if (fd > STDERR_FILENO && fd != keep && fd != dirfd(d)) {
+			close(fd);
+		}
+	}
+	closedir(d);
+}
+
+static void
+writer_run(int fd)
+{
+	struct dump_file *ring;
+	struct dump_file *found;
+	uint32_t num_found = dumps_find(&found);
+	/* one spare slot for the dump written before the oldest goes */
+	uint32_t ring_len = (num_found > dump_max_files ?
+			     num_found : dump_max_files) + 1;
+	uint32_t ring_head = 0;
+	uint32_t ring_count = 0;
+	uint64_t ring_total = 0;
+	uint32_t seq = 0;
+	struct dump_hdr hdr;
+	xmlOutputBufferPtr out;
+	char filename[PATH_MAX];
+	struct stat st;
+	char *input;
+	uint32_t slot;
+	uint32_t i;
+
+	/* signals are for the daemon, an EOF tells the writer to stop */
+	signal(SIGINT, SIG_IGN);
+	signal(SIGHUP, SIG_IGN);
+	signal(SIGUSR1, SIG_IGN);
+
+	ring = calloc(ring_len, sizeof(struct dump_file));
+	if (ring == NULL) {
+		_exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < num_found; i++) {
+		ring[i] = found[i];
+		ring_total += found[i].size;
+	}
+	ring_count = num_found;
+	if (num_found > 0) {
+		seq = found[num_found - 1].seq + 1;
+	}
+	free(found);
+
+	while (read_full(fd, &hdr, sizeof(hdr)) == 0) {
+		input = malloc(hdr.len + 1);
+		if (input == NULL || read_full(fd, input, hdr.len) != 0) {
+			_exit(EXIT_FAILURE);
+		}
+		input[hdr.len] = '\0';
+
+		if (dump_validate) {
+			input_validate(hdr.transition, input);
+		}
+
+		dump_filename_get(filename, seq);
+		out = xmlOutputBufferCreateFilename(filename, NULL,
+						    PE_DUMP_COMPRESSION);
+		if (out == NULL) {
+			qb_perror(LOG_ERR, "Could not create %s", filename);
+			free(input);
+			continue;
+		}
+		xmlOutputBufferWrite(out, hdr.len, input);
+		free(input);
+		if (xmlOutputBufferClose(out) < 0 ||
+		    stat(filename, &st) != 0) {
+			qb_log(LOG_ERR, "Could not write %s", filename);
+			unlink(filename);
+			continue;
+		}
+		qb_log(LOG_DEBUG, "Transition %u input saved to %s",
+		       hdr.transition, filename);
+
+		slot = (ring_head + ring_count) % ring_len;
+		ring[slot].seq = seq++;
+		ring[slot].size = st.st_size;
+		ring_total += st.st_size;
+		ring_count++;
+
+		/* drop the oldest, the newest stays even when too large */
+		while (ring_count > 1 &&
+		       (ring_count > dump_max_files || ring_total > dump_max_bytes)) {
+			dump_filename_get(filename, ring[ring_head].seq);
+			unlink(filename);
+			ring_total -= ring[ring_head].size;
+			ring_head = (ring_head + 1) % ring_len;
+			ring_count--;
+		}
+	}
+	_exit(EXIT_SUCCESS);
+}
+
+/*
+ * Main loop side
+ */
+static void
+queue_drop(void)
+{
+	struct dump_buf *b;
+
+	while (!qb_list_empty(&dump_queue)) {
+		b = qb_list_entry(dump_queue.next, struct dump_buf, list);
+		qb_list_del(&b->list);
+		stats.dropped++;
+		stats.queued_bytes -= sizeof(b->hdr) + b->hdr.len;
+		xmlFree(b->data);
+		free(b);
+	}
+}
+
+static void
+writer_stop(void)
+{
+	if (writer_polled) {
+		qb_loop_poll_del(NULL, writer_fd);
+		writer_polled = QB_FALSE;
+	}
+	close(writer_fd);
+	writer_fd = -1;
+
+	while (waitpid(writer_pid, NULL, 0) < 0 && errno == EINTR) {
+	}
+	writer_pid = 0;
+}
+
+/*
+ * The dumps go to a directory of their own, it is created unless there
+ * already is one of ours
+ */
+static int
+dump_dir_prepare(void)
+{
+	struct stat st;
+
+	if (mkdir(dump_dir, 0700) != 0 && errno != EEXIST) {
+		return -errno;
+	}
+	if (lstat(dump_dir, &st) != 0) {
+		return -errno;
+	}
+	if (!S_ISDIR(st.st_mode) || st.st_uid != geteuid()) {
+		return -EPERM;
+	}
+	return 0;
+}
+
+static int
+writer_start(void)
+{
+	int fds[2];
+	pid_t pid;
+	int rc;
+
+	rc = dump_dir_prepare();
+	if (rc != 0) {
+		return rc;
+	}
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+		return -errno;
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		close(fds[0]);
+		close(fds[1]);
+		return -errno;
+	}
+	if (pid == 0) {
+		fds_close(fds[1]);
+		writer_run(fds[1]);
+	}
+	close(fds[1]);
+
+	fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	writer_pid = pid;
+	writer_fd = fds[0];
+	qb_log(LOG_DEBUG, "Transition dumps written to %s by %d",
+	       dump_dir, pid);
+	return 0;
+}
+
+/*
+ * Pass on as much of the queue as the socket takes
+ */
+static int
+queue_flush(void)
+{
+	struct dump_buf *b;
+	size_t total;
+	ssize_t rc;
+
+	while (!qb_list_empty(&dump_queue)) {
+		b = qb_list_entry(dump_queue.next, struct dump_buf, list);
+		total = sizeof(b->hdr) + b->hdr.len;
+
+		if (b->off < sizeof(b->hdr)) {
+			rc = send(writer_fd, (char *)&b->hdr + b->off,
+				  sizeof(b->hdr) - b->off, MSG_NOSIGNAL);
+		} else {
+			rc = send(writer_fd, b->data + b->off - sizeof(b->hdr),
+				  total - b->off, MSG_NOSIGNAL);
+		}
+		if (rc < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return 0;
+			}
+			return -errno;
+		}
+		b->off += rc;
+		if (b->off < total) {
+			continue;
+		}
+
+		qb_list_del(&b->list);
+		stats.queued_bytes -= total;
+		xmlFree(b->data);
+		free(b);
+	}
+	return 0;
+}
+
+static void
+writer_lost(int rc)
+{
+	qb_log(LOG_ERR, "Transition dump writer %d lost: %s",
+	       writer_pid, strerror(-rc));
+	queue_drop();
+	writer_stop();
+}
+
+static int32_t
+writer_dispatch(int32_t fd, int32_t revents, void *data)
+{
+	int rc = -EPIPE;
+
+	if ((revents & POLLOUT) != 0) {
+		rc = queue_flush();
+	}
+	if (rc != 0) {
+		writer_lost(rc);
+		return 0;
+	}
+	if (qb_list_empty(&dump_queue)) {
+		qb_loop_poll_del(NULL, writer_fd);
+		writer_polled = QB_FALSE;
+	}
+	return 0;
+}
+
+/*
+ * External API
+ */
+void
+pe_dump_config_set(const char *dir, uint32_t max_files,
+		   uint64_t max_bytes, int validate)
+{
+	snprintf(dump_dir, PATH_MAX, "%s", dir);
+	dump_disabled = QB_FALSE;
+	dump_max_files = max_files > 0 ? max_files : 1;
+	dump_max_bytes = max_bytes;
+	dump_validate = validate;
+}
+
+int32_t
+pe_dump_submit(xmlDocPtr doc, uint32_t transition)
+{
+	struct dump_buf *b;
+	xmlChar *data = NULL;
+	int len = 0;
+	int rc;
+
+	qb_enter();
+
+	if (dump_disabled) {
+		qb_leave();
+		return -ENOENT;
+	}
+	if (writer_fd < 0) {
+		rc = writer_start();
+		if (rc != 0) {
+			qb_log(LOG_ERR, "Could not start the dump writer for %s, "
+			       "not dumping transitions: %s",
+			       dump_dir, strerror(-rc));
+			dump_disabled = QB_TRUE;
+			qb_leave();
+			return rc;
+		}
+	}
+
+	if (stats.queued_bytes >= PE_DUMP_QUEUE_MAX) {
+		stats.dropped++;
+		qb_log(LOG_DEBUG, "Transition %u not dumped, writer behind by %"
+		       PRIu64" bytes", transition, stats.queued_bytes);
+		qb_leave();
+		return -EAGAIN;
+	}
+
+	xmlDocDumpMemoryEnc(doc, &data, &len, "UTF-8");
+	b = calloc(1, sizeof(struct dump_buf));
+	if (data == NULL || b == NULL) {
+		xmlFree(data);
+		free(b);
+		qb_leave();
+		return -ENOMEM;
+	}
+	b->hdr.transition = transition;
+	b->hdr.len = len;
+	b->data = data;
+	qb_list_add_tail(&b->list, &dump_queue);
+	stats.submitted++;
+	stats.queued_bytes += sizeof(b->hdr) + len;
+
+	rc = queue_flush();
+	if (rc != 0) {
+		writer_lost(rc);
+	} else if (!qb_list_empty(&dump_queue) && !writer_polled) {
+		rc = qb_loop_poll_add(NULL, QB_LOOP_LOW, writer_fd, POLLOUT,
+				      NULL, writer_dispatch);
+		writer_polled = (rc == 0);
+	}
+
+	qb_leave();
+	return rc;
+}
+
+void
+pe_dump_stats_get(struct pe_dump_stats *s)
+{
+	*s = stats;
+}
+
+void
+pe_dump_exit(void)
+{
+	int rc;
+
+	qb_enter();
+
+	if (writer_fd < 0) {
+		qb_leave();
+		return;
+	}
+
+	/* the writer is draining, block until it took everything */
+	fcntl(writer_fd, F_SETFL, fcntl(writer_fd, F_GETFL) & ~O_NONBLOCK);
+	rc = queue_flush();
+	if (rc != 0) {
+		writer_lost(rc);
+	} else {
+		writer_stop();
+	}
+
+	qb_leave();
+}
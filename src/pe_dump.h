@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2012 Red Hat, Inc.
+ *
+ * Authors: Steven Dake <sdake@redhat.com>
+ *          Angus Salkeld <asalkeld@redhat.com>
+ *
+ * This file is part of pacemaker-cloud.
+ *
+ * pacemaker-cloud is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * pacemaker-cloud is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pacemaker-cloud.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef PE_DUMP_H_DEFINED
+#define PE_DUMP_H_DEFINED
+
+#include <stdint.h>
+#include <libxml/tree.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PE_DUMP_DIR		"/tmp"	/* caped dumps to <dir>/cape-<deployable> */
+#define PE_DUMP_MAX_FILES	256
+#define PE_DUMP_MAX_BYTES	(64 * 1024 * 1024)
+#define PE_DUMP_QUEUE_MAX	(16 * 1024 * 1024) /* serialized, not written yet */
+
+/*
+ * Policy engine inputs are serialized on the main loop and handed to a
+ * writer process, which compresses them to <dir>/pe-input-<n>.xml.gz,
+ * numbered on from the dumps already there.  The directory belongs to one
+ * process, it is created if missing.  The writer keeps at most
+ * max_files dumps and max_bytes of them on disk, those of earlier runs
+ * included, removing the oldest first.  With validate set every input is
+ * checked against the schema, once per distinct configuration section.
+ */
+struct pe_dump_stats {
+	uint64_t submitted;		/* inputs handed to the writer */
+	uint64_t dropped;		/* inputs dropped, writer too far behind */
+	uint64_t queued_bytes;		/* serialized, not passed on yet */
+};
+
+void pe_dump_config_set(const char *dir, uint32_t max_files,
+			uint64_t max_bytes, int validate);
+
+/*
+ * Never blocks: when the writer can not keep up the input is dropped
+ */
+int32_t pe_dump_submit(xmlDocPtr doc, uint32_t transition);
+
+void pe_dump_stats_get(struct pe_dump_stats *stats);
+
+/*
+ * Flush what is queued and wait for the writer to finish
+ */
+void pe_dump_exit(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PE_DUMP_H_DEFINED */
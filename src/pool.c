@@ -0,0 +1,134 @@
+/*
+ * Copyright (C) 2012 Red Hat, Inc.
+ *
+ * Authors: Steven Dake <sdake@redhat.com>
+ *          Angus Salkeld <asalkeld@redhat.com>
+ *
+ * This file is part of pacemaker-cloud.
+ *
+ * pacemaker-cloud is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * pacemaker-cloud is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pacemaker-cloud.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <inttypes.h>
+#include <stdlib.h>
+#include <qb/qbdefs.h>
+#include <qb/qblist.h>
+#include <qb/qblog.h>
+#include <assert.h>
+
+#include "pool.h"
+
+static QB_LIST_DECLARE(pool_head);
+
+struct pool_link {
+	struct pool_link *next;
+};
+
+static size_t
+pool_object_size(struct pool *p)
+{
+	size_t align = sizeof(void *);
+
+	if (p->size < sizeof(struct pool_link)) {
+		return sizeof(struct pool_link);
+	}
+	return (p->size + align - 1) & ~(align - 1);
+}
+
+static void
+pool_grow(struct pool *p)
+{
+	size_t size = pool_object_size(p);
+	char *slab;
+	struct pool_link *link;
+	uint32_t i;
+
+	if (!p->registered) {
+		qb_list_init(&p->list);
+		qb_list_add_tail(&p->list, &pool_head);
+		p->registered = QB_TRUE;
+	}
+
+	slab = calloc(p->slab_objects, size);
+	assert(slab);
+
+	for (i = 0; i < p->slab_objects; i++) {
+		link = (struct pool_link *)(slab + i * size);
+		link->next = p->free_list;
+		p->free_list = link;
+	}
+	p->stats.free += p->slab_objects;
+	p->stats.slabs++;
+
+	qb_log(LOG_DEBUG, "pool %s grown to %"PRIu32" objects",
+	       p->name, p->stats.slabs * p->slab_objects);
+}
+
+void *
+pool_alloc(struct pool *p)
+{
+	struct pool_link *link;
+
+	if (p->free_list == NULL) {
+		pool_grow(p);
+	}
+
+	link = p->free_list;
+	p->free_list = link->next;
+	link->next = NULL;
+
+	p->stats.free--;
+	p->stats.in_use++;
+	p->stats.allocs++;
+	if (p->stats.in_use > p->stats.high_water) {
+		p->stats.high_water = p->stats.in_use;
+	}
+	return link;
+}
+
+void
+pool_free(struct pool *p, void *obj)
+{
+	struct pool_link *link = (struct pool_link *)obj;
+
+	if (obj == NULL) {
+		return;
+	}
+	assert(p->stats.in_use > 0);
+
+	link->next = p->free_list;
+	p->free_list = link;
+	p->stats.in_use--;
+	p->stats.free++;
+}
+
+void
+pool_stats_get(struct pool *p, struct pool_stats *stats)
+{
+	*stats = p->stats;
+}
+
+void
+pool_stats_log(void)
+{
+	struct qb_list_head *list;
+	struct pool *p;
+
+	qb_list_for_each(list, &pool_head) {
+		p = qb_list_entry(list, struct pool, list);
+		qb_log(LOG_INFO, "pool %s: in_use:%"PRIu32" free:%"PRIu32
+		       " high_water:%"PRIu32" slabs:%"PRIu32" allocs:%"PRIu64,
+		       p->name, p->stats.in_use, p->stats.free,
+		       p->stats.high_water, p->stats.slabs, p->stats.allocs);
+	}
+}
@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2012 Red Hat, Inc.
+ *
+ * Authors: Steven Dake <sdake@redhat.com>
+ *          Angus Salkeld <asalkeld@redhat.com>
+ *
+ * This file is part of pacemaker-cloud.
+ *
+ * pacemaker-cloud is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * pacemaker-cloud is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pacemaker-cloud.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef POOL_H_DEFINED
+#define POOL_H_DEFINED
+
+#include <stddef.h>
+#include <stdint.h>
+#include <qb/qblist.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Fixed size object pool.  Objects are carved out of slabs of
+ * slab_objects and recycled through a free list, slabs are never
+ * returned to the system.  A recycled object keeps its old contents
+ * except for the first pointer, which links the free list.
+ */
+struct pool_stats {
+	uint32_t in_use;		/* objects handed out */
+	uint32_t free;			/* objects waiting on the free list */
+	uint32_t high_water;		/* most objects in use at once */
+	uint32_t slabs;			/* slabs allocated */
+	uint64_t allocs;		/* calls to pool_alloc() */
+};
+
+struct pool {
+	const char *name;
+	size_t size;
+	uint32_t slab_objects;
+	void *free_list;
+	int registered;
+	struct qb_list_head list;
+	struct pool_stats stats;
+};
+
+#define POOL_INITIALIZER(pool_name, type, objects) {	\
+	.name = pool_name,				\
+	.size = sizeof(type),				\
+	.slab_objects = objects,			\
+}
+
+/*
+ * Returns an object that is zeroed when it comes from a fresh slab
+ */
+void *pool_alloc(struct pool *p);
+
+void pool_free(struct pool *p, void *obj);
+
+void pool_stats_get(struct pool *p, struct pool_stats *stats);
+
+/*
+ * Log the occupancy of every pool that has been used
+ */
+void pool_stats_log(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* POOL_H_DEFINED */
@@ -0,0 +1,330 @@
+/*
+ * Copyright (C) 2012 Red Hat, Inc.
+ *
+ * Authors: Steven Dake <sdake@redhat.com>
+ *          Angus Salkeld <asalkeld@redhat.com>
+ *
+ * This file is part of pacemaker-cloud.
+ *
+ * pacemaker-cloud is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * pacemaker-cloud is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pacemaker-cloud.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <inttypes.h>
+#include <string.h>
+#include <qb/qbdefs.h>
+#include <qb/qbutil.h>
+#include <qb/qblist.h>
+#include <qb/qbloop.h>
+#include <qb/qblog.h>
+#include <assert.h>
+
+#include "timer_wheel.h"
+
+/*
+ * A hierarchical timing wheel in the style of the kernel's timer wheel.
+ *
+ * Level 0 has one slot per tick, every higher level has one slot per
+ * revolution of the level below it.  Entries far in the future sit in a
+ * coarse slot and are cascaded down as the wheel turns.  Only one qb_loop
+ * timer is armed for the whole wheel, for the next tick that has work.
+ */
+
+#define SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+#define TICK_NS (TIMER_WHEEL_TICK * QB_TIME_NS_IN_MSEC)
+
+static void timer_wheel_expire(void *data);
+
+static uint64_t
+ticks_get(struct timer_wheel *tw)
+{
+	return (qb_util_nano_current_get() - tw->start) / TICK_NS;
+}
+
+static void
+entry_place(struct timer_wheel *tw, struct timer_wheel_entry *te)
+{
+	uint64_t expires = te->expires;
+	uint64_t diff;
+	int level;
+
+	/*
+	 * the slot for the current tick is being (or has been) run
+	 */
+	if (expires <= tw->now) {
+		expires = tw->now + 1;
+	}
+	diff = expires - tw->now;
+
+	for (level = 0; level < TIMER_WHEEL_LEVELS - 1; level++) {
+		if (diff < (1ULL << ((level + 1) * TIMER_WHEEL_SLOT_BITS))) {
+			break;
+		}
+	}
+	if (level == TIMER_WHEEL_LEVELS - 1 &&
+	    diff >= (1ULL << (TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOT_BITS))) {
+		expires = tw->now +
+			(1ULL << (TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOT_BITS)) - 1;
+	}
+
+	qb_list_add_tail(&te->list,
+		&tw->slots[level][(expires >> (level * TIMER_WHEEL_SLOT_BITS)) & SLOT_MASK]);
+}
+
+/*
+ * Move the entries of the current slot of a level down the hierarchy
+ */
+static void
+cascade(struct timer_wheel *tw, int level)
+{
+	struct qb_list_head *list;
+	struct qb_list_head *list_temp;
+	struct timer_wheel_entry *te;
+	int idx = (tw->now >> (level * TIMER_WHEEL_SLOT_BITS)) & SLOT_MASK;
+	struct qb_list_head *slot = &tw->slots[level][idx];
+
+	qb_list_for_each_safe(list, list_temp, slot) {
+		te = qb_list_entry(list, struct timer_wheel_entry, list);
+		qb_list_del(list);
+		entry_place(tw, te);
+	}
+}
+
+static void
+slot_run(struct timer_wheel *tw, struct qb_list_head *slot)
+{
+	struct qb_list_head expired;
+	struct timer_wheel_entry *te;
+	uint64_t now_msec;
+	uint64_t late;
+
+	if (qb_list_empty(slot)) {
+		return;
+	}
+
+	/*
+	 * take the list over as the callbacks may add entries again
+	 */
+	expired.next = slot->next;
+	expired.prev = slot->prev;
+	expired.next->prev = &expired;
+	expired.prev->next = &expired;
+	qb_list_init(slot);
+
+	now_msec = timer_wheel_msec_get(tw);
+	while (!qb_list_empty(&expired)) {
+		te = qb_list_entry(expired.next, struct timer_wheel_entry, list);
+		qb_list_del(&te->list);
+		qb_list_init(&te->list);
+		te->running = QB_FALSE;
+
+		late = 0;
+		if (now_msec > te->deadline) {
+			late = now_msec - te->deadline;
+		}
+		tw->stats.active--;
+		tw->stats.fired++;
+		tw->stats.late_total += late;
+		if (late > tw->stats.late_max) {
+			tw->stats.late_max = late;
+		}
+		te->fn(te->data, late);
+	}
+}
+
+static void
+timer_wheel_advance(struct timer_wheel *tw)
+{
+	uint64_t target = ticks_get(tw);
+	int level;
+
+	while (tw->now < target) {
+		tw->now++;
+		for (level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+			if (((tw->now >> ((level - 1) * TIMER_WHEEL_SLOT_BITS)) & SLOT_MASK) != 0) {
+				break;
+			}
+			cascade(tw, level);
+		}
+		slot_run(tw, &tw->slots[0][tw->now & SLOT_MASK]);
+	}
+}
+
+/*
+ * Arm the loop timer for the next tick with expiring entries, or the next
+ * revolution of level 0 when entries need to be cascaded.
+ */
+static void
+timer_wheel_arm(struct timer_wheel *tw)
+{
+	uint64_t tick;
+	uint64_t when;
+	uint64_t now;
+
+	qb_loop_timer_del(NULL, tw->timer);
+	if (tw->stats.active == 0) {
+		return;
+	}
+
+	for (tick = tw->now + 1; (tick & SLOT_MASK) != 0; tick++) {
+		if (!qb_list_empty(&tw->slots[0][tick & SLOT_MASK])) {
+			break;
+		}
+	}
+
+	when = tw->start + tick * TICK_NS;
+	now = qb_util_nano_current_get();
+	qb_loop_timer_add(NULL, tw->priority, when > now ? when - now : 0,
+			  tw, timer_wheel_expire, &tw->timer);
+}
+
+static void
+timer_wheel_expire(void *data)
+{
+	struct timer_wheel *tw = (struct timer_wheel *)data;
+
+	qb_enter();
+
+	timer_wheel_advance(tw);
+	timer_wheel_arm(tw);
+
+	qb_leave();
+}
+
+/*
+ * External API
+ */
+void
+timer_wheel_init(struct timer_wheel *tw, enum qb_loop_priority p)
+{
+	int level;
+	int slot;
+
+	memset(tw, 0, sizeof(struct timer_wheel));
+	for (level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+		for (slot = 0; slot < TIMER_WHEEL_SLOTS; slot++) {
+			qb_list_init(&tw->slots[level][slot]);
+		}
+	}
+	tw->priority = p;
+	tw->start = qb_util_nano_current_get();
+}
+
+void
+timer_wheel_entry_init(struct timer_wheel_entry *te)
+{
+	qb_list_init(&te->list);
+	te->running = QB_FALSE;
+}
+
+void
+timer_wheel_add(struct timer_wheel *tw, struct timer_wheel_entry *te,
+		uint64_t delay_msec, timer_wheel_fn_t fn, void *data)
+{
+	uint64_t ticks;
+
+	qb_enter();
+
+	if (te->running) {
+		timer_wheel_del(tw, te);
+	}
+
+	ticks = (delay_msec + TIMER_WHEEL_TICK - 1) / TIMER_WHEEL_TICK;
+	te->expires = ticks_get(tw) + ticks;
+	te->deadline = timer_wheel_msec_get(tw) + delay_msec;
+	te->fn = fn;
+	te->data = data;
+	te->running = QB_TRUE;
+	entry_place(tw, te);
+	tw->stats.active++;
+
+	/*
+	 * only a level 0 entry can be due before the armed timer
+	 */
+	if (tw->stats.active == 1 ||
+	    te->expires <= tw->now + TIMER_WHEEL_SLOTS) {
+		timer_wheel_arm(tw);
+	}
+
+	qb_leave();
+}
+
+void
+timer_wheel_del(struct timer_wheel *tw, struct timer_wheel_entry *te)
+{
+	qb_enter();
+
+	if (te->running) {
+		qb_list_del(&te->list);
+		qb_list_init(&te->list);
+		te->running = QB_FALSE;
+		tw->stats.active--;
+		if (tw->stats.active == 0) {
+			qb_loop_timer_del(NULL, tw->timer);
+		}
+	}
+
+	qb_leave();
+}
+
+int
+timer_wheel_is_running(struct timer_wheel_entry *te)
+{
+	return te->running;
+}
+
+uint64_t
+timer_wheel_msec_get(struct timer_wheel *tw)
+{
+	return (qb_util_nano_current_get() - tw->start) / QB_TIME_NS_IN_MSEC;
+}
+
+/*
+ * Delay until the next point of a per-key phase grid, so entries of the same
+ * interval spread over the interval instead of firing in lockstep.  The
+ * result is always at least half an interval so a rescheduled entry never
+ * runs back to back.
+ */
+uint64_t
+timer_wheel_phase_delay(const char *key, uint64_t now_msec,
+			uint64_t interval_msec)
+{
+	uint32_t hash = 2166136261U;
+	uint64_t phase;
+	uint64_t delay;
+	const char *p;
+
+	if (interval_msec == 0) {
+		return 0;
+	}
+
+	/* FNV-1a */
+	for (p = key; *p; p++) {
+		hash ^= (uint8_t)*p;
+		hash *= 16777619U;
+	}
+	phase = hash % interval_msec;
+
+	delay = interval_msec -
+		((now_msec + interval_msec - phase) % interval_msec);
+	if (delay < interval_msec / 2) {
+		delay += interval_msec;
+	}
+	return delay;
+}
+
+void
+timer_wheel_stats_get(struct timer_wheel *tw,
+		      struct timer_wheel_stats *stats)
+{
+	*stats = tw->stats;
+}
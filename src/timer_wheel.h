@@ -0,0 +1,91 @@
+/*
+ * Copyright (C) 2012 Red Hat, Inc.
+ *
+ * Authors: Steven Dake <sdake@redhat.com>
+ *          Angus Salkeld <asalkeld@redhat.com>
+ *
+ * This file is part of pacemaker-cloud.
+ *
+ * pacemaker-cloud is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * pacemaker-cloud is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pacemaker-cloud.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef TIMER_WHEEL_H_DEFINED
+#define TIMER_WHEEL_H_DEFINED
+
+#include <stdint.h>
+#include <qb/qblist.h>
+#include <qb/qbloop.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TIMER_WHEEL_LEVELS 4		/* levels in the hierarchy */
+#define TIMER_WHEEL_SLOT_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_SLOT_BITS)
+#define TIMER_WHEEL_TICK 10		/* milliseconds */
+
+/*
+ * Called with the number of milliseconds the timer fired after its deadline
+ */
+typedef void (*timer_wheel_fn_t)(void *data, uint64_t late_msec);
+
+struct timer_wheel_entry {
+	struct qb_list_head list;
+	uint64_t expires;		/* tick the entry is due */
+	uint64_t deadline;		/* milliseconds since the wheel start */
+	timer_wheel_fn_t fn;
+	void *data;
+	int running;
+};
+
+struct timer_wheel_stats {
+	uint32_t active;		/* entries currently armed */
+	uint64_t fired;			/* entries expired */
+	uint64_t late_total;		/* sum of lateness in milliseconds */
+	uint64_t late_max;		/* worst lateness in milliseconds */
+};
+
+struct timer_wheel {
+	uint64_t start;			/* nanoseconds, monotonic */
+	uint64_t now;			/* current tick */
+	struct qb_list_head slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+	qb_loop_timer_handle timer;
+	enum qb_loop_priority priority;
+	struct timer_wheel_stats stats;
+};
+
+void timer_wheel_init(struct timer_wheel *tw, enum qb_loop_priority p);
+
+void timer_wheel_entry_init(struct timer_wheel_entry *te);
+
+void timer_wheel_add(struct timer_wheel *tw, struct timer_wheel_entry *te,
+		     uint64_t delay_msec, timer_wheel_fn_t fn, void *data);
+
+void timer_wheel_del(struct timer_wheel *tw, struct timer_wheel_entry *te);
+
+int timer_wheel_is_running(struct timer_wheel_entry *te);
+
+uint64_t timer_wheel_msec_get(struct timer_wheel *tw);
+
+uint64_t timer_wheel_phase_delay(const char *key, uint64_t now_msec,
+				 uint64_t interval_msec);
+
+void timer_wheel_stats_get(struct timer_wheel *tw,
+			   struct timer_wheel_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* TIMER_WHEEL_H_DEFINED */
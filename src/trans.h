@@ -32,12 +32,25 @@ void transport_resource_action(struct assembly *a,
 	struct resource *resource,
 	struct pe_operation *op);
 
+/*
+ * Execute the monitor operations of several resources on one assembly in a
+ * single round trip.  Each result is reported through
+ * resource_action_completed(), as for transport_resource_action().
+ */
+void transport_resource_monitor_batch(struct assembly *a,
+	struct pe_operation **ops,
+	uint32_t num_ops);
+
 void *transport_connect(struct assembly *a);
 
 void transport_disconnect(struct assembly *a);
 
 void transport_del(void *transport);
 
+/*
+ * Commands run through here are routine work, resource actions of a
+ * transition are queued ahead of them
+ */
 void
 transport_execute(void *transport,
 	void (*completion_func)(void *data, int rc),
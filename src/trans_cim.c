@@ -114,14 +114,14 @@ transport_resource_action(struct assembly *a,
     action->service = op->rtype;
 
     // TODO handle OCF resources
-    assert(strcmp(op->rclass, "lsb") == 0);
+    assert(op->rclass == intern_lsb);
 
-    if (strcmp(op->method, "monitor") == 0) {
+    if (op->method == intern_monitor) {
         action->action_func = cim_service_started;
     } else {
-        if (strcmp(op->method, "start") == 0) {
+        if (op->method == intern_start) {
             action->action_func = cim_service_start;
-        } else if (strcmp(op->method, "stop") == 0) {
+        } else if (op->method == intern_stop) {
             action->action_func = cim_service_stop;
         } else {
             assert(0);
@@ -129,7 +129,8 @@ transport_resource_action(struct assembly *a,
         }
     }
 
-    result = qb_loop_job_add(NULL, QB_LOOP_LOW, action, &perform_action);
+    result = qb_loop_job_add(NULL, cape_prio_loop_level(cape_op_prio_get(op)),
+                             action, &perform_action);
 
 done:
     if (result) {
@@ -140,3 +141,21 @@ done:
     qb_leave();
 }
 
+
+void
+transport_resource_monitor_batch(struct assembly *a,
+                                 struct pe_operation **ops,
+                                 uint32_t num_ops)
+{
+    uint32_t i;
+
+    qb_enter();
+
+    /* CIM has no way to run several services' checks in one request
+     */
+    for (i = 0; i < num_ops; i++) {
+        transport_resource_action(a, ops[i]->resource, ops[i]);
+    }
+
+    qb_leave();
+}
@@ -34,9 +34,12 @@
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
 
 #include "cape.h"
 #include "trans.h"
+#include "pool.h"
 
 /*
  * Internal global variables
@@ -74,10 +77,14 @@ struct ssh_op {
 	enum ssh_exec_state ssh_exec_state;
 	void (*completion_func) (void *data, int rc);
 	void (*timeout_func) (void *data);
+	void (*output_func) (void *data, const char *buffer, size_t len);
 	void *data;
 	LIBSSH2_CHANNEL *channel;
 	int failed;
+	enum cape_prio prio;
+	uint64_t queued;		/* nanoseconds, 0 once started */
 	char *command;
+	char command_buf[RESOURCE_COMMAND_MAX];
 	struct trans_ssh *transport;
 };
 
@@ -87,6 +94,15 @@ struct ra_op {
 	struct pe_operation *pe_op;
 };
 
+struct ra_batch {
+	struct assembly *assembly;
+	uint32_t num_ops;
+	uint64_t timeout;		/* the monitors run one after another */
+	struct pe_operation *pe_ops[MONITOR_BATCH_MAX];
+	char *output;
+	size_t output_len;
+};
+
 struct trans_ssh {
 	int fd;
 	enum ssh_state ssh_state;
@@ -96,16 +112,165 @@ struct trans_ssh {
 	struct qb_list_head ssh_op_head;
 	int scheduled;
 	qb_loop_timer_handle healthcheck_timer;
+	qb_loop_timer_handle connect_timer;
+	struct assembly *assembly;
+	int32_t poll_events;		/* registered with the loop, 0 if not */
+	enum qb_loop_priority poll_prio;
+	int poll_armed;			/* a state machine waits on the socket */
 };
 
+static struct pool ssh_op_pool = POOL_INITIALIZER("ssh_op",
+						  struct ssh_op, 32);
+
+static struct pool ra_op_pool = POOL_INITIALIZER("ra_op",
+						 struct ra_op, 32);
+
 /*
  * Internal implementation
  */
 
+/*
+ * Commands that fit are kept in the pooled ssh_op itself
+ */
+static void ssh_op_command_set(struct ssh_op *ssh_op, const char *command)
+{
+	size_t len = strlen(command);
+
+	if (len < RESOURCE_COMMAND_MAX) {
+		memcpy(ssh_op->command_buf, command, len + 1);
+		ssh_op->command = ssh_op->command_buf;
+	} else {
+		ssh_op->command = strdup(command);
+	}
+}
+
+static void ssh_op_free(struct ssh_op *ssh_op)
+{
+	if (ssh_op->command != ssh_op->command_buf) {
+		free(ssh_op->command);
+	}
+	pool_free(&ssh_op_pool, ssh_op);
+}
+
 static void assembly_healthcheck(void *data);
 
 static void assembly_ssh_exec(void *data);
 
+static void ssh_assembly_connect(void *data);
+
+static void connect_execute(void *data);
+
+static int32_t ssh_dispatch(int32_t fd, int32_t revents, void *data);
+
+/*
+ * Wait until the socket is ready, the state machine blocked on it is run
+ * again from ssh_dispatch().  The registration is kept as long as a state
+ * machine keeps waiting, so a wait in the same direction costs nothing.
+ */
+static void ssh_wait(struct trans_ssh *trans_ssh, int32_t events,
+	enum qb_loop_priority p)
+{
+	int32_t rc;
+
+	trans_ssh->poll_armed = 1;
+	if (trans_ssh->poll_events == events && trans_ssh->poll_prio == p) {
+		return;
+	}
+
+	if (trans_ssh->poll_events == 0) {
+		rc = qb_loop_poll_add(NULL, p, trans_ssh->fd, events,
+			trans_ssh, ssh_dispatch);
+	} else {
+		rc = qb_loop_poll_mod(NULL, p, trans_ssh->fd, events,
+			trans_ssh, ssh_dispatch);
+	}
+	if (rc != 0) {
+		qb_log(LOG_ERR, "can not poll ssh socket %d: %d",
+			trans_ssh->fd, rc);
+		trans_ssh->poll_events = 0;
+		return;
+	}
+	trans_ssh->poll_events = events;
+	trans_ssh->poll_prio = p;
+}
+
+static void ssh_poll_stop(struct trans_ssh *trans_ssh)
+{
+	trans_ssh->poll_armed = 0;
+	if (trans_ssh->poll_events) {
+		qb_loop_poll_del(NULL, trans_ssh->fd);
+		trans_ssh->poll_events = 0;
+	}
+}
+
+/*
+ * The direction libssh2 got LIBSSH2_ERROR_EAGAIN on
+ */
+static int32_t ssh_session_events(struct trans_ssh *trans_ssh)
+{
+	int dir = libssh2_session_block_directions(trans_ssh->session);
+	int32_t events = 0;
+
+	if (dir & LIBSSH2_SESSION_BLOCK_INBOUND) {
+		events |= POLLIN;
+	}
+	if (dir & LIBSSH2_SESSION_BLOCK_OUTBOUND) {
+		events |= POLLOUT;
+	}
+	if (events == 0) {
+		events = POLLIN;
+	}
+	return events;
+}
+
+static int32_t ssh_dispatch(int32_t fd, int32_t revents, void *data)
+{
+	struct trans_ssh *trans_ssh = (struct trans_ssh *)data;
+	struct assembly *assembly = trans_ssh->assembly;
+	struct ssh_op *ssh_op;
+
+	qb_enter();
+
+	trans_ssh->poll_armed = 0;
+
+	switch (trans_ssh->ssh_state) {
+	case SSH_SESSION_CONNECTING:
+		connect_execute(trans_ssh->assembly);
+		break;
+	case SSH_SESSION_CONNECTED:
+		if (trans_ssh->scheduled &&
+			qb_list_empty(&trans_ssh->ssh_op_head) == 0) {
+			ssh_op = qb_list_entry(trans_ssh->ssh_op_head.next,
+				struct ssh_op, list);
+			assembly_ssh_exec(ssh_op);
+		}
+		break;
+	default:
+		ssh_assembly_connect(trans_ssh->assembly);
+		break;
+	}
+
+	/*
+	 * a failure restarts the assembly right away, which frees the
+	 * transport and closes its socket
+	 */
+	if (assembly->transport != trans_ssh) {
+		qb_leave();
+		return 0;
+	}
+
+	/*
+	 * Nothing waits on the socket any more, an idle session would
+	 * otherwise wake up for every keepalive reply
+	 */
+	if (trans_ssh->poll_armed == 0) {
+		ssh_poll_stop(trans_ssh);
+	}
+
+	qb_leave();
+	return 0;
+}
+
 static void transport_schedule(struct trans_ssh *trans_ssh)
 {
 	struct ssh_op *ssh_op;
@@ -114,7 +279,8 @@ static void transport_schedule(struct trans_ssh *trans_ssh)
 		trans_ssh->scheduled = 1;
 		ssh_op = qb_list_entry(trans_ssh->ssh_op_head.next, struct ssh_op, list);
 	assert(ssh_op);
-		qb_loop_job_add(NULL, QB_LOOP_LOW, ssh_op, assembly_ssh_exec);
+		qb_loop_job_add(NULL, cape_prio_loop_level(ssh_op->prio),
+			ssh_op, assembly_ssh_exec);
 	} else {
 		trans_ssh->scheduled = 0;
 	}
@@ -128,7 +294,9 @@ static void transport_unschedule(struct trans_ssh *trans_ssh)
 		trans_ssh->scheduled = 0;
 		ssh_op = qb_list_entry(trans_ssh->ssh_op_head.next, struct ssh_op, list);
 	assert(ssh_op);
-		qb_loop_job_del(NULL, QB_LOOP_LOW, ssh_op, assembly_ssh_exec);
+		qb_loop_job_del(NULL, cape_prio_loop_level(ssh_op->prio),
+			ssh_op, assembly_ssh_exec);
+		ssh_poll_stop(trans_ssh);
 	}
 }
 
@@ -148,14 +316,14 @@ static void ssh_op_complete(struct ssh_op *ssh_op)
 	if (ssh_op->failed == 0) {
 		ssh_op->completion_func(ssh_op->data, ssh_op->ssh_rc);
 	}
-	free(ssh_op->command);
-	free(ssh_op);
+	ssh_op_free(ssh_op);
 }
 
 static void assembly_ssh_exec(void *data)
 {
 	struct ssh_op *ssh_op = (struct ssh_op *)data;
 	struct trans_ssh *trans_ssh = (struct trans_ssh *)ssh_op->transport;
+	struct assembly *assembly = trans_ssh->assembly;
 	int rc;
 	char buffer[4096];
 	ssize_t rc_read;
@@ -164,13 +332,20 @@ static void assembly_ssh_exec(void *data)
 
 	assert (trans_ssh->ssh_state == SSH_SESSION_CONNECTED);
 
+	if (ssh_op->queued) {
+		cape_queue_wait_record(ssh_op->prio,
+			(qb_util_nano_current_get() - ssh_op->queued) /
+			QB_TIME_NS_IN_USEC);
+		ssh_op->queued = 0;
+	}
+
 	switch (ssh_op->ssh_exec_state) {
 	case SSH_CHANNEL_OPEN:
 		ssh_op->channel = libssh2_channel_open_session(trans_ssh->session);
 		if (ssh_op->channel == NULL) {
 			rc = libssh2_session_last_errno(trans_ssh->session);
 			if (rc == LIBSSH2_ERROR_EAGAIN) {
-				goto job_repeat_schedule;
+				goto socket_wait;
 			}
 			qb_log(LOG_NOTICE,
 				"open session failed %d\n", rc);
@@ -186,7 +361,7 @@ static void assembly_ssh_exec(void *data)
 	case SSH_CHANNEL_EXEC:
 		rc = libssh2_channel_exec(ssh_op->channel, ssh_op->command);
 		if (rc == LIBSSH2_ERROR_EAGAIN) {
-			goto job_repeat_schedule;
+			goto socket_wait;
 		}
 		if (rc != 0) {
 			qb_log(LOG_NOTICE,
@@ -204,7 +379,7 @@ static void assembly_ssh_exec(void *data)
 	case SSH_CHANNEL_SEND_EOF:
 		rc = libssh2_channel_send_eof(ssh_op->channel);
 		if (rc == LIBSSH2_ERROR_EAGAIN) {
-			goto job_repeat_schedule;
+			goto socket_wait;
 		}
 		if (rc != 0) {
 			qb_log(LOG_NOTICE,
@@ -223,7 +398,7 @@ static void assembly_ssh_exec(void *data)
 	case SSH_CHANNEL_WAIT_EOF:
 		rc = libssh2_channel_wait_eof(ssh_op->channel);
 		if (rc == LIBSSH2_ERROR_EAGAIN) {
-			goto job_repeat_schedule;
+			goto socket_wait;
 		}
 		if (rc != 0) {
 			qb_log(LOG_NOTICE,
@@ -241,7 +416,7 @@ static void assembly_ssh_exec(void *data)
 	case SSH_CHANNEL_CLOSE:
 		rc = libssh2_channel_close(ssh_op->channel);
 		if (rc == LIBSSH2_ERROR_EAGAIN) {
-			goto job_repeat_schedule;
+			goto socket_wait;
 		}
 		if (rc != 0) {
 			qb_log(LOG_NOTICE,
@@ -258,9 +433,16 @@ static void assembly_ssh_exec(void *data)
 
 
 	case SSH_CHANNEL_READ:
-		rc_read = libssh2_channel_read(ssh_op->channel, buffer, sizeof(buffer));
+		do {
+			rc_read = libssh2_channel_read(ssh_op->channel,
+				buffer, sizeof(buffer));
+			if (rc_read > 0 && ssh_op->output_func) {
+				ssh_op->output_func(ssh_op->data,
+					buffer, rc_read);
+			}
+		} while (rc_read > 0);
 		if (rc_read == LIBSSH2_ERROR_EAGAIN) {
-			goto job_repeat_schedule;
+			goto socket_wait;
 		}
 		if (rc_read < 0) {
 			qb_log(LOG_NOTICE,
@@ -278,7 +460,7 @@ static void assembly_ssh_exec(void *data)
 	case SSH_CHANNEL_READ_STDERR:
 		rc_read = libssh2_channel_read_stderr(ssh_op->channel, buffer, sizeof(buffer));
 		if (rc_read == LIBSSH2_ERROR_EAGAIN) {
-			goto job_repeat_schedule;
+			goto socket_wait;
 		}
 		if (rc_read < 0) {
 			qb_log(LOG_NOTICE,
@@ -295,7 +477,7 @@ static void assembly_ssh_exec(void *data)
 	case SSH_CHANNEL_WAIT_CLOSED:
 		rc = libssh2_channel_wait_closed(ssh_op->channel);
 		if (rc == LIBSSH2_ERROR_EAGAIN) {
-			goto job_repeat_schedule;
+			goto socket_wait;
 		}
 		if (rc != 0) {
 			qb_log(LOG_NOTICE,
@@ -319,7 +501,7 @@ channel_free:
 	case SSH_CHANNEL_FREE:
 		rc = libssh2_channel_free(ssh_op->channel);
 		if (rc == LIBSSH2_ERROR_EAGAIN) {
-			goto job_repeat_schedule;
+			goto socket_wait;
 		}
 		if (rc != 0) {
 			qb_log(LOG_NOTICE,
@@ -334,23 +516,36 @@ channel_free:
 
 	ssh_op_complete(ssh_op);
 
+	/*
+	 * the completion may have failed and disconnected the assembly
+	 */
+	if (assembly->transport != trans_ssh) {
+		qb_leave();
+		return;
+	}
 	transport_schedule(trans_ssh);
 
 	qb_leave();
 
 	return;
 
-job_repeat_schedule:
-	assert(ssh_op);
-	qb_loop_job_add(NULL, QB_LOOP_LOW, ssh_op, assembly_ssh_exec);
+socket_wait:
+	ssh_wait(trans_ssh, ssh_session_events(trans_ssh),
+		cape_prio_loop_level(ssh_op->prio));
 
 	qb_leave();
 }
 
+/*
+ * The session is stuck, none of the queued operations will get to run.
+ * They are taken off the transport first, a timeout_func may disconnect
+ * the assembly and free it.
+ */
 static void ssh_timeout(void *data)
 {
 	struct ssh_op *ssh_op = (struct ssh_op *)data;
 	struct trans_ssh *trans_ssh = (struct trans_ssh *)ssh_op->transport;
+	struct qb_list_head timedout_head;
 	struct qb_list_head *list_temp;
 	struct qb_list_head *list;
 	struct ssh_op *ssh_op_del;
@@ -360,14 +555,30 @@ static void ssh_timeout(void *data)
 	transport_unschedule(trans_ssh);
 
 	qb_log(LOG_NOTICE, "ssh timeout for command '%s'", ssh_op->command);
+	qb_list_init(&timedout_head);
 	qb_list_for_each_safe(list, list_temp, &trans_ssh->ssh_op_head) {
 		ssh_op_del = qb_list_entry(list, struct ssh_op, list);
 		qb_loop_timer_del(NULL, ssh_op_del->ssh_timer);
 		qb_list_del(list);
-		qb_log(LOG_NOTICE, "delete ssh operation '%s'", ssh_op_del->command);
+		if (ssh_op_del->channel) {
+			libssh2_channel_free(ssh_op_del->channel);
+		}
+		if (ssh_op_del != ssh_op) {
+			qb_log(LOG_NOTICE, "delete ssh operation '%s'",
+				ssh_op_del->command);
+			qb_list_add_tail(list, &timedout_head);
+		}
 	}
 
 	ssh_op->timeout_func(ssh_op->data);
+	ssh_op_free(ssh_op);
+
+	qb_list_for_each_safe(list, list_temp, &timedout_head) {
+		ssh_op_del = qb_list_entry(list, struct ssh_op, list);
+		qb_list_del(list);
+		ssh_op_del->timeout_func(ssh_op_del->data);
+		ssh_op_free(ssh_op_del);
+	}
 
 	qb_leave();
 }
@@ -400,7 +611,10 @@ static void ssh_assembly_connect(void *data)
 	case SSH_SESSION_INIT:
 		trans_ssh->session = libssh2_session_init();
 		if (trans_ssh->session == NULL) {
-			goto job_repeat_schedule;
+			qb_loop_timer_add(NULL, QB_LOOP_LOW,
+				SSH_CONNECT_RETRY * QB_TIME_NS_IN_MSEC, assembly,
+				ssh_assembly_connect, &trans_ssh->connect_timer);
+			goto error;
 		}
 
 		libssh2_session_set_blocking(trans_ssh->session, 0);
@@ -413,7 +627,7 @@ static void ssh_assembly_connect(void *data)
 	case SSH_SESSION_STARTUP:
 		rc = libssh2_session_startup(trans_ssh->session, trans_ssh->fd);
 		if (rc == LIBSSH2_ERROR_EAGAIN) {
-			goto job_repeat_schedule;
+			goto socket_wait;
 		}
 		if (rc != 0) {
 			qb_log(LOG_NOTICE,
@@ -434,7 +648,7 @@ static void ssh_assembly_connect(void *data)
 		rc = libssh2_userauth_publickey_fromfile(trans_ssh->session,
 			"root", name_pub, name, "");
 		if (rc == LIBSSH2_ERROR_EAGAIN) {
-			goto job_repeat_schedule;
+			goto socket_wait;
 		}
 		if (rc) {
 			qb_log(LOG_ERR,
@@ -468,14 +682,19 @@ error:
 	qb_leave();
 	return;
 
-job_repeat_schedule:
-	qb_loop_job_add(NULL, QB_LOOP_LOW, assembly, ssh_assembly_connect);
+socket_wait:
+	ssh_wait(trans_ssh, ssh_session_events(trans_ssh), QB_LOOP_LOW);
 	qb_leave();
 }
 
 static void assembly_healthcheck_failed(struct assembly *assembly)
 {
-	transport_failed(assembly->transport);
+	/*
+	 * already disconnected by an earlier timeout of the same session
+	 */
+	if (assembly->transport) {
+		transport_failed(assembly->transport);
+	}
 	recover_state_set(&assembly->recover, RECOVER_STATE_FAILED);
 }
 
@@ -536,31 +755,108 @@ static void connect_execute(void *data)
 	struct assembly *assembly = (struct assembly *)data;
 	struct trans_ssh *trans_ssh = (struct trans_ssh *)assembly->transport;
 	int rc;
-	int flags;
 
 	qb_enter();
 
+	/*
+	 * The socket stays non-blocking, the session runs from the loop
+	 */
 	rc = connect(trans_ssh->fd, (struct sockaddr*)(&trans_ssh->sin),
 		sizeof (struct sockaddr_in));
-	if (rc == 0) {
-		flags = fcntl(trans_ssh->fd, F_GETFL, 0);
-		fcntl(trans_ssh->fd, F_SETFL, flags | (~O_NONBLOCK));
+	if (rc == 0 || errno == EISCONN) {
 		qb_log(LOG_NOTICE, "Connected to assembly '%s'",
 			assembly->name);
 		trans_ssh->ssh_state = SSH_SESSION_INIT;
 		qb_loop_job_add(NULL, QB_LOOP_LOW, assembly, ssh_assembly_connect);
+	} else if (errno == EINPROGRESS || errno == EALREADY) {
+		ssh_wait(trans_ssh, POLLOUT, QB_LOOP_LOW);
 	} else {
-		qb_loop_job_add(NULL, QB_LOOP_LOW, assembly, connect_execute);
+		qb_log(LOG_DEBUG, "Connection to assembly '%s' failed: %s",
+			assembly->name, strerror(errno));
+		qb_loop_timer_add(NULL, QB_LOOP_LOW,
+			SSH_CONNECT_RETRY * QB_TIME_NS_IN_MSEC, assembly,
+			connect_execute, &trans_ssh->connect_timer);
 	}
 
 	qb_leave();
 }
 
+/*
+ * Operations run one at a time per session.  A recovery operation is
+ * queued ahead of every routine one that has not started yet.
+ */
+static void ssh_op_enqueue(struct trans_ssh *trans_ssh, struct ssh_op *ssh_op)
+{
+	struct qb_list_head *list;
+	struct ssh_op *queued;
+
+	qb_list_for_each(list, &trans_ssh->ssh_op_head) {
+		if (trans_ssh->scheduled && list == trans_ssh->ssh_op_head.next) {
+			continue;
+		}
+		queued = qb_list_entry(list, struct ssh_op, list);
+		if (queued->prio > ssh_op->prio) {
+			qb_list_add_tail(&ssh_op->list, list);
+			return;
+		}
+	}
+	qb_list_add_tail(&ssh_op->list, &trans_ssh->ssh_op_head);
+}
+
+static struct ssh_op *
+ssh_op_queue(void *transport,
+	enum cape_prio prio,
+	void (*completion_func)(void *data, int ssh_rc),
+	void (*timeout_func)(void *data),
+	void (*output_func)(void *data, const char *buffer, size_t len),
+	void *data,
+	uint64_t timeout_msec,
+	const char *command)
+{
+	struct trans_ssh *trans_ssh = (struct trans_ssh *)transport;
+	struct ssh_op *ssh_op;
+
+	/*
+	 * Only execute an opperation when in the connected state
+	 */
+	if (trans_ssh == NULL ||
+		trans_ssh->ssh_state != SSH_SESSION_CONNECTED) {
+		return NULL;
+	}
+	ssh_op = pool_alloc(&ssh_op_pool);
+	ssh_op_command_set(ssh_op, command);
+
+	qb_log(LOG_NOTICE, "transport_exec command '%s'", command);
+
+	ssh_op->ssh_rc = 0;
+	ssh_op->failed = 0;
+	ssh_op->channel = NULL;
+	ssh_op->data = data;
+	ssh_op->transport = transport;
+	ssh_op->ssh_exec_state = SSH_CHANNEL_OPEN;
+	ssh_op->completion_func = completion_func;
+	ssh_op->timeout_func = timeout_func;
+	ssh_op->output_func = output_func;
+	ssh_op->prio = prio;
+	ssh_op->queued = qb_util_nano_current_get();
+	qb_list_init(&ssh_op->list);
+	ssh_op_enqueue(trans_ssh, ssh_op);
+
+	if (trans_ssh->scheduled == 0) {
+		transport_schedule(transport);
+	}
+
+	qb_loop_timer_add(NULL, QB_LOOP_LOW,
+		timeout_msec * QB_TIME_NS_IN_MSEC,
+		ssh_op, ssh_timeout, &ssh_op->ssh_timer);
+	return ssh_op;
+}
+
 static int32_t
 set_ocf_env_with_prefix(const char *key, void *value, void *user_data)
 {
 	char *buffer = (char*)user_data;
-	strcat(buffer, "OCF_RESKEY_");
+	strcat(buffer, " OCF_RESKEY_");
 	strcat(buffer, (char *)key);
 	strcat(buffer, "=");
 	strcat(buffer, (char *)value);
@@ -568,22 +864,71 @@ set_ocf_env_with_prefix(const char *key, void *value, void *user_data)
 }
 
 
+static enum ocf_exitcode
+resource_action_exitcode(struct pe_operation *pe_op, int ssh_rc)
+{
+	if (pe_op->rclass == intern_lsb) {
+		return pe_resource_ocf_exitcode_get(pe_op, ssh_rc);
+	}
+	return ssh_rc;
+}
+
+static void
+resource_command_build(struct pe_operation *pe_op, char *command, size_t len)
+{
+	char envs[RESOURCE_ENVIRONMENT_MAX];
+
+	if (pe_op->rclass == intern_lsb) {
+		/*
+		 * LSB resource class
+		 */
+		if (pe_op->method == intern_monitor) {
+			snprintf(command, len, "systemctl status %s.service",
+				pe_op->rtype);
+		} else {
+			snprintf(command, len, "systemctl %s %s.service",
+				pe_op->method, pe_op->rtype);
+		}
+		return;
+	}
+
+	/*
+	 * OCF resource class
+	 */
+	sprintf(envs, "OCF_RA_VERSION_MAJOR=1 OCF_RA_VERSION_MINOR=0 OCF_ROOT=%s", OCF_ROOT);
+
+	if (pe_op->rname) {
+		strcat(envs, " OCF_RESOURCE_INSTANCE=");
+		strcat(envs, pe_op->rname);
+	}
+
+	if (pe_op->rtype != NULL) {
+		strcat(envs, " OCF_RESOURCE_TYPE=");
+		strcat(envs, pe_op->rtype);
+	}
+
+	if (pe_op->rprovider != NULL) {
+		strcat(envs, " OCF_RESOURCE_PROVIDER=");
+		strcat(envs, pe_op->rprovider);
+	}
+	if (pe_op->params) {
+		qb_map_foreach(pe_op->params, set_ocf_env_with_prefix, envs);
+	}
+	snprintf(command, len, "%s %s/resource.d/%s/%s %s",
+		envs, OCF_ROOT, pe_op->rprovider,
+		pe_op->rtype, pe_op->method);
+}
+
 void resource_action_completion(void *data, int ssh_rc)
 {
 	struct ra_op *ra_op = (struct ra_op *)data;
-	enum ocf_exitcode pe_rc;
 
 	qb_enter();
 
-	if (strcmp(ra_op->pe_op->rclass, "lsb") == 0) {
-		pe_rc = pe_resource_ocf_exitcode_get(ra_op->pe_op, ssh_rc);
-	} else {
-		pe_rc = ssh_rc;
-	}
-
-	resource_action_completed(ra_op->pe_op, pe_rc);
+	resource_action_completed(ra_op->pe_op,
+		resource_action_exitcode(ra_op->pe_op, ssh_rc));
 	pe_resource_unref(ra_op->pe_op);
-	free(ra_op);
+	pool_free(&ra_op_pool, ra_op);
 
 	qb_leave();
 }
@@ -593,12 +938,120 @@ void resource_action_timeout(void *data)
 	struct ra_op *ra_op = (struct ra_op *)data;
 	qb_enter();
 
+	resource_action_timedout(ra_op->pe_op);
 	recover_state_set(&ra_op->assembly->recover, RECOVER_STATE_FAILED);
-	free(ra_op);
+	pe_resource_unref(ra_op->pe_op);
+	pool_free(&ra_op_pool, ra_op);
+
+	qb_leave();
+}
+
+static void resource_batch_output(void *data, const char *buffer, size_t len)
+{
+	struct ra_batch *ra_batch = (struct ra_batch *)data;
+
+	ra_batch->output = realloc(ra_batch->output,
+		ra_batch->output_len + len + 1);
+	memcpy(&ra_batch->output[ra_batch->output_len], buffer, len);
+	ra_batch->output_len += len;
+	ra_batch->output[ra_batch->output_len] = '\0';
+}
+
+static void resource_batch_free(struct ra_batch *ra_batch)
+{
+	uint32_t i;
+
+	for (i = 0; i < ra_batch->num_ops; i++) {
+		pe_resource_unref(ra_batch->pe_ops[i]);
+	}
+	free(ra_batch->output);
+	free(ra_batch);
+}
+
+/*
+ * The batch script prints one "cape_rc:<index>:<exit status>" line per
+ * monitor, a monitor without a line did not get to run.
+ */
+static void resource_batch_completion(void *data, int ssh_rc)
+{
+	struct ra_batch *ra_batch = (struct ra_batch *)data;
+	int rcs[MONITOR_BATCH_MAX];
+	enum ocf_exitcode pe_rc;
+	char *line;
+	char *save = NULL;
+	uint32_t idx;
+	int rc;
+	uint32_t i;
+
+	qb_enter();
+
+	for (i = 0; i < ra_batch->num_ops; i++) {
+		rcs[i] = -1;
+	}
+	if (ra_batch->output) {
+		for (line = strtok_r(ra_batch->output, "\n", &save); line;
+		     line = strtok_r(NULL, "\n", &save)) {
+			if (sscanf(line, "cape_rc:%u:%d", &idx, &rc) == 2 &&
+			    idx < ra_batch->num_ops) {
+				rcs[idx] = rc;
+			}
+		}
+	}
+
+	for (i = 0; i < ra_batch->num_ops; i++) {
+		if (rcs[i] < 0) {
+			qb_log(LOG_NOTICE, "no result for %s_%s_%d in batch (%d)",
+				ra_batch->pe_ops[i]->rname,
+				ra_batch->pe_ops[i]->method,
+				ra_batch->pe_ops[i]->interval, ssh_rc);
+			pe_rc = OCF_UNKNOWN_ERROR;
+		} else {
+			pe_rc = resource_action_exitcode(ra_batch->pe_ops[i],
+				rcs[i]);
+		}
+		resource_action_completed(ra_batch->pe_ops[i], pe_rc);
+	}
+	resource_batch_free(ra_batch);
 
 	qb_leave();
 }
 
+/*
+ * A hung monitor holds up the ones after it, each one is a failed
+ * monitor of its resource rather than a failure of the assembly
+ */
+static void resource_batch_timeout(void *data)
+{
+	struct ra_batch *ra_batch = (struct ra_batch *)data;
+	uint32_t i;
+
+	qb_enter();
+
+	for (i = 0; i < ra_batch->num_ops; i++) {
+		resource_action_timedout(ra_batch->pe_ops[i]);
+		resource_action_completed(ra_batch->pe_ops[i], OCF_TIMEOUT);
+	}
+	resource_batch_free(ra_batch);
+
+	qb_leave();
+}
+
+static void
+resource_batch_send(struct assembly *assembly, struct ra_batch *ra_batch,
+	const char *script)
+{
+	if (ssh_op_queue(assembly->transport,
+		CAPE_PRIO_ROUTINE,
+		resource_batch_completion,
+		resource_batch_timeout,
+		resource_batch_output,
+		ra_batch,
+		SSH_TIMEOUT + ra_batch->timeout,
+		script) == NULL) {
+		resource_batch_free(ra_batch);
+	}
+}
+
 /*
  * External API
  */
@@ -607,74 +1060,88 @@ transport_resource_action(struct assembly *assembly,
 		   struct resource *resource,
 		   struct pe_operation *pe_op)
 {
-	char envs[RESOURCE_ENVIRONMENT_MAX];
+	char command[RESOURCE_COMMAND_MAX];
 	struct ra_op *ra_op;
 
 	qb_enter();
 
-	ra_op = calloc(1, sizeof (struct ra_op));
+	ra_op = pool_alloc(&ra_op_pool);
 	ra_op->assembly = assembly;
 	ra_op->resource = resource;
 	ra_op->pe_op = pe_op;
 
 	pe_resource_ref(pe_op);
 
-	if (strcmp(pe_op->rclass, "lsb") == 0) {
-		/*
-		 * LSB resource class
-		 */
-		if (strcmp(pe_op->method, "monitor") == 0) {
-			transport_execute(
-				assembly->transport,
-				resource_action_completion,
-				resource_action_timeout,
-				ra_op,
-				SSH_TIMEOUT,
-				"systemctl status %s.service",
-				ra_op->pe_op->rtype);
-		} else {
-			transport_execute(
-				assembly->transport,
-				resource_action_completion,
-				resource_action_timeout,
-				ra_op,
-				SSH_TIMEOUT,
-				"systemctl %s %s.service",
-				ra_op->pe_op->method, ra_op->pe_op->rtype);
-		}
-	} else {
-		/*
-		 * OCF resource class
-		 */
-		sprintf(envs, "OCF_RA_VERSION_MAJOR=1 OCF_RA_VERSION_MINOR=0 OCF_ROOT=%s", OCF_ROOT);
+	resource_command_build(pe_op, command, sizeof(command));
+	if (ssh_op_queue(assembly->transport,
+		cape_op_prio_get(pe_op),
+		resource_action_completion,
+		resource_action_timeout,
+		NULL,
+		ra_op,
+		SSH_TIMEOUT,
+		command) == NULL) {
+		pe_resource_unref(pe_op);
+		pool_free(&ra_op_pool, ra_op);
+	}
 
-		if (pe_op->rname) {
-			strcat(envs, "OCF_RESOURCE_INSTANCE=");
-			strcat(envs, pe_op->rname);
-		}
+	qb_leave();
+}
 
-		if (pe_op->rtype != NULL) {
-			strcat(envs, "OCF_RESOURCE_TYPE=");
-			strcat(envs, pe_op->rtype);
-		}
+void
+transport_resource_monitor_batch(struct assembly *assembly,
+	struct pe_operation **pe_ops,
+	uint32_t num_ops)
+{
+	char command[RESOURCE_COMMAND_MAX];
+	char line[RESOURCE_COMMAND_MAX + 64];
+	char *script;
+	size_t script_len = 0;
+	size_t line_len;
+	struct ra_batch *ra_batch = NULL;
+	uint32_t i;
+
+	qb_enter();
 
-		if (pe_op->rprovider != NULL) {
-			strcat(envs, "OCF_RESOURCE_PROVIDER=");
-			strcat(envs, pe_op->rprovider);
+	script = malloc(COMMAND_MAX);
+	script[0] = '\0';
+
+	for (i = 0; i < num_ops; i++) {
+		resource_command_build(pe_ops[i], command, sizeof(command));
+
+		if (ra_batch) {
+			line_len = snprintf(line, sizeof(line),
+				"%s >/dev/null 2>&1; echo \"cape_rc:%u:$?\"; ",
+				command, ra_batch->num_ops);
+			/*
+			 * the script is full or would take too long, send
+			 * it and start another one
+			 */
+			if (script_len + line_len >= COMMAND_MAX ||
+			    ra_batch->timeout + pe_ops[i]->timeout > MONITOR_BATCH_TIMEOUT) {
+				resource_batch_send(assembly, ra_batch, script);
+				ra_batch = NULL;
+			}
 		}
-		if (pe_op->params) {
-			qb_map_foreach(pe_op->params, set_ocf_env_with_prefix, envs);
+		if (ra_batch == NULL) {
+			ra_batch = calloc(1, sizeof(struct ra_batch));
+			ra_batch->assembly = assembly;
+			script_len = 0;
+			line_len = snprintf(line, sizeof(line),
+				"%s >/dev/null 2>&1; echo \"cape_rc:%u:$?\"; ",
+				command, 0);
 		}
-		transport_execute(
-			assembly->transport,
-			resource_action_completion,
-			resource_action_timeout,
-			ra_op,
-			SSH_TIMEOUT,
-			"%s %s/resource.d/%s/%s %s )",
-			envs, OCF_ROOT, pe_op->rprovider,
-			pe_op->rtype, pe_op->method);
+
+		memcpy(&script[script_len], line, line_len + 1);
+		script_len += line_len;
+		pe_resource_ref(pe_ops[i]);
+		ra_batch->pe_ops[ra_batch->num_ops++] = pe_ops[i];
+		ra_batch->timeout += pe_ops[i]->timeout;
 	}
+	if (ra_batch) {
+		resource_batch_send(assembly, ra_batch, script);
+	}
+	free(script);
 
 	qb_leave();
 }
@@ -694,6 +1161,7 @@ transport_connect(struct assembly * a)
 	assert(ssh_init_rc == 0);
 
 	trans_ssh = calloc(1, sizeof(struct trans_ssh));
+	trans_ssh->assembly = a;
 	a->transport = trans_ssh;
 
 	hostaddr = inet_addr(a->address);
@@ -724,16 +1192,22 @@ void transport_disconnect(struct assembly *a)
 
 	qb_enter();
 
+	/*
+	 * already disconnected, e.g. restarted and then retired by a reload
+	 */
 	if (trans_ssh == NULL) {
+		qb_leave();
 		return;
 	}
 
 	qb_loop_timer_del(NULL, trans_ssh->healthcheck_timer);
+	qb_loop_timer_del(NULL, trans_ssh->connect_timer);
+	ssh_poll_stop(trans_ssh);
 
 	/*
 	 * Delete a transport connection in progress
 	 */
-	if (trans_ssh->ssh_state == SSH_SESSION_INIT) {
+	if (trans_ssh->ssh_state == SSH_SESSION_CONNECTING) {
 		qb_loop_job_del(NULL, QB_LOOP_LOW, a, connect_execute);
 	}
 
@@ -759,8 +1233,7 @@ void transport_disconnect(struct assembly *a)
 		qb_loop_timer_del(NULL, ssh_op_del->ssh_timer);
 		qb_list_del(list);
 		libssh2_channel_free(ssh_op_del->channel);
-		free(ssh_op_del->command);
-		free(ssh_op_del);
+		ssh_op_free(ssh_op_del);
 	}
 	/*
 	 * Free the SSH session associated with this transport
@@ -779,8 +1252,9 @@ void transport_disconnect(struct assembly *a)
 		break;
 	}
 
-	free(a->transport);
 	close(trans_ssh->fd);
+	free(trans_ssh);
+	a->transport = NULL;
 	qb_leave();
 }
 
@@ -793,45 +1267,16 @@ transport_execute(void *transport,
 	char *format, ...)
 {
 	va_list ap;
-	struct trans_ssh *trans_ssh = (struct trans_ssh *)transport;
-	struct ssh_op *ssh_op;
 	char ssh_command_buffer[COMMAND_MAX];
 
 	qb_enter();
 
-	assert(transport);
-	/*
-	 * Only execute an opperation when in the connected state
-	 */
-	if (trans_ssh->ssh_state != SSH_SESSION_CONNECTED) {
-		qb_leave();
-		return;
-	}
-	ssh_op = calloc(1, sizeof(struct ssh_op));
-
 	va_start(ap, format);
 	vsnprintf(ssh_command_buffer, COMMAND_MAX, format, ap);
 	va_end(ap);
-	ssh_op->command = strdup(ssh_command_buffer);
 
-	qb_log(LOG_NOTICE, "transport_exec command '%s'", ssh_command_buffer);
+	ssh_op_queue(transport, CAPE_PRIO_ROUTINE, completion_func,
+		timeout_func, NULL, data, timeout_msec, ssh_command_buffer);
 
-	ssh_op->ssh_rc = 0;
-	ssh_op->failed = 0;
-	ssh_op->data = data;
-	ssh_op->transport = transport;
-	ssh_op->ssh_exec_state = SSH_CHANNEL_OPEN;
-	ssh_op->completion_func = completion_func;
-	ssh_op->timeout_func = timeout_func;
-	qb_list_init(&ssh_op->list);
-	qb_list_add_tail(&ssh_op->list, &trans_ssh->ssh_op_head);
-
-	if (trans_ssh->scheduled == 0) {
-		transport_schedule(transport);
-	}
-
-	qb_loop_timer_add(NULL, QB_LOOP_LOW,
-		timeout_msec * QB_TIME_NS_IN_MSEC,
-		ssh_op, ssh_timeout, &ssh_op->ssh_timer);
 	qb_leave();
 }
@@ -20,6 +20,7 @@
  */
 
 #include <check.h>
+#include <sys/resource.h>
 
 #include <qb/qbdefs.h>
 #include <qb/qblog.h>
@@ -102,6 +103,10 @@ static int test_seq = RSEQ_INIT;
 static int is_node_test = 0;
 static int is_ocf_test = 0;
 static int seen_my_param = 0;
+static int is_idle_test = 0;
+static uint64_t idle_cpu_start;
+
+#define SLOW_START_MSEC 2000
 
 static void
 instance_state_detect(void *data)
@@ -155,6 +160,34 @@ log_ocf_envs(const char* key,
 	return 0;
 }
 
+static uint64_t
+cpu_usec_get(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * QB_TIME_US_IN_SEC +
+		ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+/*
+ * The transition had nothing to do but wait on the start, the
+ * loop should have been asleep rather than polling the graph.
+ */
+static void
+slow_start_completed(void *data)
+{
+	struct pe_operation *op = (struct pe_operation *)data;
+	uint64_t cpu_used = cpu_usec_get() - idle_cpu_start;
+
+	qb_log(LOG_INFO, "%"PRIu64"us of cpu used in %dms waiting on the start",
+	       cpu_used, SLOW_START_MSEC);
+	ck_assert(cpu_used < SLOW_START_MSEC * QB_TIME_US_IN_MSEC / 10);
+
+	resource_action_completed(op, OCF_OK);
+	qb_loop_stop(NULL);
+}
+
 static void resource_action_completion_cb(void *data)
 {
 	struct job_holder *j = (struct job_holder*)data;
@@ -192,6 +225,13 @@ static void resource_action_completion_cb(void *data)
 		break;
 	case RSEQ_START_1:
 		ck_assert_str_eq(j->op->method, "start");
+		if (is_idle_test) {
+			idle_cpu_start = cpu_usec_get();
+			qb_loop_timer_add(NULL, QB_LOOP_LOW,
+					  SLOW_START_MSEC * QB_TIME_NS_IN_MSEC,
+					  j->op, slow_start_completed, NULL);
+			break;
+		}
 		resource_action_completed(j->op, OCF_OK);
 		break;
 	case RSEQ_MON_REPEAT_1:
@@ -242,6 +282,18 @@ transport_resource_action(struct assembly * a,
 	qb_loop_job_add(NULL, QB_LOOP_MED, j, resource_action_completion_cb);
 }
 
+void
+transport_resource_monitor_batch(struct assembly *a,
+				 struct pe_operation **ops,
+				 uint32_t num_ops)
+{
+	uint32_t i;
+
+	for (i = 0; i < num_ops; i++) {
+		transport_resource_action(a, ops[i]->resource, ops[i]);
+	}
+}
+
 void*
 transport_connect(struct assembly * a)
 {
@@ -288,6 +340,20 @@ START_TEST(test_restart_node)
 }
 END_TEST
 
+START_TEST(test_idle_transition)
+{
+	qb_loop_t *loop = qb_loop_create();
+
+	is_node_test = 0;
+	is_idle_test = 1;
+	cape_init(1);
+
+	cape_load_from_buffer(test1_conf);
+
+	qb_loop_run(loop);
+}
+END_TEST
+
 static Suite *
 basic_suite(void)
 {
@@ -309,6 +375,11 @@ basic_suite(void)
 	tcase_set_timeout(tc, 30);
 	suite_add_tcase(s, tc);
 
+	tc = tcase_create("idle_transition");
+	tcase_add_test(tc, test_idle_transition);
+	tcase_set_timeout(tc, 20);
+	suite_add_tcase(s, tc);
+
 	return s;
 }
 
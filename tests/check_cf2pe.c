@@ -0,0 +1,349 @@
+/*
+ * Copyright (C) 2012 Red Hat, Inc.
+ *
+ * Authors: Angus Salkeld <asalkeld@redhat.com>
+ *
+ * This file is part of pacemaker-cloud.
+ *
+ * pacemaker-cloud is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * pacemaker-cloud is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pacemaker-cloud.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <check.h>
+
+#include <qb/qbdefs.h>
+#include <qb/qblog.h>
+#include <libxml/parser.h>
+#include <libxml/tree.h>
+#include <libxml/xpath.h>
+#include <libxslt/transform.h>
+#include <libxslt/xsltutils.h>
+
+#include "cf2pe.h"
+
+/*
+ * cf2pe_compile() has to give the same cib as cf2pe.xsl
+ */
+
+static const char * lsb_conf = "\
+<deployable name=\"foo\" uuid=\"123456\" monitor=\"tester\" username=\"me\">\
+  <assemblies>\
+    <assembly name=\"bar\" uuid=\"7891011\" escalation_failures=\"3\" escalation_period=\"10\">\
+      <services>\
+        <service name=\"angus\" provider=\"me\" class=\"lsb\" type=\"httpd\" monitor_interval=\"1\" escalation_period=\"-1\" escalation_failures=\"-1\">\
+	</service>\
+      </services>\
+    </assembly>\
+  </assemblies>\
+  <constraints/>\
+</deployable>\
+";
+
+static const char * ocf_conf = "\
+<deployable name=\"foo\" uuid=\"123456\" monitor=\"tester\" username=\"me\">\
+  <assemblies>\
+    <assembly name=\"bar\" uuid=\"7891011\" escalation_failures=\"3\" escalation_period=\"10\">\
+      <services>\
+        <service name=\"angus\" provider=\"heartbeat\" class=\"ocf\" type=\"Dummy\" monitor_interval=\"1\" escalation_period=\"-1\" escalation_failures=\"-1\">\
+          <parameters>\
+	    <parameter name=\"assertion\"> <value>true</value></parameter>\
+	    <parameter name=\"empty\"/>\
+          </parameters>\
+	</service>\
+        <service name=\"steve\" class=\"lsb\" type=\"mysqld\" monitor_interval=\"30s\">\
+	</service>\
+      </services>\
+    </assembly>\
+  </assemblies>\
+  <constraints/>\
+</deployable>\
+";
+
+static const char * wordpress_conf = "\
+<deployable name=\"wp\" uuid=\"abcdef\" monitor=\"tester\" username=\"me\">\
+  <assemblies>\
+    <assembly name=\"web\" uuid=\"1111\">\
+      <services>\
+        <service name=\"http\" provider=\"pacemaker-cloud\" class=\"ocf\" type=\"httpd\" monitor_interval=\"10s\">\
+          <configure_executable url=\"http://example.com/wp_config.sh\"/>\
+          <parameters>\
+	    <parameter name=\"db_ip\"><reference assembly=\"db\" parameter=\"ipaddress\"/><value></value></parameter>\
+	    <parameter name=\"user\"><value>admin</value></parameter>\
+          </parameters>\
+	</service>\
+      </services>\
+    </assembly>\
+    <assembly name=\"db\" uuid=\"2222\">\
+      <services>\
+        <service name=\"mysql\" class=\"lsb\" type=\"mysqld\" monitor_interval=\"10s\">\
+          <configure_executable url=\"http://example.com/db_config.sh\"/>\
+	</service>\
+      </services>\
+    </assembly>\
+  </assemblies>\
+  <constraints>\
+    <service_dependancy id=\"db_first\" first=\"rsc_db_mysql\" then=\"cfg_web_http\"/>\
+  </constraints>\
+</deployable>\
+";
+
+/*
+ * The stylesheet output is indented and carries its comments,
+ * neither is part of the cib.
+ */
+static void
+xml_strip(xmlNode *node)
+{
+	xmlNode *child;
+	xmlNode *next;
+
+	for (child = node->children; child; child = next) {
+		next = child->next;
+		if (child->type == XML_COMMENT_NODE ||
+		    (child->type == XML_TEXT_NODE && xmlIsBlankNode(child))) {
+			xmlUnlinkNode(child);
+			xmlFreeNode(child);
+		} else if (child->type == XML_ELEMENT_NODE) {
+			xml_strip(child);
+		}
+	}
+}
+
+/*
+ * only the cib element is compared, the stylesheet also sets the
+ * encoding of the document
+ */
+static char *
+xml_dump(xmlDocPtr doc)
+{
+	xmlBufferPtr buf = xmlBufferCreate();
+	char *res;
+
+	xmlNodeDump(buf, doc, xmlDocGetRootElement(doc), 0, 0);
+	res = strdup((char*)xmlBufferContent(buf));
+	xmlBufferFree(buf);
+	return res;
+}
+
+static void
+compare_with_xsl(const char *conf)
+{
+	xmlDocPtr config = xmlParseMemory(conf, strlen(conf));
+	xsltStylesheetPtr ss;
+	const char *params[1] = { NULL };
+	xmlDocPtr xsl_pe;
+	xmlDocPtr native_pe;
+	char *xsl_str;
+	char *native_str;
+
+	ck_assert(config != NULL);
+
+	ss = xsltParseStylesheetFile(BAD_CAST CF2PE_XSL);
+	ck_assert(ss != NULL);
+	xsl_pe = xsltApplyStylesheet(ss, config, params);
+	ck_assert(xsl_pe != NULL);
+	xml_strip(xmlDocGetRootElement(xsl_pe));
+
+	native_pe = cf2pe_compile(config, NULL, NULL);
+	ck_assert(native_pe != NULL);
+
+	xsl_str = xml_dump(xsl_pe);
+	native_str = xml_dump(native_pe);
+	if (strcmp(xsl_str, native_str) != 0) {
+		qb_log(LOG_ERR, "xsl:\n%s", xsl_str);
+		qb_log(LOG_ERR, "native:\n%s", native_str);
+	}
+	ck_assert_str_eq(xsl_str, native_str);
+
+	free(xsl_str);
+	free(native_str);
+	xmlFreeDoc(native_pe);
+	xmlFreeDoc(xsl_pe);
+	xsltFreeStylesheet(ss);
+	xmlFreeDoc(config);
+}
+
+START_TEST(test_cf2pe_lsb)
+{
+	compare_with_xsl(lsb_conf);
+}
+END_TEST
+
+START_TEST(test_cf2pe_ocf)
+{
+	compare_with_xsl(ocf_conf);
+}
+END_TEST
+
+START_TEST(test_cf2pe_configure)
+{
+	compare_with_xsl(wordpress_conf);
+}
+END_TEST
+
+static int num_assemblies;
+static int num_services;
+static int num_cfg;
+
+static void *
+_assembly(void *user_data, xmlNode *assembly_xml)
+{
+	num_assemblies++;
+	return user_data;
+}
+
+static void
+_service(void *user_data, void *assembly, xmlNode *service_xml,
+	 xmlNode *primitive_xml, xmlNode *cfg_primitive_xml)
+{
+	ck_assert(assembly == user_data);
+	ck_assert(primitive_xml != NULL);
+	num_services++;
+	if (cfg_primitive_xml) {
+		num_cfg++;
+	}
+}
+
+START_TEST(test_cf2pe_callbacks)
+{
+	struct cf2pe_ops ops = {
+		.assembly = _assembly,
+		.service = _service,
+	};
+	xmlDocPtr config = xmlParseMemory(wordpress_conf, strlen(wordpress_conf));
+	xmlDocPtr pe;
+
+	num_assemblies = num_services = num_cfg = 0;
+	pe = cf2pe_compile(config, &ops, &ops);
+	ck_assert(pe != NULL);
+	ck_assert_int_eq(num_assemblies, 2);
+	ck_assert_int_eq(num_services, 2);
+	ck_assert_int_eq(num_cfg, 2);
+
+	xmlFreeDoc(pe);
+	xmlFreeDoc(config);
+}
+END_TEST
+
+/*
+ * Set the name of the first element called elem in the deployable
+ */
+static void
+name_set(xmlDocPtr config, const char *elem, size_t len)
+{
+	xmlXPathContextPtr ctx = xmlXPathNewContext(config);
+	xmlXPathObjectPtr obj;
+	char path[64];
+	char *name = malloc(len + 1);
+
+	memset(name, 'x', len);
+	name[len] = '\0';
+	snprintf(path, sizeof(path), "//%s", elem);
+	obj = xmlXPathEvalExpression(BAD_CAST path, ctx);
+	ck_assert(obj->nodesetval && obj->nodesetval->nodeNr > 0);
+	xmlSetProp(obj->nodesetval->nodeTab[0], BAD_CAST "name", BAD_CAST name);
+	xmlXPathFreeObject(obj);
+	xmlXPathFreeContext(ctx);
+	free(name);
+}
+
+START_TEST(test_cf2pe_long_names)
+{
+	struct cf2pe_ops ops = {
+		.assembly = _assembly,
+		.service = _service,
+	};
+	xmlDocPtr config = xmlParseMemory(ocf_conf, strlen(ocf_conf));
+	xmlDocPtr pe;
+	xmlNode *resources;
+	xmlChar *id;
+
+	/*
+	 * the longest names give ids that are not cut short
+	 */
+	name_set(config, "assembly", CF2PE_NAME_MAX - 1);
+	name_set(config, "service", CF2PE_NAME_MAX - 1);
+	pe = cf2pe_compile(config, NULL, NULL);
+	ck_assert(pe != NULL);
+	resources = xmlDocGetRootElement(pe)->children->children->next->next->next;
+	ck_assert_str_eq((char*)resources->name, "resources");
+	id = xmlGetProp(resources->children, BAD_CAST "id");
+	ck_assert_int_eq(strlen((char*)id), 2 * (CF2PE_NAME_MAX - 1) + 5);
+	xmlFree(id);
+	xmlFreeDoc(pe);
+
+	/*
+	 * a name too long fails before any callback ran
+	 */
+	name_set(config, "parameter", CF2PE_NAME_MAX);
+	num_assemblies = num_services = num_cfg = 0;
+	pe = cf2pe_compile(config, &ops, &ops);
+	ck_assert(pe == NULL);
+	ck_assert_int_eq(num_assemblies, 0);
+	ck_assert_int_eq(num_services, 0);
+
+	xmlFreeDoc(config);
+}
+END_TEST
+
+static Suite *
+cf2pe_suite(void)
+{
+	TCase *tc;
+	Suite *s = suite_create("cf2pe");
+
+	tc = tcase_create("lsb");
+	tcase_add_test(tc, test_cf2pe_lsb);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("ocf");
+	tcase_add_test(tc, test_cf2pe_ocf);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("configure");
+	tcase_add_test(tc, test_cf2pe_configure);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("callbacks");
+	tcase_add_test(tc, test_cf2pe_callbacks);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("long_names");
+	tcase_add_test(tc, test_cf2pe_long_names);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
+
+int32_t main(void)
+{
+	int32_t number_failed;
+
+	Suite *s = cf2pe_suite();
+	SRunner *sr = srunner_create(s);
+
+	qb_log_init("check", LOG_USER, LOG_EMERG);
+	qb_log_ctl(QB_LOG_SYSLOG, QB_LOG_CONF_ENABLED, QB_FALSE);
+	qb_log_filter_ctl(QB_LOG_STDERR, QB_LOG_FILTER_ADD,
+			  QB_LOG_FILTER_FILE, "*", LOG_TRACE);
+	qb_log_ctl(QB_LOG_STDERR, QB_LOG_CONF_ENABLED, QB_TRUE);
+	qb_log_format_set(QB_LOG_STDERR, "[%6p] %f:%l %b");
+
+	srunner_run_all(sr, CK_VERBOSE);
+	number_failed = srunner_ntests_failed(sr);
+	srunner_free(sr);
+	return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,324 @@
+/*
+ * Copyright (C) 2012 Red Hat, Inc.
+ *
+ * Authors: Angus Salkeld <asalkeld@redhat.com>
+ *
+ * This file is part of pacemaker-cloud.
+ *
+ * pacemaker-cloud is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * pacemaker-cloud is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pacemaker-cloud.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <check.h>
+
+#include <qb/qbdefs.h>
+#include <qb/qblog.h>
+#include <qb/qbloop.h>
+#include <qb/qbutil.h>
+
+#include "cape.h"
+#include "trans.h"
+#include "inst_ctrl.h"
+
+#define NUM_ASSEMBLIES 4
+
+static struct application app;
+static struct assembly assemblies[NUM_ASSEMBLIES];
+static struct cape_cloud_limits limits;
+
+static int num_booted;
+static struct assembly *boot_order[NUM_ASSEMBLIES];
+static uint64_t boot_time[NUM_ASSEMBLIES];
+static int num_connected;
+static const char *instance_state;
+static int num_polls;
+static int num_destroyed;
+static int num_failed;
+static int num_finds;
+static int find_failures;
+
+/*
+ * fake cloud, every instance reports instance_state
+ */
+void instance_state_get(char *instance_id,
+	void (*completion_func)(char *status, char *ip_addr, void *data),
+	void *data)
+{
+	num_polls++;
+	completion_func((char *)instance_state, "10.0.0.1", data);
+}
+
+void image_id_get(const char *image_name,
+	void (*completion_func)(char *image_id, void *data),
+	void *data)
+{
+	completion_func("img", data);
+}
+
+void instance_create_from_image_id(char *image_id,
+	const char *instance_name,
+	void (*completion_func)(char *instance_id, void *data),
+	void *data)
+{
+	struct assembly *a = (struct assembly *)data;
+	char instance_id[64];
+
+	boot_time[num_booted] = qb_util_nano_current_get();
+	boot_order[num_booted++] = a;
+	snprintf(instance_id, sizeof(instance_id), "i-%s", a->name);
+	completion_func(instance_id, data);
+}
+
+void instance_find_by_name(const char *instance_name,
+	void (*completion_func)(int32_t rc, char *instance_id, void *data),
+	void *data)
+{
+	num_finds++;
+	if (find_failures > 0) {
+		find_failures--;
+		completion_func(-EIO, NULL, data);
+		return;
+	}
+	completion_func(0, NULL, data);
+}
+
+void instance_destroy_by_instance_id(char *instance_id,
+	void (*completion_func)(void *data),
+	void *data)
+{
+	num_destroyed++;
+	completion_func(data);
+}
+
+void *
+transport_connect(struct assembly *a)
+{
+	num_connected++;
+	return NULL;
+}
+
+void
+recover_state_set(struct recover *r, enum recover_state state)
+{
+	if (state == RECOVER_STATE_FAILED) {
+		num_failed++;
+	}
+}
+
+void
+cape_cloud_limits_get(struct cape_cloud_limits *l)
+{
+	*l = limits;
+}
+
+static void
+loop_stop(void *data)
+{
+	qb_loop_stop(NULL);
+}
+
+static void
+loop_run_for(uint64_t msec)
+{
+	qb_loop_timer_add(NULL, QB_LOOP_LOW, msec * QB_TIME_NS_IN_MSEC,
+			  NULL, loop_stop, NULL);
+	qb_loop_run(NULL);
+}
+
+static void
+assemblies_setup(void)
+{
+	static char names[NUM_ASSEMBLIES][8];
+	int i;
+
+	app.name = "foo";
+	for (i = 0; i < NUM_ASSEMBLIES; i++) {
+		memset(&assemblies[i], 0, sizeof(struct assembly));
+		snprintf(names[i], sizeof(names[i]), "a%d", i);
+		assemblies[i].name = names[i];
+		assemblies[i].application = &app;
+		assemblies[i].sw_instance_create = qb_util_stopwatch_create();
+		assemblies[i].sw_instance_connected = qb_util_stopwatch_create();
+	}
+	num_booted = 0;
+	num_connected = 0;
+	instance_state = "BUILD";
+	num_polls = 0;
+	num_destroyed = 0;
+	num_failed = 0;
+	num_finds = 0;
+	find_failures = 0;
+}
+
+START_TEST(test_cloud_concurrency)
+{
+	int i;
+
+	qb_loop_create();
+	assemblies_setup();
+	limits.concurrency = 2;
+	limits.rate = 0;
+	limits.burst = 1;
+
+	/*
+	 * cold starts queue behind the recovery of a0 and a1
+	 */
+	assemblies[2].adopt = QB_TRUE;
+	assemblies[3].adopt = QB_TRUE;
+	instance_create(&assemblies[2]);
+	instance_create(&assemblies[3]);
+	instance_create(&assemblies[0]);
+	instance_create(&assemblies[1]);
+
+	loop_run_for(100);
+	ck_assert_int_eq(num_booted, 2);
+	ck_assert(boot_order[0] == &assemblies[0]);
+	ck_assert(boot_order[1] == &assemblies[1]);
+
+	/*
+	 * the slots free up once the instances are active
+	 */
+	instance_state = "ACTIVE";
+	loop_run_for(2 * PENDING_TIMEOUT + 100);
+	ck_assert_int_eq(num_booted, NUM_ASSEMBLIES);
+	ck_assert_int_eq(num_connected, NUM_ASSEMBLIES);
+	for (i = 0; i < NUM_ASSEMBLIES; i++) {
+		ck_assert_int_eq(assemblies[i].cloud_slot, QB_FALSE);
+		free(assemblies[i].address);
+	}
+}
+END_TEST
+
+START_TEST(test_cloud_rate)
+{
+	qb_loop_create();
+	assemblies_setup();
+	limits.concurrency = 0;
+	limits.rate = 10;
+	limits.burst = 1;
+
+	instance_create(&assemblies[0]);
+	instance_create(&assemblies[1]);
+	instance_create(&assemblies[2]);
+
+	loop_run_for(500);
+	ck_assert_int_eq(num_booted, 3);
+	ck_assert(boot_time[2] - boot_time[0] >= 180 * QB_TIME_NS_IN_MSEC);
+}
+END_TEST
+
+START_TEST(test_cloud_find_failed)
+{
+	qb_loop_create();
+	assemblies_setup();
+	limits.concurrency = 0;
+	limits.rate = 0;
+	limits.burst = 1;
+
+	/*
+	 * a failed lookup is retried, only "no such instance" boots
+	 */
+	find_failures = 2;
+	assemblies[0].adopt = QB_TRUE;
+	instance_create(&assemblies[0]);
+
+	loop_run_for(PENDING_TIMEOUT / 2);
+	ck_assert_int_eq(num_finds, 1);
+	ck_assert_int_eq(num_booted, 0);
+
+	loop_run_for(2 * PENDING_TIMEOUT + 100);
+	ck_assert_int_eq(num_finds, 3);
+	ck_assert_int_eq(num_booted, 1);
+}
+END_TEST
+
+START_TEST(test_cloud_instance_error)
+{
+	int i;
+
+	qb_loop_create();
+	assemblies_setup();
+	limits.concurrency = 1;
+	limits.rate = 0;
+	limits.burst = 1;
+
+	/*
+	 * an instance in ERROR is destroyed and the assembly failed,
+	 * it is not polled again and gives its slot to the next boot
+	 */
+	instance_state = "ERROR";
+	instance_create(&assemblies[0]);
+	instance_create(&assemblies[1]);
+
+	loop_run_for(2 * PENDING_TIMEOUT + 100);
+	ck_assert_int_eq(num_booted, 2);
+	ck_assert_int_eq(num_polls, 2);
+	ck_assert_int_eq(num_destroyed, 2);
+	ck_assert_int_eq(num_failed, 2);
+	ck_assert_int_eq(num_connected, 0);
+	for (i = 0; i < 2; i++) {
+		ck_assert_int_eq(assemblies[i].cloud_slot, QB_FALSE);
+		ck_assert_str_eq(assemblies[i].instance_id, "");
+	}
+}
+END_TEST
+
+static Suite *
+inst_ctrl_suite(void)
+{
+	TCase *tc;
+	Suite *s = suite_create("inst_ctrl");
+
+	tc = tcase_create("concurrency");
+	tcase_add_test(tc, test_cloud_concurrency);
+	tcase_set_timeout(tc, 10);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("rate");
+	tcase_add_test(tc, test_cloud_rate);
+	tcase_set_timeout(tc, 10);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("find_failed");
+	tcase_add_test(tc, test_cloud_find_failed);
+	tcase_set_timeout(tc, 10);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("instance_error");
+	tcase_add_test(tc, test_cloud_instance_error);
+	tcase_set_timeout(tc, 10);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
+
+int32_t main(void)
+{
+	int32_t number_failed;
+
+	Suite *s = inst_ctrl_suite();
+	SRunner *sr = srunner_create(s);
+
+	qb_log_init("check", LOG_USER, LOG_EMERG);
+	qb_log_ctl(QB_LOG_SYSLOG, QB_LOG_CONF_ENABLED, QB_FALSE);
+	qb_log_filter_ctl(QB_LOG_STDERR, QB_LOG_FILTER_ADD,
+			  QB_LOG_FILTER_FILE, "*", LOG_TRACE);
+	qb_log_ctl(QB_LOG_STDERR, QB_LOG_CONF_ENABLED, QB_TRUE);
+	qb_log_format_set(QB_LOG_STDERR, "[%6p] %f:%l %b");
+
+	srunner_run_all(sr, CK_VERBOSE);
+	number_failed = srunner_ntests_failed(sr);
+	srunner_free(sr);
+	return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
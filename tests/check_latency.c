@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2012 Red Hat, Inc.
+ *
+ * Authors: Angus Salkeld <asalkeld@redhat.com>
+ *
+ * This file is part of pacemaker-cloud.
+ *
+ * pacemaker-cloud is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * pacemaker-cloud is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pacemaker-cloud.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <check.h>
+
+#include <qb/qbdefs.h>
+#include <qb/qblog.h>
+
+#include "latency.h"
+
+static struct latency_histogram h;
+
+START_TEST(test_latency_percentiles)
+{
+	uint64_t v;
+	uint64_t p;
+
+	latency_init(&h);
+	ck_assert_int_eq(latency_percentile(&h, 99), 0);
+
+	/*
+	 * 1..1000 once each
+	 */
+	for (v = 1; v <= 1000; v++) {
+		latency_record(&h, v);
+	}
+	ck_assert_int_eq(h.count, 1000);
+	ck_assert_int_eq(h.max, 1000);
+	ck_assert_int_eq(latency_mean(&h), 500);
+
+	p = latency_percentile(&h, 50);
+	ck_assert(p >= 500 && p <= 500 + 500 / LATENCY_SUB_BUCKETS);
+	p = latency_percentile(&h, 99);
+	ck_assert(p >= 990 && p <= 1000);
+	ck_assert_int_eq(latency_percentile(&h, 100), 1000);
+
+	/*
+	 * small values are exact
+	 */
+	latency_init(&h);
+	latency_record(&h, 3);
+	latency_record(&h, 5);
+	ck_assert_int_eq(latency_percentile(&h, 50), 3);
+	ck_assert_int_eq(latency_percentile(&h, 100), 5);
+}
+END_TEST
+
+START_TEST(test_latency_range)
+{
+	latency_init(&h);
+	latency_record(&h, 0);
+	latency_record(&h, UINT64_MAX);
+	ck_assert_int_eq(latency_percentile(&h, 50), 0);
+	ck_assert(latency_percentile(&h, 100) == UINT64_MAX);
+}
+END_TEST
+
+static Suite *
+latency_suite(void)
+{
+	TCase *tc;
+	Suite *s = suite_create("latency");
+
+	tc = tcase_create("percentiles");
+	tcase_add_test(tc, test_latency_percentiles);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("range");
+	tcase_add_test(tc, test_latency_range);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
+
+int32_t main(void)
+{
+	int32_t number_failed;
+
+	Suite *s = latency_suite();
+	SRunner *sr = srunner_create(s);
+
+	qb_log_init("check", LOG_USER, LOG_EMERG);
+	qb_log_ctl(QB_LOG_SYSLOG, QB_LOG_CONF_ENABLED, QB_FALSE);
+	qb_log_filter_ctl(QB_LOG_STDERR, QB_LOG_FILTER_ADD,
+			  QB_LOG_FILTER_FILE, "*", LOG_TRACE);
+	qb_log_ctl(QB_LOG_STDERR, QB_LOG_CONF_ENABLED, QB_TRUE);
+	qb_log_format_set(QB_LOG_STDERR, "[%6p] %f:%l %b");
+
+	srunner_run_all(sr, CK_VERBOSE);
+	number_failed = srunner_ntests_failed(sr);
+	srunner_free(sr);
+	return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,183 @@
+/*
+ * Copyright (C) 2012 Red Hat, Inc.
+ *
+ * Authors: Angus Salkeld <asalkeld@redhat.com>
+ *
+ * This file is part of pacemaker-cloud.
+ *
+ * pacemaker-cloud is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * pacemaker-cloud is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pacemaker-cloud.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <unistd.h>
+
+#include <libxml/parser.h>
+#include <libxml/tree.h>
+#include <qb/qbdefs.h>
+#include <qb/qblog.h>
+#include <qb/qbloop.h>
+
+#include "pe_dump.h"
+
+static char dir[] = "/tmp/pe-dump-XXXXXX";
+
+static void
+doc_submit(uint32_t transition)
+{
+	xmlDocPtr doc = xmlNewDoc(BAD_CAST "1.0");
+	xmlNodePtr cib = xmlNewNode(NULL, BAD_CAST "cib");
+	xmlNodePtr status;
+	char num[16];
+
+	xmlDocSetRootElement(doc, cib);
+	xmlNewChild(cib, NULL, BAD_CAST "configuration", NULL);
+	status = xmlNewChild(cib, NULL, BAD_CAST "status", NULL);
+	snprintf(num, sizeof(num), "%u", transition);
+	xmlNewProp(status, BAD_CAST "transition", BAD_CAST num);
+
+	ck_assert_int_eq(pe_dump_submit(doc, transition), 0);
+	xmlFreeDoc(doc);
+}
+
+static int
+dump_exists(uint32_t seq)
+{
+	char filename[PATH_MAX];
+
+	snprintf(filename, PATH_MAX, "%s/pe-input-%u.xml.gz", dir, seq);
+	return access(filename, F_OK) == 0;
+}
+
+static void
+dump_remove(uint32_t seq)
+{
+	char filename[PATH_MAX];
+
+	snprintf(filename, PATH_MAX, "%s/pe-input-%u.xml.gz", dir, seq);
+	unlink(filename);
+}
+
+START_TEST(test_pe_dump_ring)
+{
+	struct pe_dump_stats stats;
+	char filename[PATH_MAX];
+	xmlDocPtr doc;
+	xmlNodePtr status;
+	xmlChar *t;
+	uint32_t i;
+
+	qb_loop_create();
+	ck_assert(mkdtemp(dir) != NULL);
+
+	/*
+	 * at most three files are kept, the oldest go first
+	 */
+	pe_dump_config_set(dir, 3, PE_DUMP_MAX_BYTES, QB_FALSE);
+	for (i = 1; i <= 5; i++) {
+		doc_submit(i);
+	}
+	pe_dump_exit();
+
+	pe_dump_stats_get(&stats);
+	ck_assert_int_eq(stats.submitted, 5);
+	ck_assert_int_eq(stats.dropped, 0);
+	ck_assert_int_eq(stats.queued_bytes, 0);
+
+	ck_assert_int_eq(dump_exists(0), QB_FALSE);
+	ck_assert_int_eq(dump_exists(1), QB_FALSE);
+	for (i = 2; i <= 4; i++) {
+		ck_assert_int_eq(dump_exists(i), QB_TRUE);
+	}
+
+	/* compressed, libxml2 reads it back as is */
+	snprintf(filename, PATH_MAX, "%s/pe-input-%u.xml.gz", dir, 3);
+	doc = xmlReadFile(filename, NULL, 0);
+	ck_assert(doc != NULL);
+	status = xmlDocGetRootElement(doc)->children->next;
+	t = xmlGetProp(status, BAD_CAST "transition");
+	ck_assert_str_eq((char *)t, "4");
+	xmlFree(t);
+	xmlFreeDoc(doc);
+
+	/*
+	 * a new writer is started after the exit, it numbers on from
+	 * the dumps left behind and trims them as well: the byte bound
+	 * keeps only the newest
+	 */
+	pe_dump_config_set(dir, 3, 1, QB_FALSE);
+	for (i = 6; i <= 8; i++) {
+		doc_submit(i);
+	}
+	pe_dump_exit();
+
+	for (i = 0; i <= 6; i++) {
+		ck_assert_int_eq(dump_exists(i), QB_FALSE);
+	}
+	ck_assert_int_eq(dump_exists(7), QB_TRUE);
+
+	dump_remove(7);
+
+	/*
+	 * the directory is made when missing
+	 */
+	snprintf(filename, PATH_MAX, "%s/cape-foo", dir);
+	pe_dump_config_set(filename, 3, PE_DUMP_MAX_BYTES, QB_FALSE);
+	doc_submit(9);
+	pe_dump_exit();
+
+	snprintf(filename, PATH_MAX, "%s/cape-foo/pe-input-0.xml.gz", dir);
+	ck_assert_int_eq(access(filename, F_OK), 0);
+	unlink(filename);
+	snprintf(filename, PATH_MAX, "%s/cape-foo", dir);
+	rmdir(filename);
+	rmdir(dir);
+}
+END_TEST
+
+static Suite *
+pe_dump_suite(void)
+{
+	TCase *tc;
+	Suite *s = suite_create("pe_dump");
+
+	tc = tcase_create("ring");
+	tcase_add_test(tc, test_pe_dump_ring);
+	tcase_set_timeout(tc, 10);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
+
+int32_t main(void)
+{
+	int32_t number_failed;
+
+	Suite *s = pe_dump_suite();
+	SRunner *sr = srunner_create(s);
+
+	qb_log_init("check", LOG_USER, LOG_EMERG);
+	qb_log_ctl(QB_LOG_SYSLOG, QB_LOG_CONF_ENABLED, QB_FALSE);
+	qb_log_filter_ctl(QB_LOG_STDERR, QB_LOG_FILTER_ADD,
+			  QB_LOG_FILTER_FILE, "*", LOG_TRACE);
+	qb_log_ctl(QB_LOG_STDERR, QB_LOG_CONF_ENABLED, QB_TRUE);
+	qb_log_format_set(QB_LOG_STDERR, "[%6p] %f:%l %b");
+
+	srunner_run_all(sr, CK_VERBOSE);
+	number_failed = srunner_ntests_failed(sr);
+	srunner_free(sr);
+	return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,112 @@
+/*
+ * Copyright (C) 2012 Red Hat, Inc.
+ *
+ * Authors: Angus Salkeld <asalkeld@redhat.com>
+ *
+ * This file is part of pacemaker-cloud.
+ *
+ * pacemaker-cloud is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * pacemaker-cloud is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pacemaker-cloud.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <check.h>
+
+#include <qb/qbdefs.h>
+#include <qb/qblog.h>
+
+#include "pool.h"
+
+struct thing {
+	void *first;
+	int value;
+	char name[20];
+};
+
+#define NUM_THINGS 10
+
+static struct pool thing_pool = POOL_INITIALIZER("thing", struct thing, 4);
+
+START_TEST(test_pool_recycle)
+{
+	struct thing *things[NUM_THINGS];
+	struct thing *t;
+	struct pool_stats stats;
+	int i;
+
+	for (i = 0; i < NUM_THINGS; i++) {
+		things[i] = pool_alloc(&thing_pool);
+		ck_assert(things[i] != NULL);
+		ck_assert_int_eq(things[i]->value, 0);
+		things[i]->value = i + 1;
+	}
+	pool_stats_get(&thing_pool, &stats);
+	ck_assert_int_eq(stats.in_use, NUM_THINGS);
+	ck_assert_int_eq(stats.high_water, NUM_THINGS);
+	ck_assert_int_eq(stats.slabs, 3);
+	ck_assert_int_eq(stats.free, 2);
+
+	/*
+	 * the last object freed is the first one handed out again,
+	 * with everything but the first pointer left as it was
+	 */
+	pool_free(&thing_pool, things[3]);
+	t = pool_alloc(&thing_pool);
+	ck_assert(t == things[3]);
+	ck_assert_int_eq(t->value, 4);
+	ck_assert(t->first == NULL);
+
+	for (i = 0; i < NUM_THINGS; i++) {
+		pool_free(&thing_pool, things[i]);
+	}
+	pool_stats_get(&thing_pool, &stats);
+	ck_assert_int_eq(stats.in_use, 0);
+	ck_assert_int_eq(stats.free, 12);
+	ck_assert_int_eq(stats.high_water, NUM_THINGS);
+	ck_assert_int_eq(stats.allocs, NUM_THINGS + 1);
+
+	pool_stats_log();
+}
+END_TEST
+
+static Suite *
+pool_suite(void)
+{
+	TCase *tc;
+	Suite *s = suite_create("pool");
+
+	tc = tcase_create("recycle");
+	tcase_add_test(tc, test_pool_recycle);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
+
+int32_t main(void)
+{
+	int32_t number_failed;
+
+	Suite *s = pool_suite();
+	SRunner *sr = srunner_create(s);
+
+	qb_log_init("check", LOG_USER, LOG_EMERG);
+	qb_log_ctl(QB_LOG_SYSLOG, QB_LOG_CONF_ENABLED, QB_FALSE);
+	qb_log_filter_ctl(QB_LOG_STDERR, QB_LOG_FILTER_ADD,
+			  QB_LOG_FILTER_FILE, "*", LOG_TRACE);
+	qb_log_ctl(QB_LOG_STDERR, QB_LOG_CONF_ENABLED, QB_TRUE);
+	qb_log_format_set(QB_LOG_STDERR, "[%6p] %f:%l %b");
+
+	srunner_run_all(sr, CK_VERBOSE);
+	number_failed = srunner_ntests_failed(sr);
+	srunner_free(sr);
+	return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
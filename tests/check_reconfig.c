@@ -19,6 +19,9 @@
  * along with pacemaker-cloud.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
 #include <check.h>
 
 #include <qb/qbdefs.h>
@@ -58,6 +61,70 @@ static const char *test1_conf = "\
 </deployable>\
 ";
 
+/*
+ * test1_conf with a service added to "bar" and a new assembly
+ */
+static const char *reload_add_conf = "\
+<deployable name=\"foo\" uuid=\"123456\" monitor=\"tester\" username=\"me\">\
+  <assemblies>\
+    <assembly name=\"bar\" uuid=\"7891011\" escalation_failures=\"3\" escalation_period=\"10\">\
+      <services>\
+        <service name=\"angus\" provider=\"me\" class=\"lsb\" type=\"httpd\" monitor_interval=\"1\" escalation_period=\"-1\" escalation_failures=\"-1\">\
+          <configure_executable url=\"http://random.com/bla/wordpress/wordpress-http.sh\"/>\
+          <parameters>\
+            <parameter name=\"wp_name\" type=\"scalar\"><value>wordpress</value></parameter>\
+            <parameter name=\"wp_user\" type=\"scalar\"><value>wordpress</value></parameter>\
+            <parameter name=\"wp_pw\" type=\"scalar\"><value>wordpress</value></parameter>\
+            <parameter name=\"mysql_ip\" type=\"scalar\"><reference assembly=\"victim\" parameter=\"ipaddress\"/></parameter>\
+            <parameter name=\"mysql_hostname\" type=\"scalar\"><reference assembly=\"victim\" parameter=\"hostname\"/></parameter>\
+          </parameters>\
+	</service>\
+        <service name=\"steve\" provider=\"me\" class=\"lsb\" type=\"sshd\" monitor_interval=\"1\">\
+	</service>\
+      </services>\
+    </assembly>\
+    <assembly name=\"victim\" uuid=\"7891411\" escalation_failures=\"3\" escalation_period=\"10\">\
+      <services>\
+        <service name=\"andy\" provider=\"me\" class=\"lsb\" type=\"mysql\" monitor_interval=\"1\" escalation_period=\"-1\" escalation_failures=\"-1\">\
+	</service>\
+      </services>\
+    </assembly>\
+    <assembly name=\"extra\" uuid=\"7891511\">\
+      <services>\
+        <service name=\"pete\" provider=\"me\" class=\"lsb\" type=\"ntpd\" monitor_interval=\"1\">\
+	</service>\
+      </services>\
+    </assembly>\
+  </assemblies>\
+  <constraints>\
+    <service_dependancy id=\"1\" first=\"rsc_victim_andy\" then=\"rsc_bar_angus\"/>\
+  </constraints>\
+</deployable>\
+";
+
+/*
+ * the "victim" assembly and the "steve" service removed again
+ */
+static const char *reload_remove_conf = "\
+<deployable name=\"foo\" uuid=\"123456\" monitor=\"tester\" username=\"me\">\
+  <assemblies>\
+    <assembly name=\"bar\" uuid=\"7891011\" escalation_failures=\"3\" escalation_period=\"10\">\
+      <services>\
+        <service name=\"angus\" provider=\"me\" class=\"lsb\" type=\"httpd\" monitor_interval=\"1\" escalation_period=\"-1\" escalation_failures=\"-1\">\
+	</service>\
+      </services>\
+    </assembly>\
+    <assembly name=\"extra\" uuid=\"7891511\">\
+      <services>\
+        <service name=\"pete\" provider=\"me\" class=\"lsb\" type=\"ntpd\" monitor_interval=\"1\">\
+	</service>\
+      </services>\
+    </assembly>\
+  </assemblies>\
+  <constraints/>\
+</deployable>\
+";
+
 enum resource_test_seq {
 	RSEQ_INIT,
 	RSEQ_MON_0,
@@ -94,6 +161,10 @@ static int test_ip = 0;
 static int test_seq = RSEQ_INIT;
 static int is_node_test = 0;
 static int seen_my_param = 0;
+static struct assembly *created[8];
+static int num_created = 0;
+static int num_disconnected = 0;
+static int num_destroyed = 0;
 
 static void
 instance_state_detect(void *data)
@@ -109,6 +180,11 @@ instance_create(struct assembly *a)
 
 	qb_log(LOG_INFO, "starting instance (seq %d)", test_seq);
 
+	if (num_created < 8) {
+		created[num_created] = a;
+	}
+	num_created++;
+
 	snprintf(ip, 12, "1.2.3.%d", ++test_ip);
 	a->address = strdup(ip);
 
@@ -126,12 +202,14 @@ int
 instance_destroy(struct assembly *a)
 {
 	qb_log(LOG_INFO, "stopping instance");
+	num_destroyed++;
 	return 0;
 }
 
 void
 transport_disconnect(struct assembly *a)
 {
+	num_disconnected++;
 }
 
 static int32_t
@@ -231,6 +309,18 @@ transport_resource_action(struct assembly *a,
 	qb_loop_job_add(NULL, QB_LOOP_MED, j, resource_action_completion_cb);
 }
 
+void
+transport_resource_monitor_batch(struct assembly *a,
+				 struct pe_operation **ops,
+				 uint32_t num_ops)
+{
+	uint32_t i;
+
+	for (i = 0; i < num_ops; i++) {
+		transport_resource_action(a, ops[i]->resource, ops[i]);
+	}
+}
+
 void *
 transport_connect(struct assembly *a)
 {
@@ -250,7 +340,154 @@ START_TEST(test_restart_node)
 	qb_loop_run(loop);
 }
 
-END_TEST static Suite *
+END_TEST
+
+START_TEST(test_reload)
+{
+	qb_loop_t *loop = qb_loop_create();
+	struct assembly *bar;
+	struct assembly *victim;
+	struct resource *angus;
+	struct resource *cfg_angus;
+
+	cape_init(0);
+
+	ck_assert_int_eq(cape_load_from_buffer(test1_conf), 0);
+	ck_assert_int_eq(num_created, 2);
+	bar = created[0];
+	victim = created[1];
+	ck_assert_str_eq(bar->name, "bar");
+	ck_assert_str_eq(victim->name, "victim");
+	angus = qb_map_get(bar->resource_map, "rsc_bar_angus");
+	cfg_angus = qb_map_get(bar->resource_map, "cfg_bar_angus");
+	ck_assert(angus != NULL);
+	ck_assert(cfg_angus != NULL);
+
+	/*
+	 * only the new assembly is started, the others keep their objects
+	 */
+	ck_assert_int_eq(cape_load_from_buffer(reload_add_conf), 0);
+	ck_assert_int_eq(num_created, 3);
+	ck_assert_str_eq(created[2]->name, "extra");
+	ck_assert_int_eq(num_disconnected, 0);
+	ck_assert(qb_map_get(bar->resource_map, "rsc_bar_angus") == angus);
+	ck_assert(qb_map_get(bar->resource_map, "cfg_bar_angus") == cfg_angus);
+	ck_assert(qb_map_get(bar->resource_map, "rsc_bar_steve") != NULL);
+	ck_assert_int_eq(qb_map_count_get(bar->resource_map), 3);
+	ck_assert_int_eq(qb_map_count_get(cfg_angus->ref_params_map), 2);
+
+	/*
+	 * bar depends on victim, extra is on its own
+	 */
+	ck_assert_int_eq(bar->application->num_domains, 2);
+	ck_assert(bar->domain == victim->domain);
+	ck_assert(created[2]->domain != bar->domain);
+	ck_assert_int_eq(bar->domain->num_assemblies, 2);
+
+	/*
+	 * never started, so the removed resources go right away
+	 */
+	cape_load_from_buffer(reload_remove_conf);
+	ck_assert_int_eq(num_created, 3);
+	ck_assert_int_eq(num_disconnected, 1);
+	ck_assert_int_eq(victim->retired, QB_TRUE);
+	ck_assert_int_eq(bar->retired, QB_FALSE);
+	ck_assert(qb_map_get(bar->resource_map, "rsc_bar_angus") == angus);
+	ck_assert(qb_map_get(bar->resource_map, "rsc_bar_steve") == NULL);
+	ck_assert(qb_map_get(bar->resource_map, "cfg_bar_angus") == NULL);
+	ck_assert(victim->domain == NULL);
+	ck_assert_int_eq(bar->application->num_domains, 2);
+	ck_assert_int_eq(bar->domain->num_assemblies, 1);
+	ck_assert(created[2]->domain != bar->domain);
+
+	/*
+	 * a reload that does not parse is rejected, the deployable keeps
+	 * running as it was
+	 */
+	ck_assert_int_eq(cape_load_from_buffer("<deployable name=\"foo\""),
+			 -EINVAL);
+	ck_assert_int_eq(num_created, 3);
+	ck_assert_int_eq(bar->retired, QB_FALSE);
+	ck_assert(qb_map_get(bar->resource_map, "rsc_bar_angus") == angus);
+
+	qb_loop_destroy(loop);
+}
+END_TEST
+
+START_TEST(test_checkpoint)
+{
+	qb_loop_t *loop = qb_loop_create();
+	char dir[] = "/tmp/cape-checkpoint-XXXXXX";
+	char path[PATH_MAX];
+	char line[1024];
+	struct assembly *bar;
+	struct resource *angus;
+	int seen_assembly = QB_FALSE;
+	int seen_op = QB_FALSE;
+	FILE *f;
+
+	ck_assert(mkdtemp(dir) != NULL);
+	snprintf(path, PATH_MAX, "%s/foo.ckpt", dir);
+	f = fopen(path, "w");
+	ck_assert(f != NULL);
+	fprintf(f, "cape-checkpoint 1 foo 123456\n");
+	fprintf(f, "assembly bar 7891011 1 i-0042 10.0.0.7\n");
+	fprintf(f, "assembly victim 7891411 2 i-0099 10.0.0.9\n");
+	fprintf(f, "op bar rsc_bar_angus rsc_bar_angus_start_0 start 0 0 0 7 1000 1000 1 4 -\n");
+	fprintf(f, "op bar rsc_bar_angus rsc_bar_angus_monitor_1000 monitor 1000 0 0 8 1000 1000 1 5 -\n");
+	fprintf(f, "op gone rsc_gone_x rsc_gone_x_start_0 start 0 0 0 9 1000 1000 1 6 -\n");
+	fclose(f);
+
+	cape_checkpoint_dir_set(dir);
+	cape_init(0);
+
+	/*
+	 * only the one-off operation of a known resource comes back
+	 */
+	cape_load_from_buffer(test1_conf);
+	ck_assert_int_eq(num_created, 2);
+	bar = created[0];
+	ck_assert_str_eq(bar->name, "bar");
+	ck_assert_str_eq(bar->instance_id, "i-0042");
+	ck_assert_int_eq(bar->checkpoint_state, RECOVER_STATE_RUNNING);
+
+	/*
+	 * victim was failed, its instance is destroyed instead of adopted
+	 * and a new one is booted
+	 */
+	ck_assert_str_eq(created[1]->name, "victim");
+	ck_assert_int_eq(created[1]->checkpoint_state, RECOVER_STATE_FAILED);
+	ck_assert_int_eq(num_destroyed, 1);
+	ck_assert_str_eq(created[1]->instance_id, "");
+	ck_assert_int_eq(created[1]->adopt, QB_FALSE);
+	angus = qb_map_get(bar->resource_map, "rsc_bar_angus");
+	ck_assert_int_eq(qb_map_count_get(angus->op_history_map), 1);
+	ck_assert(qb_map_get(angus->op_history_map, "rsc_bar_angus_start_0") != NULL);
+
+	cape_exit();
+
+	f = fopen(path, "r");
+	ck_assert(f != NULL);
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (strncmp(line, "assembly bar 7891011 ", 21) == 0 &&
+		    strstr(line, " i-0042 ") != NULL) {
+			seen_assembly = QB_TRUE;
+		}
+		if (strncmp(line, "op bar rsc_bar_angus rsc_bar_angus_start_0 start ", 49) == 0) {
+			seen_op = QB_TRUE;
+		}
+	}
+	fclose(f);
+	ck_assert_int_eq(seen_assembly, QB_TRUE);
+	ck_assert_int_eq(seen_op, QB_TRUE);
+
+	unlink(path);
+	rmdir(dir);
+	qb_loop_destroy(loop);
+}
+END_TEST
+
+static Suite *
 reconfig_suite(void)
 {
 	TCase *tc;
@@ -261,6 +498,14 @@ reconfig_suite(void)
 	tcase_set_timeout(tc, 30);
 	suite_add_tcase(s, tc);
 
+	tc = tcase_create("reload");
+	tcase_add_test(tc, test_reload);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("checkpoint");
+	tcase_add_test(tc, test_checkpoint);
+	suite_add_tcase(s, tc);
+
 	return s;
 }
 
@@ -0,0 +1,146 @@
+/*
+ * Copyright (C) 2012 Red Hat, Inc.
+ *
+ * Authors: Angus Salkeld <asalkeld@redhat.com>
+ *
+ * This file is part of pacemaker-cloud.
+ *
+ * pacemaker-cloud is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * pacemaker-cloud is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pacemaker-cloud.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <check.h>
+
+#include <qb/qbdefs.h>
+#include <qb/qblog.h>
+#include <qb/qbloop.h>
+
+#include "timer_wheel.h"
+
+#define NUM_ENTRIES 4
+
+static struct timer_wheel tw;
+static struct timer_wheel_entry entries[NUM_ENTRIES];
+static int fired[NUM_ENTRIES];
+static int fire_order[NUM_ENTRIES];
+static int num_fired;
+
+static void
+_expired_cb(void *data, uint64_t late_msec)
+{
+	int i = (int)(intptr_t)data;
+
+	qb_log(LOG_DEBUG, "entry %d fired %"PRIu64"ms late", i, late_msec);
+
+	fired[i]++;
+	fire_order[num_fired++] = i;
+	ck_assert(late_msec < 100);
+	if (tw.stats.active == 0) {
+		qb_loop_stop(NULL);
+	}
+}
+
+START_TEST(test_timer_wheel_order)
+{
+	qb_loop_t *loop = qb_loop_create();
+	int i;
+
+	timer_wheel_init(&tw, QB_LOOP_LOW);
+	for (i = 0; i < NUM_ENTRIES; i++) {
+		timer_wheel_entry_init(&entries[i]);
+	}
+	num_fired = 0;
+
+	/*
+	 * entry 3 lands on level 1 and has to be cascaded,
+	 * entry 2 is deleted before it expires.
+	 */
+	timer_wheel_add(&tw, &entries[3], 900, _expired_cb, (void*)3);
+	timer_wheel_add(&tw, &entries[1], 120, _expired_cb, (void*)1);
+	timer_wheel_add(&tw, &entries[0], 20, _expired_cb, (void*)0);
+	timer_wheel_add(&tw, &entries[2], 300, _expired_cb, (void*)2);
+	ck_assert_int_eq(tw.stats.active, 4);
+
+	timer_wheel_del(&tw, &entries[2]);
+	ck_assert_int_eq(timer_wheel_is_running(&entries[2]), QB_FALSE);
+	ck_assert_int_eq(tw.stats.active, 3);
+
+	qb_loop_run(loop);
+
+	ck_assert_int_eq(num_fired, 3);
+	ck_assert_int_eq(fire_order[0], 0);
+	ck_assert_int_eq(fire_order[1], 1);
+	ck_assert_int_eq(fire_order[2], 3);
+	ck_assert_int_eq(fired[2], 0);
+	ck_assert_int_eq(tw.stats.fired, 3);
+}
+END_TEST
+
+START_TEST(test_timer_wheel_phase)
+{
+	uint64_t phase;
+	uint64_t d;
+	uint64_t now;
+
+	/*
+	 * deterministic: the same key always lands on the same phase
+	 * and never sooner than half an interval away.
+	 */
+	phase = timer_wheel_phase_delay("rsc_bar_angus", 0, 1000) % 1000;
+	for (now = 0; now < 5000; now += 7) {
+		d = timer_wheel_phase_delay("rsc_bar_angus", now, 1000);
+		ck_assert(d >= 500 && d <= 1500);
+		ck_assert_int_eq((now + d) % 1000, phase);
+	}
+
+	ck_assert(timer_wheel_phase_delay("rsc_victim_andy", 0, 1000) % 1000 != phase);
+}
+END_TEST
+
+static Suite *
+timer_wheel_suite(void)
+{
+	TCase *tc;
+	Suite *s = suite_create("timer_wheel");
+
+	tc = tcase_create("order");
+	tcase_add_test(tc, test_timer_wheel_order);
+	tcase_set_timeout(tc, 10);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("phase");
+	tcase_add_test(tc, test_timer_wheel_phase);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
+
+int32_t main(void)
+{
+	int32_t number_failed;
+
+	Suite *s = timer_wheel_suite();
+	SRunner *sr = srunner_create(s);
+
+	qb_log_init("check", LOG_USER, LOG_EMERG);
+	qb_log_ctl(QB_LOG_SYSLOG, QB_LOG_CONF_ENABLED, QB_FALSE);
+	qb_log_filter_ctl(QB_LOG_STDERR, QB_LOG_FILTER_ADD,
+			  QB_LOG_FILTER_FILE, "*", LOG_TRACE);
+	qb_log_ctl(QB_LOG_STDERR, QB_LOG_CONF_ENABLED, QB_TRUE);
+	qb_log_format_set(QB_LOG_STDERR, "[%6p] %f:%l %b");
+
+	srunner_run_all(sr, CK_VERBOSE);
+	number_failed = srunner_ntests_failed(sr);
+	srunner_free(sr);
+	return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
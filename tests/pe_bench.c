@@ -0,0 +1,473 @@
+/*
+ * Copyright (C) 2012 Red Hat, Inc.
+ *
+ * Authors: Angus Salkeld <asalkeld@redhat.com>
+ *
+ * This file is part of pacemaker-cloud.
+ *
+ * pacemaker-cloud is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * pacemaker-cloud is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pacemaker-cloud.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Replay policy engine inputs and report what they cost.
+ *
+ * The inputs are either the transitions cape dumps in debug mode
+ * (/tmp/cape-<name>/pe-input-<n>.xml.gz) or a deployable of N assemblies
+ * with M services each, compiled by cf2pe the way cape does it.
+ */
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <dirent.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include <glib.h>
+#include <libxml/parser.h>
+#include <crm/transition.h>
+#include <crm/pengine/status.h>
+#include <qb/qblog.h>
+
+#include "cf2pe.h"
+
+#define DEFAULT_RUNS 10
+
+extern xmlNode * do_calculations(pe_working_set_t *data_set,
+				 xmlNode *xml_input, ha_time_t *now);
+extern void cleanup_alloc_calculations(pe_working_set_t *data_set);
+extern xmlNode* get_object_root(const char *object_type, xmlNode *the_root);
+
+struct bench_result {
+	double *msec;
+	size_t graph_bytes;
+	int num_actions;
+	int num_synapses;
+	long maxrss_kb;
+};
+
+static uint64_t
+nano_current_get(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static long
+maxrss_get(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_maxrss;
+}
+
+static int
+double_cmp(const void *a, const void *b)
+{
+	double da = *(const double *)a;
+	double db = *(const double *)b;
+
+	return (da > db) - (da < db);
+}
+
+/*
+ * the dumps are numbered in transition order, pe-input-9 runs before
+ * pe-input-10; other inputs follow by name
+ */
+static int
+input_cmp(const void *a, const void *b)
+{
+	const char *na = *(char * const *)a;
+	const char *nb = *(char * const *)b;
+	unsigned int seq_a;
+	unsigned int seq_b;
+	int has_a = (sscanf(na, "pe-input-%u", &seq_a) == 1);
+	int has_b = (sscanf(nb, "pe-input-%u", &seq_b) == 1);
+
+	if (has_a && has_b && seq_a != seq_b) {
+		return (seq_a > seq_b) - (seq_a < seq_b);
+	}
+	if (has_a != has_b) {
+		return has_b - has_a;
+	}
+	return strcmp(na, nb);
+}
+
+/*
+ * nearest rank on sorted samples
+ */
+static double
+percentile_get(double *sorted, int n, int percent)
+{
+	int rank = (n * percent + 99) / 100;
+
+	if (rank < 1) {
+		rank = 1;
+	}
+	return sorted[rank - 1];
+}
+
+/*
+ * Each run gets its own copy of the input, the calculations hang on to
+ * (and modify) the document they were given.
+ */
+static int
+bench_run(xmlNode *cib, int runs, struct bench_result *res)
+{
+	pe_working_set_t data_set;
+	xmlNode *input;
+	crm_graph_t *graph;
+	char *graph_str;
+	uint64_t start;
+	int i;
+
+	for (i = 0; i < runs; i++) {
+		input = copy_xml(cib);
+
+		start = nano_current_get();
+		set_working_set_defaults(&data_set);
+		do_calculations(&data_set, input, NULL);
+		res->msec[i] = (nano_current_get() - start) / 1000000.0;
+
+		if (data_set.graph == NULL) {
+			data_set.input = NULL;
+			cleanup_alloc_calculations(&data_set);
+			free_xml(input);
+			return -1;
+		}
+		if (i == 0) {
+			graph_str = dump_xml_unformatted(data_set.graph);
+			res->graph_bytes = strlen(graph_str);
+			crm_free(graph_str);
+
+			graph = unpack_graph(data_set.graph, __func__);
+			res->num_actions = graph->num_actions;
+			res->num_synapses = graph->num_synapses;
+			destroy_graph(graph);
+		}
+
+		data_set.input = NULL;
+		cleanup_alloc_calculations(&data_set);
+		free_xml(input);
+	}
+	res->maxrss_kb = maxrss_get();
+	return 0;
+}
+
+static void
+bench_report(const char *name, int runs, struct bench_result *res)
+{
+	qsort(res->msec, runs, sizeof(double), double_cmp);
+	printf("%-32s runs:%d time(ms) min:%.2f median:%.2f p99:%.2f"
+	       " graph:%zu bytes actions:%d synapses:%d maxrss:%ld KB\n",
+	       name, runs, res->msec[0], percentile_get(res->msec, runs, 50),
+	       percentile_get(res->msec, runs, 99), res->graph_bytes,
+	       res->num_actions, res->num_synapses, res->maxrss_kb);
+	fflush(stdout);
+}
+
+static int
+bench_cib(const char *name, xmlNode *cib, int runs)
+{
+	struct bench_result res;
+	int rc;
+
+	memset(&res, 0, sizeof(res));
+	res.msec = calloc(runs, sizeof(double));
+
+	rc = bench_run(cib, runs, &res);
+	if (rc == 0) {
+		bench_report(name, runs, &res);
+	} else {
+		fprintf(stderr, "%s: no transition graph calculated\n", name);
+	}
+	free(res.msec);
+	return rc;
+}
+
+static int
+bench_file(const char *filename, int runs)
+{
+	xmlNode *cib = filename2xml(filename);
+	const char *name = strrchr(filename, '/');
+	int rc;
+
+	if (cib == NULL) {
+		fprintf(stderr, "Could not parse %s\n", filename);
+		return -1;
+	}
+	if (get_object_root(XML_CIB_TAG_STATUS, cib) == NULL) {
+		create_xml_node(cib, XML_CIB_TAG_STATUS);
+	}
+	if (cli_config_update(&cib, NULL, FALSE) == FALSE ||
+	    validate_xml(cib, NULL, FALSE) != TRUE) {
+		fprintf(stderr, "%s is not a valid cib\n", filename);
+		free_xml(cib);
+		return -1;
+	}
+
+	rc = bench_cib(name ? name + 1 : filename, cib, runs);
+	free_xml(cib);
+	return rc;
+}
+
+/*
+ * ru_maxrss only ever grows, each input file is replayed in a process of
+ * its own so the maxrss reported for it is its own
+ */
+static int
+bench_file_isolated(const char *filename, int runs)
+{
+	pid_t pid;
+	int status;
+
+	fflush(stdout);
+	pid = fork();
+	if (pid == 0) {
+		exit(bench_file(filename, runs) == 0 ? EXIT_SUCCESS :
+		     EXIT_FAILURE);
+	}
+	if (pid < 0) {
+		perror("fork");
+		return -1;
+	}
+	if (waitpid(pid, &status, 0) < 0 ||
+	    !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+		return -1;
+	}
+	return 0;
+}
+
+static int
+bench_dir(const char *dirname, int runs)
+{
+	DIR *dir = opendir(dirname);
+	struct dirent *de;
+	char **names = NULL;
+	size_t num_names = 0;
+	size_t len;
+	size_t i;
+	char path[PATH_MAX];
+	int failed = 0;
+
+	if (dir == NULL) {
+		perror(dirname);
+		return -1;
+	}
+	while ((de = readdir(dir)) != NULL) {
+		len = strlen(de->d_name);
+		/* libxml2 reads the compressed dumps as they are */
+		if ((len < 4 || strcmp(de->d_name + len - 4, ".xml") != 0) &&
+		    (len < 7 || strcmp(de->d_name + len - 7, ".xml.gz") != 0)) {
+			continue;
+		}
+		names = realloc(names, (num_names + 1) * sizeof(char *));
+		names[num_names++] = strdup(de->d_name);
+	}
+	closedir(dir);
+
+	qsort(names, num_names, sizeof(char *), input_cmp);
+	for (i = 0; i < num_names; i++) {
+		snprintf(path, PATH_MAX, "%s/%s", dirname, names[i]);
+		if (bench_file_isolated(path, runs) != 0) {
+			failed++;
+		}
+		free(names[i]);
+	}
+	free(names);
+	return failed ? -1 : 0;
+}
+
+/*
+ * A deployable like the ones cape is given, with every assembly up
+ * and nothing run yet: the graph probes and starts everything.
+ */
+static xmlDocPtr
+deployable_generate(int num_assemblies, int num_services)
+{
+	xmlDocPtr config = xmlNewDoc(BAD_CAST "1.0");
+	xmlNode *dep;
+	xmlNode *assemblies;
+	xmlNode *assembly;
+	xmlNode *services;
+	xmlNode *service;
+	char buf[64];
+	int a;
+	int s;
+
+	dep = xmlNewDocNode(config, NULL, BAD_CAST "deployable", NULL);
+	xmlDocSetRootElement(config, dep);
+	xmlNewProp(dep, BAD_CAST "name", BAD_CAST "bench");
+	xmlNewProp(dep, BAD_CAST "uuid", BAD_CAST "1");
+
+	assemblies = xmlNewChild(dep, NULL, BAD_CAST "assemblies", NULL);
+	for (a = 0; a < num_assemblies; a++) {
+		assembly = xmlNewChild(assemblies, NULL, BAD_CAST "assembly", NULL);
+		snprintf(buf, sizeof(buf), "ass%d", a);
+		xmlNewProp(assembly, BAD_CAST "name", BAD_CAST buf);
+		snprintf(buf, sizeof(buf), "%d", 1000 + a);
+		xmlNewProp(assembly, BAD_CAST "uuid", BAD_CAST buf);
+
+		services = xmlNewChild(assembly, NULL, BAD_CAST "services", NULL);
+		for (s = 0; s < num_services; s++) {
+			service = xmlNewChild(services, NULL, BAD_CAST "service", NULL);
+			snprintf(buf, sizeof(buf), "svc%d", s);
+			xmlNewProp(service, BAD_CAST "name", BAD_CAST buf);
+			xmlNewProp(service, BAD_CAST "class", BAD_CAST "lsb");
+			xmlNewProp(service, BAD_CAST "type", BAD_CAST "httpd");
+			xmlNewProp(service, BAD_CAST "monitor_interval", BAD_CAST "10");
+		}
+	}
+	xmlNewChild(dep, NULL, BAD_CAST "constraints", NULL);
+
+	return config;
+}
+
+static int
+bench_synthetic(int num_assemblies, int num_services, int runs)
+{
+	xmlDocPtr config = deployable_generate(num_assemblies, num_services);
+	xmlDocPtr pe = cf2pe_compile(config, NULL, NULL);
+	xmlNode *status;
+	xmlNode *node_state;
+	xmlNode *lrm;
+	char name[64];
+	char buf[64];
+	int a;
+	int rc;
+
+	status = xmlNewChild(xmlDocGetRootElement(pe), NULL, BAD_CAST "status", NULL);
+	for (a = 0; a < num_assemblies; a++) {
+		node_state = xmlNewChild(status, NULL, BAD_CAST "node_state", NULL);
+		snprintf(buf, sizeof(buf), "%d", 1000 + a);
+		xmlNewProp(node_state, BAD_CAST "id", BAD_CAST buf);
+		snprintf(buf, sizeof(buf), "ass%d", a);
+		xmlNewProp(node_state, BAD_CAST "uname", BAD_CAST buf);
+		xmlNewProp(node_state, BAD_CAST "ha", BAD_CAST "active");
+		xmlNewProp(node_state, BAD_CAST "expected", BAD_CAST "member");
+		xmlNewProp(node_state, BAD_CAST "in_ccm", BAD_CAST "true");
+		xmlNewProp(node_state, BAD_CAST "crmd", BAD_CAST "online");
+		xmlNewProp(node_state, BAD_CAST "join", BAD_CAST "member");
+		lrm = xmlNewChild(node_state, NULL, BAD_CAST "lrm", NULL);
+		xmlNewChild(lrm, NULL, BAD_CAST "lrm_resources", NULL);
+	}
+
+	snprintf(name, sizeof(name), "synthetic-%dx%d",
+		 num_assemblies, num_services);
+	rc = bench_cib(name, xmlDocGetRootElement(pe), runs);
+
+	xmlFreeDoc(pe);
+	xmlFreeDoc(config);
+	return rc;
+}
+
+static void
+show_usage(const char *name)
+{
+	printf("usage: \n");
+	printf("%s <options>\n", name);
+	printf("\n");
+	printf("  options:\n");
+	printf("\n");
+	printf("  -x <file>      replay one policy engine input\n");
+	printf("  -d <dir>       replay every *.xml(.gz) input in a directory\n");
+	printf("  -s <N>x<M>     generate N assemblies of M services each\n");
+	printf("  -n <runs>      runs per input (default %d)\n", DEFAULT_RUNS);
+	printf("  -h             show this help text\n");
+	printf("\n");
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *options = "hx:d:s:n:";
+	const char *xml_file = NULL;
+	const char *xml_dir = NULL;
+	int num_assemblies = 0;
+	int num_services = 0;
+	int runs = DEFAULT_RUNS;
+	int32_t opt;
+	int rc = 0;
+
+	/* disable glib's fancy allocators that can't be free'd */
+	GMemVTable vtable;
+
+	vtable.malloc = malloc;
+	vtable.realloc = realloc;
+	vtable.free = free;
+	vtable.calloc = calloc;
+	vtable.try_malloc = malloc;
+	vtable.try_realloc = realloc;
+
+	g_mem_set_vtable(&vtable);
+
+	while ((opt = getopt(argc, argv, options)) != -1) {
+		switch (opt) {
+		case 'x':
+			xml_file = optarg;
+			break;
+		case 'd':
+			xml_dir = optarg;
+			break;
+		case 's':
+			if (sscanf(optarg, "%dx%d", &num_assemblies,
+				   &num_services) != 2 ||
+			    num_assemblies <= 0 || num_services <= 0) {
+				show_usage(argv[0]);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'n':
+			runs = atoi(optarg);
+			break;
+		case 'h':
+		default:
+			show_usage(argv[0]);
+			exit(0);
+			break;
+		}
+	}
+	if ((xml_file == NULL && xml_dir == NULL && num_assemblies == 0) ||
+	    runs <= 0) {
+		show_usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	crm_log_init_quiet(NULL, LOG_CRIT, FALSE, FALSE, argc, argv);
+	qb_log_init("pe_bench", LOG_USER, LOG_EMERG);
+	qb_log_ctl(QB_LOG_SYSLOG, QB_LOG_CONF_ENABLED, QB_FALSE);
+
+	if (xml_file && bench_file_isolated(xml_file, runs) != 0) {
+		rc = EXIT_FAILURE;
+	}
+	if (xml_dir && bench_dir(xml_dir, runs) != 0) {
+		rc = EXIT_FAILURE;
+	}
+	if (num_assemblies &&
+	    bench_synthetic(num_assemblies, num_services, runs) != 0) {
+		rc = EXIT_FAILURE;
+	}
+
+	qb_log_fini();
+	crm_log_deinit();
+	return rc;
+}
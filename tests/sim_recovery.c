@@ -51,6 +51,17 @@ void transport_resource_action(struct assembly *a,
 	return;
 }
 
+void transport_resource_monitor_batch(struct assembly *a,
+	struct pe_operation **ops,
+	uint32_t num_ops)
+{
+	uint32_t i;
+
+	for (i = 0; i < num_ops; i++) {
+		transport_resource_action(a, ops[i]->resource, ops[i]);
+	}
+}
+
 void *transport_connect(struct assembly *a)
 {
 	qb_enter();